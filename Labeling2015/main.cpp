@@ -13,9 +13,27 @@
 #include <list>
 #include <map>
 #include <array>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+#include <fstream>
+#include <numeric>
+#include <cmath>
+
+#ifdef _WIN32
+#	define WIN32_LEAN_AND_MEAN
+#	include <windows.h>
+#	undef min
+#	undef max
+#endif
 
 #include "src/LabelingTools.hpp"
 #include "src/LabelingAlgs.hpp"
+#include "src/SyntheticImages.hpp"
 
 ///////////////////////////////////////////////////////////////////////////////
 
@@ -25,6 +43,102 @@ using namespace std;
 
 ///////////////////////////////////////////////////////////////////////////////
 
+// Writes per phase profiles of labeled images as CSV (one row per phase) or JSON (one object per image)
+class ProfileWriter
+{
+public:
+	ProfileWriter(const std::string &fileName) 
+		: out(fileName), json(path(fileName).extension().string() == ".json")
+	{
+		THROW_IF(!out, "Cannot open profile output file");
+
+		out << (json ? "[" : "image,algorithm,device,width,height,total_us,end_to_end_us,iterations,phase,time_us,runs,bytes\n");
+	}
+
+	~ProfileWriter(void) 
+	{ 
+		if (json) out << (first ? "]\n" : "\n]\n"); 
+	}
+
+	void Write(const std::string &image, const std::string &alg, const std::string &device, const TImage &img, const TProfile &profile)
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+
+		const int width = img.dims == 2 ? img.cols : img.size[0], height = img.dims == 2 ? img.rows : img.size[1];
+
+		if (!json)
+		{
+			for (auto &phase : profile.phases)
+				out << '"' << image << "\"," << alg << ',' << device << ',' << width << ',' << height << ',' << profile.total << ',' << profile.endToEnd << ','
+					<< profile.iterations << ',' << phase.name << ',' << phase.time << ',' << phase.runs << ',' << phase.bytes << '\n';
+			return;
+		}
+
+		out << (first ? "\n" : ",\n") << "  {\"image\": \"" << Escape(image) << "\", \"algorithm\": \"" << alg 
+			<< "\", \"device\": \"" << device << "\", \"width\": " << width << ", \"height\": " << height 
+			<< ", \"total_us\": " << profile.total << ", \"end_to_end_us\": " << profile.endToEnd << ", \"iterations\": " << profile.iterations << ", \"phases\": [";
+
+		for (size_t i = 0; i < profile.phases.size(); ++i)
+		{
+			auto &phase = profile.phases[i];
+			out << (i ? ", " : "") << "{\"name\": \"" << phase.name << "\", \"time_us\": " << phase.time 
+				<< ", \"runs\": " << phase.runs << ", \"bytes\": " << phase.bytes << "}";
+		}
+
+		out << "]}";
+		first = false;
+	}
+
+private:
+	std::ofstream out;
+	const bool json;
+	bool first = true;
+	std::mutex mtx;
+
+	static std::string Escape(const std::string &str)
+	{
+		std::string res;
+
+		for (char c : str)
+		{
+			if (c == '"' || c == '\\') res += '\\';
+			res += c;
+		}
+
+		return res;
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Writes component stats of labeled images as CSV (one row per component)
+class StatsWriter
+{
+public:
+	StatsWriter(const std::string &fileName) 
+		: out(fileName)
+	{
+		THROW_IF(!out, "Cannot open stats output file");
+
+		out << "image,label,area,left,top,width,height,centroid_x,centroid_y\n";
+	}
+
+	void Write(const std::string &image, const TStats &stats)
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+
+		for (auto &st : stats)
+			out << '"' << image << "\"," << st.label << ',' << st.area << ',' << st.bbox.x << ',' << st.bbox.y << ','
+				<< st.bbox.width << ',' << st.bbox.height << ',' << st.centroid.x << ',' << st.centroid.y << '\n';
+	}
+
+private:
+	std::ofstream out;
+	std::mutex mtx;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
 struct Options
 {
 	std::string inPath;
@@ -32,38 +146,117 @@ struct Options
 
 	int numThreads = MAX_THREADS;
 	int cycles = 1;
+	int syncInterval = 1;
 
+	std::string algName;
 	std::shared_ptr<ILabeling> labelingAlg;
 
 	enum {OCL_NO, OCL_CPU, OCL_GPU} useOCL = OCL_NO;
 	TCoherence coh = COH_DEFAULT;
 	bool label3D = false;
+	bool binaryInput = false;
+	bool packedInput = false;	// Images are bit packed before labeling
+	bool checkRuns = false;		// Images are labeled into runs too and checked against labels
+	bool checkMask = false;		// Images are encoded into run masks, labeled and checked against labels
+	bool batchMode = false;
+	int decoders = 0;		// Pipeline mode if not 0
+	int encoders = 0;
+	bool concurrent = false;	// Several images at once
+	bool printProfile = false;
+	bool compact = false;		// Labels are renumbered to 1..N
+	std::shared_ptr<ProfileWriter> profileOut;
+	std::shared_ptr<StatsWriter> statsOut;
+	std::string benchOut;		// Synthetic benchmark mode if not empty
+	uint seed = 1;
+	std::string scalingOut;		// Thread scaling sweep if not empty
 	bool quickExit = false;
 };
 
 ///////////////////////////////////////////////////////////////////////////////
 
+// HDR style histogram of times in us: exact below 128 us, then 64 linear buckets per power of two,
+// so percentiles are within 1.6% and merging is adding counts
+class LatencyHistogram
+{
+public:
+	void Reset(void) { counts.clear(); total = 0; }
+
+	void Add(TTime t) {
+		size_t idx = Index(t);
+		if (idx >= counts.size()) counts.resize(idx + 1, 0);
+		++counts[idx];
+		++total;
+	}
+
+	LatencyHistogram& operator+=(const LatencyHistogram& other) {
+		if (counts.size() < other.counts.size()) counts.resize(other.counts.size(), 0);
+		for (size_t i = 0; i < other.counts.size(); ++i) counts[i] += other.counts[i];
+		total += other.total;
+
+		return *this;
+	}
+
+	// Highest time of the bucket holding the p-th percentile (p in [0, 100])
+	TTime Percentile(double p) const {
+		uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(p / 100 * total))), seen = 0;
+
+		for (size_t i = 0; i < counts.size(); ++i)
+			if ((seen += counts[i]) >= rank) 
+				return Highest(i);
+
+		return 0;
+	}
+
+private:
+	enum { SUB_BITS = 6, SUB_COUNT = 1 << SUB_BITS };
+
+	std::vector<uint64_t> counts;
+	uint64_t total = 0;
+
+	static int Msb(TTime t) { int msb = 0; while (t >>= 1) ++msb; return msb; }
+
+	static size_t Index(TTime t) {
+		if (t < 2 * SUB_COUNT) return t;
+		int shift = Msb(t) - SUB_BITS;
+		return 2 * SUB_COUNT + (shift - 1) * SUB_COUNT + ((t >> shift) - SUB_COUNT);
+	}
+
+	static TTime Highest(size_t idx) {
+		if (idx < 2 * SUB_COUNT) return static_cast<TTime>(idx);
+		int shift = static_cast<int>((idx - 2 * SUB_COUNT) / SUB_COUNT) + 1;
+		uint64_t sub = (idx - 2 * SUB_COUNT) % SUB_COUNT + SUB_COUNT;
+		return static_cast<TTime>(std::min<uint64_t>(((sub + 1) << shift) - 1, UINT_MAX));
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
 struct ImgTime
 {	
-	void Reset(void) { min = UINT_MAX; c = avg = max = 0; }	
+	void Reset(void) { min = UINT_MAX; max = 0; sum = 0; c = 0; hist.Reset(); }	
 	
 	TTime Min(void) const { return min != UINT_MAX ? min : 0; }
 	TTime Max(void) const { return max; }
-	TTime Avg(void) const { return c ? static_cast<float>(avg) / c : 0; }
+	TTime Avg(void) const { return c ? static_cast<TTime>(sum / c) : 0; }
+	size_t Count(void) const { return c; }
+
+	// Percentiles are clamped to min and max since histogram buckets are wider than one us
+	TTime Percentile(double p) const { return c ? std::min(std::max(hist.Percentile(p), Min()), max) : 0; }
 	
 	void Add(TTime t) {
-		if (UINT_MAX - avg < t) CompressData();
 		if (min > t) min = t;
 		if (max < t) max = t;
-		avg += t;
+		sum += t;
 		++c;
+		hist.Add(t);
 	}
 	
 	ImgTime& operator+(const ImgTime& other) {
-		this->avg += other.avg;
+		this->sum += other.sum;
 		this->min = std::min(this->min, other.min);
 		this->max = std::max(this->max, other.max);
 		this->c += other.c;
+		this->hist += other.hist;
 
 		return *this;
 	}
@@ -74,17 +267,25 @@ struct ImgTime
 	ImgTime(void) { Reset(); }
 
 private:
-	TTime min, avg, max;
+	TTime min, max;
+	uint64_t sum;
 	size_t c = 0;
-
-	void CompressData(void) {
-		avg /= c;
-		c = 1;
-	}
+	LatencyHistogram hist;
 };
 
 ///////////////////////////////////////////////////////////////////////////////
 
+std::string Percentiles(const ImgTime &time)
+{
+	std::stringstream str;
+	str << "p50 = " << float(time.Percentile(50)) / 1000 << " ms, p90 = " << float(time.Percentile(90)) / 1000 
+		<< " ms, p99 = " << float(time.Percentile(99)) / 1000 << " ms, p99.9 = " << float(time.Percentile(99.9)) / 1000 << " ms";
+
+	return str.str();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
 struct Algs
 {
 	const std::string descr;
@@ -111,18 +312,24 @@ void InitAlgs(void)
 	ALG_LIST.emplace(std::string("gr-block"), Algs{ "Block labeling by Grana et.al. 2010", 
 												&std::make_shared<TBlockGranaLabeling>, 
 												nullptr, nullptr, nullptr });
+	ALG_LIST.emplace(std::string("gr-uf"), Algs{ "Block labeling by Grana et.al. 2010 with union-find", 
+												[]{ return std::make_shared<TBlockGranaLabeling>(true); }, 
+												nullptr, nullptr, nullptr });
 	ALG_LIST.emplace(std::string("ocv"), Algs{ "OpenCV labeling", 
 												&std::make_shared<TOpenCVLabeling>, 
 												nullptr, nullptr, nullptr });
 	ALG_LIST.emplace(std::string("lbeq"), Algs{ "Label equivalence by Kalentev et.al. 2012", 
 												&std::make_shared<TLabelDistribution>, 
 												&std::make_shared<TOCLLabelDistribution, bool>, 
-												nullptr, 
+												&std::make_shared<TLabelEquivalence3D>, 
 												&std::make_shared<TOCLLabelEquivalence3D, bool> });
+	ALG_LIST.emplace(std::string("lbuf"), Algs{ "Label equivalence by lock-free union-find",
+												&std::make_shared<TLabelUnionFind>,
+												nullptr, nullptr, nullptr });
 	ALG_LIST.emplace(std::string("bleq"), Algs{ "Block equivalence by Zavalishin et.al. 2016", 
 												&std::make_shared<TLabelEquivalenceX2>, 
 												std::make_shared<TOCLLabelEquivalenceX2, bool>, 
-												nullptr, 
+												&std::make_shared<TBlockEquivalence3D>, 
 												std::make_shared<TOCLBlockEquivalence3D, bool> });
 	ALG_LIST.emplace(std::string("runeq"), Algs{ "Run equivalence by Bekhtin et.al. 2015", 
 												&std::make_shared<TRunEqivLabeling>, 
@@ -153,23 +360,123 @@ std::list<std::string> FindFiles(const std::string &path)
 
 ///////////////////////////////////////////////////////////////////////////////
 
-TImage ProcessImage(const TImage &inImg, const Options& opts, ImgTime& time)
+void ReportProfile(const std::string &image, const TImage &img, const ILabeling &alg, const Options &opts)
+{
+	const TProfile &profile = alg.Profile();
+
+	if (opts.printProfile)
+	{
+		for (auto &phase : profile.phases)
+			cout << "  " << setw(16) << left << phase.name << right << setw(10) << static_cast<float>(phase.time) / 1000 << " ms "
+				 << setw(6) << phase.runs << " runs " << setw(10) << static_cast<float>(phase.bytes) / (1 << 20) << " MB\n" << left;
+
+		if (profile.iterations)
+			cout << "  Iterations: " << profile.iterations << "\n";
+
+		if (profile.endToEnd)
+			cout << "  End-to-end: " << static_cast<float>(profile.endToEnd) / 1000 << " ms\n";
+
+		if (alg.Compaction())
+			cout << "  Labels: " << alg.LabelCount() << "\n";
+	}
+
+	if (opts.profileOut)
+	{
+		const char *device = opts.useOCL == Options::OCL_GPU ? "ocl-gpu" : opts.useOCL == Options::OCL_CPU ? "ocl-cpu" : "cpu";
+		opts.profileOut->Write(image, opts.algName, device, img, profile);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Runs must cover the same pixels and their labels must map one to one, since algorithms number components differently
+bool SameRuns(const TLabelRuns &a, const TLabelRuns &b)
+{
+	if (a.size() != b.size())
+		return false;
+
+	std::map<TLabel, TLabel> ab, ba;
+
+	for (size_t i = 0; i < a.size(); ++i)
+	{
+		if (a[i].row != b[i].row || a[i].l != b[i].l || a[i].r != b[i].r)
+			return false;
+
+		if (ab.emplace(a[i].label, b[i].label).first->second != b[i].label ||
+			ba.emplace(b[i].label, a[i].label).first->second != a[i].label)
+			return false;
+	}
+
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Component stats of the last cycle go to stats if it's given, every cycle is timed with stats then
+TImage ProcessImage(const TImage &inImg, const Options& opts, ImgTime& time, TStats *stats = nullptr)
 {
 	TImage labels;
 
+	// Packing isn't timed, it stands for masks kept packed
+	TBitImage bits;
+	if (opts.packedInput)
+		bits.Pack(opts.binaryInput ? inImg : ILabeling::RGB2Gray(inImg));
+
+	// Runs are labeled before timed cycles, so profile and label count stay of the last cycle
+	TLabelRuns runs, maskRuns;
+	if (opts.checkRuns)
+		opts.labelingAlg->LabelRuns(inImg, runs, opts.numThreads, opts.coh, opts.binaryInput);
+
+	if (opts.checkMask)
+	{
+		TRunMask mask;
+		ILabeling::ImageToRuns(opts.binaryInput ? inImg : ILabeling::RGB2Gray(inImg), mask);
+		opts.labelingAlg->LabelRuns(mask, maskRuns, opts.numThreads, opts.coh);
+	}
+
 	time.Reset();
 	for (int i = 0; i < opts.cycles; ++i)
 	{
-		TTime curTime = opts.labelingAlg->Label(inImg, labels, opts.numThreads, opts.coh);		
+		TTime curTime = stats ? 
+			opts.labelingAlg->LabelWithStats(inImg, labels, *stats, opts.numThreads, opts.coh, opts.binaryInput) :
+			opts.packedInput ?
+			opts.labelingAlg->LabelPacked(bits, labels, opts.numThreads, opts.coh) :
+			opts.binaryInput ? 
+			opts.labelingAlg->LabelBinary(inImg, labels, opts.numThreads, opts.coh) :
+			opts.labelingAlg->Label(inImg, labels, opts.numThreads, opts.coh);		
 		time.Add(curTime);
 	}	
 
+	if (opts.checkRuns || opts.checkMask)
+	{
+		TLabelRuns labelsRuns;
+		ILabeling::LabelsToRuns(labels, labelsRuns);
+		THROW_IF(opts.checkRuns && !SameRuns(runs, labelsRuns), "Labeled runs differ from runs of labels image");
+		THROW_IF(opts.checkMask && !SameRuns(maskRuns, labelsRuns), "Labeled mask runs differ from runs of labels image");
+	}
+
 	return labels;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 
-TImage Read3DImage(const std::string &inPath)
+void ReportStats(const std::string &image, const TStats &stats, const Options &opts)
+{
+	if (opts.statsOut)
+		opts.statsOut->Write(image, stats);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+TImage ReadImage(const std::string &fName, const Options &opts)
+{
+	// Binary masks are labeled as is, so they are read as single channel images
+	return cv::imread(fName, opts.binaryInput ? cv::IMREAD_GRAYSCALE : cv::IMREAD_COLOR);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+TImage Read3DImage(const std::string &inPath, const Options &opts)
 {
 	if (is_directory(inPath))
 	{
@@ -196,7 +503,8 @@ TImage Read3DImage(const std::string &inPath)
 				throw std::exception("Cannot read 3D image: slice sizes do not match");
 			}
 
-			curIm = ILabeling::RGB2Gray(curIm);
+			if (!opts.binaryInput)
+				curIm = ILabeling::RGB2Gray(curIm);
 			
 			for (int j = 0; j < curIm.size[1]; ++j)
 				for (int i = 0; i < curIm.size[0]; ++i)
@@ -306,8 +614,428 @@ void Write3DLabels(const TImage &labels, const std::string outPath)
 
 ///////////////////////////////////////////////////////////////////////////////
 
+void PrintTotalTime(ImgTime &time, size_t frames, float wallTime, const char *unit = "frames/s")
+{
+	cout << "\nMin processing time: " << static_cast<float>(time.Min()) / 1000 << " ms\n";
+	cout << "Avg processing time: " << static_cast<float>(time.Avg()) / 1000 << " ms\n";	
+	cout << "Max processing time: " << static_cast<float>(time.Max()) / 1000 << " ms\n";
+	cout << "Latency percentiles: " << Percentiles(time) << "\n";
+	cout << "Throughput: " << (wallTime > 0 ? frames * 1000 / wallTime : 0) << " " << unit << "\n";
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+void ProcessImagesBatch(const Options &opts, const std::shared_ptr<IOCLLabeling> &oclAlg)
+{
+	auto imgs = FindFiles(opts.inPath);
+	auto nextImg = imgs.begin();
+	std::list<std::string> inFlight; // Names of images read but not yet written
+
+	size_t count = 0;
+	ImgTime time;
+
+	bool wantWrite = is_directory(opts.outPath);
+
+	// Images are read ahead of labeling, so their names wait in inFlight
+	auto source = [&](TImage &img) -> bool
+	{
+		for (; nextImg != imgs.end(); ++nextImg)
+		{
+			img = ReadImage(*nextImg, opts);
+			if (!img.empty()) 
+			{
+				inFlight.push_back(*nextImg++);
+				return true;
+			}
+		}
+
+		return false;
+	};
+
+	auto sink = [&](const TImage &labels, TTime imgTime)
+	{
+		std::string fileName(path(inFlight.front()).filename().string());
+		inFlight.pop_front();
+
+		cout << "Processing image " << ++count << "/" << imgs.size() << " (" << fileName.c_str() << ") "
+			 << static_cast<float>(imgTime) / 1000 << " ms\n";
+
+		if (wantWrite)
+			cv::imwrite(opts.outPath + "/" + fileName, LabelsToRGB(labels));
+
+		time.Add(imgTime);
+	};
+
+	StopWatchWin watch;
+	watch.start();
+
+	size_t frames = oclAlg->LabelBatch(source, sink, opts.binaryInput, opts.coh);
+
+	watch.stop();
+
+	PrintTotalTime(time, frames, watch.getTime());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+template <typename T>
+class BoundedQueue
+{
+public:
+	explicit BoundedQueue(size_t maxSize) : maxSize(maxSize) {}
+
+	// Blocks while queue is full, returns false if queue is closed (item is dropped)
+	bool Push(T item)
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		notFull.wait(lock, [&] { return items.size() < maxSize || closed; });
+
+		if (closed)
+			return false;
+
+		items.push_back(std::move(item));
+		notEmpty.notify_one();
+
+		return true;
+	}
+
+	// Blocks while queue is empty, returns false if queue is closed and has no items
+	bool Pop(T &item)
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		notEmpty.wait(lock, [&] { return !items.empty() || closed; });
+
+		if (items.empty())
+			return false;
+
+		item = std::move(items.front());
+		items.pop_front();
+		notFull.notify_one();
+
+		return true;
+	}
+
+	// Wakes up all waiting threads, no more items are taken, but queued ones can still be popped
+	void Close(void)
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		closed = true;
+		notEmpty.notify_all();
+		notFull.notify_all();
+	}
+
+private:
+	const size_t maxSize;
+	std::deque<T> items;
+	bool closed = false;
+
+	std::mutex mtx;
+	std::condition_variable notEmpty, notFull;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+struct PipelineStage
+{
+	const char *name;
+	int threads;
+	float busyTime = 0; // Sum of all thread times spent on work (not on waiting), ms
+
+	std::mutex mtx;
+	std::exception_ptr error;
+
+	PipelineStage(const char *name, int threads) : name(name), threads(threads) {}
+
+	// Runs body in stage threads, keeps the first exception and calls onExit in every thread
+	void Run(std::vector<std::thread> &pool, const std::function<void(StopWatchWin&)> &body, const std::function<void(void)> &onExit)
+	{
+		for (int i = 0; i < threads; ++i)
+		{
+			pool.emplace_back([=] {
+				StopWatchWin watch;
+
+				try { body(watch); }
+				catch (...) { std::lock_guard<std::mutex> lock(mtx); if (!error) error = std::current_exception(); }
+
+				std::lock_guard<std::mutex> lock(mtx);
+				busyTime += watch.getTotalTime();
+				onExit();
+			});
+		}
+	}
+
+	void PrintUtilization(float wallTime) const
+	{
+		auto flags = cout.flags();
+		auto precision = cout.precision();
+
+		cout << setw(7) << left << name << " utilization: " << fixed << setprecision(1)
+			 << (wallTime > 0 ? 100 * busyTime / (wallTime * threads) : 0) << "% (" << threads << " threads)\n";
+
+		cout.flags(flags);
+		cout.precision(precision);
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+void ProcessImagesPipeline(const Options &opts)
+{
+	auto files = FindFiles(opts.inPath);
+	std::vector<std::string> imgs(files.begin(), files.end());
+
+	struct Item 
+	{ 
+		std::string fileName; 
+		TImage img;
+	};
+
+	// Queues are short, so only a few images are held in memory
+	BoundedQueue<Item> decoded(2 * opts.decoders), labeled(2 * opts.encoders);
+	std::atomic<size_t> nextImg(0);
+	std::atomic<int> decodersLeft(opts.decoders), encodersLeft(opts.encoders);
+
+	bool wantWrite = is_directory(opts.outPath);
+
+	PipelineStage decode("Decode", opts.decoders), label("Label", 1), encode("Encode", opts.encoders);
+	std::vector<std::thread> pool;
+
+	size_t count = 0;
+	ImgTime time;
+
+	StopWatchWin watch;
+	watch.start();
+
+	// Decoders take images in turns, unreadable ones are skipped
+	decode.Run(pool, [&](StopWatchWin &busy) {
+		for (size_t i = nextImg++; i < imgs.size(); i = nextImg++)
+		{
+			busy.start();
+			Item item = { path(imgs[i]).filename().string(), ReadImage(imgs[i], opts) };
+			busy.stop();
+
+			if (!item.img.empty() && !decoded.Push(std::move(item)))
+				break; // Labeling has stopped
+		}
+	}, [&] { if (--decodersLeft == 0) decoded.Close(); });
+
+	// Labeling stays in one thread, since algorithm may use its own threads
+	label.Run(pool, [&](StopWatchWin &busy) {
+		Item item;
+		while (decoded.Pop(item))
+		{
+			ImgTime imgTime;
+			TStats stats;
+
+			busy.start();
+			item.img = ProcessImage(item.img, opts, imgTime, opts.statsOut ? &stats : nullptr);
+			busy.stop();
+
+			time += imgTime;
+			cout << "Processing image " << ++count << "/" << imgs.size() << " (" << item.fileName.c_str() << ") "
+				 << static_cast<float>(imgTime.Avg()) / 1000 << " ms" << (opts.cycles > 1 ? " (" + Percentiles(imgTime) + ")" : "") << "\n";
+
+			ReportProfile(item.fileName, item.img, *opts.labelingAlg, opts);
+			ReportStats(item.fileName, stats, opts);
+
+			if (!labeled.Push(std::move(item)))
+				break; // Encoding has stopped
+		}
+	}, [&] { decoded.Close(); labeled.Close(); });
+
+	encode.Run(pool, [&](StopWatchWin &busy) {
+		Item item;
+		while (labeled.Pop(item))
+		{
+			busy.start();
+			if (wantWrite)
+				cv::imwrite(opts.outPath + "/" + item.fileName, LabelsToRGB(item.img));
+			busy.stop();
+		}
+	}, [&] { if (--encodersLeft == 0) labeled.Close(); });
+
+	for (auto &t : pool)
+		t.join();
+
+	watch.stop();
+
+	for (auto stage : { &decode, &label, &encode })
+		if (stage->error)
+			std::rethrow_exception(stage->error);
+
+	PrintTotalTime(time, count * opts.cycles, watch.getTime());
+
+	for (auto stage : { &decode, &label, &encode })
+		stage->PrintUtilization(watch.getTime());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Shared mutex which lets exclusive lockers in first, new shared lockers wait while any of them waits,
+// so a stream of shared lockers can't starve them (std::shared_timed_mutex may prefer readers)
+class WriterFirstMutex
+{
+public:
+	void lock(void)
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		++writersWaiting;
+		changed.wait(lock, [&] { return !writer && !readers; });
+		--writersWaiting;
+		writer = true;
+	}
+
+	void unlock(void)
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		writer = false;
+		changed.notify_all();
+	}
+
+	void lock_shared(void)
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		changed.wait(lock, [&] { return !writer && !writersWaiting; });
+		++readers;
+	}
+
+	void unlock_shared(void)
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		if (!--readers)
+			changed.notify_all();
+	}
+
+private:
+	std::mutex mtx;
+	std::condition_variable changed; // Notified whenever lock might have become free
+	int writersWaiting = 0, readers = 0;
+	bool writer = false;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+std::shared_ptr<ILabeling> SetLabelingAlg(const std::string &algName, const Options& opts);
+
+void ProcessImagesConcurrently(const Options &opts)
+{
+	auto files = FindFiles(opts.inPath);
+	std::vector<std::string> imgs(files.begin(), files.end());
+
+	const int workers = opts.numThreads > 0 ? opts.numThreads : std::max(1u, std::thread::hardware_concurrency());
+
+	// Image is labeled by all threads only if each of them gets enough pixels to pay off fork/join,
+	// smaller images are labeled by single threaded algorithms side by side
+	const size_t minPixelsPerThread = 1 << 18;
+	const size_t largeImage = minPixelsPerThread * workers;
+
+	std::atomic<size_t> nextImg(0);
+	WriterFirstMutex gate; // Locked exclusively by large images and shared by small ones
+	std::mutex outMtx;
+
+	size_t count = 0, largeCount = 0;
+	ImgTime time;
+
+	bool wantWrite = is_directory(opts.outPath);
+
+	PipelineStage label("Label", workers);
+	std::vector<std::thread> pool;
+
+	StopWatchWin watch;
+	watch.start();
+
+	label.Run(pool, [&](StopWatchWin &busy) {
+		// Algorithms keep per call state, so every worker has its own one
+		Options workerOpts = opts;
+		workerOpts.labelingAlg = SetLabelingAlg(opts.algName, opts);
+		workerOpts.labelingAlg->SetCompaction(opts.compact);
+
+		for (size_t i = nextImg++; i < imgs.size(); i = nextImg++)
+		{
+			std::string fileName(path(imgs[i]).filename().string());
+			TImage img = ReadImage(imgs[i], opts);
+
+			if (img.empty())
+				continue;
+
+			const bool isLarge = img.total() >= largeImage;
+			ImgTime imgTime;
+			TStats stats;
+
+			if (isLarge)
+			{
+				std::unique_lock<WriterFirstMutex> lock(gate);
+				workerOpts.numThreads = opts.numThreads;
+
+				busy.start();
+				img = ProcessImage(img, workerOpts, imgTime, opts.statsOut ? &stats : nullptr);
+				busy.stop();
+			}
+			else
+			{
+				std::shared_lock<WriterFirstMutex> lock(gate);
+				workerOpts.numThreads = 1;
+
+				busy.start();
+				img = ProcessImage(img, workerOpts, imgTime, opts.statsOut ? &stats : nullptr);
+				busy.stop();
+			}
+
+			if (wantWrite)
+				cv::imwrite(opts.outPath + "/" + fileName, LabelsToRGB(img));
+
+			std::lock_guard<std::mutex> lock(outMtx);
+
+			time += imgTime;
+			largeCount += isLarge;
+
+			cout << "Processing image " << ++count << "/" << imgs.size() << " (" << fileName.c_str() << ") "
+				 << static_cast<float>(imgTime.Avg()) / 1000 << " ms" << (opts.cycles > 1 ? " (" + Percentiles(imgTime) + ")" : "") 
+				 << (isLarge ? " (all threads)" : "") << "\n";
+
+			ReportProfile(fileName, img, *workerOpts.labelingAlg, opts);
+			ReportStats(fileName, stats, opts);
+		}
+	}, [] {});
+
+	for (auto &t : pool)
+		t.join();
+
+	watch.stop();
+
+	if (label.error)
+		std::rethrow_exception(label.error);
+
+	PrintTotalTime(time, count * opts.cycles, watch.getTime(), "images/s");
+
+	cout << "Labeled by all threads: " << largeCount << "/" << count << " images\n";
+	label.PrintUtilization(watch.getTime());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
 void ProcessImages(const Options &opts)
 {
+	auto oclAlg = std::dynamic_pointer_cast<IOCLLabeling>(opts.labelingAlg);
+	if (opts.batchMode && oclAlg)
+	{
+		ProcessImagesBatch(opts, oclAlg);
+		return;
+	}
+
+	if (opts.decoders)
+	{
+		ProcessImagesPipeline(opts);
+		return;
+	}
+
+	// OpenCL instances share device queue, so only CPU algorithms are run side by side
+	if (opts.concurrent && !oclAlg)
+	{
+		ProcessImagesConcurrently(opts);
+		return;
+	}
+
 	auto imgs = FindFiles(opts.inPath);
 
 	size_t count = 0;
@@ -315,28 +1043,356 @@ void ProcessImages(const Options &opts)
 
 	bool wantWrite = is_directory(opts.outPath);
 
+	StopWatchWin watch;
+	watch.start();
+
 	for (auto fName: imgs)
 	{
 		std::string fileName(path(fName).filename().string());
 
-		TImage img = cv::imread(fName);		
+		TImage img = ReadImage(fName, opts);		
 
 		cout << "Processing image " << ++count << "/" << imgs.size() << " (" << fileName.c_str() << ")";// \n";
 
-		ImgTime imgTime;			
-		img = ProcessImage(img, opts, imgTime);
+		ImgTime imgTime;
+		TStats stats;
+		img = ProcessImage(img, opts, imgTime, opts.statsOut ? &stats : nullptr);
 
 		if(wantWrite)
 			cv::imwrite(opts.outPath + "/" + fileName, LabelsToRGB(img));
 
 		time += imgTime;
 
-		cout << " " << static_cast<float>(imgTime.Avg()) / 1000 << " ms\n";
+		cout << " " << static_cast<float>(imgTime.Avg()) / 1000 << " ms" << (opts.cycles > 1 ? " (" + Percentiles(imgTime) + ")" : "") << "\n";
+
+		ReportProfile(fileName, img, *opts.labelingAlg, opts);
+		ReportStats(fileName, stats, opts);
 	}
 
-	cout << "\nMin processing time: " << static_cast<float>(time.Min()) / 1000 << " ms\n";
-	cout << "Avg processing time: " << static_cast<float>(time.Avg()) / 1000 << " ms\n";	
-	cout << "Max processing time: " << static_cast<float>(time.Max()) / 1000 << " ms\n";
+	watch.stop();
+
+	PrintTotalTime(time, count * opts.cycles, watch.getTime());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+struct BenchImage
+{
+	std::string pattern;
+	float density;
+	int granularity;
+	uint seed;
+	TImage img;
+};
+
+struct BenchAlg
+{
+	std::string name;
+	std::string device;
+	std::shared_ptr<ILabeling> alg;
+};
+
+// Reproducible size x density x granularity grid plus worst cases, images are made one by one to save memory
+void ForEachBenchImage(int size, bool is3D, uint seed, const std::function<void(const BenchImage&)> &process)
+{
+	static const int granularities[] = { 1, 2, 4, 8, 16 };
+
+	for (int g : granularities)
+		for (int d = 0; d <= 100; d += 10)
+		{
+			BenchImage bench{ g == 1 ? "noise" : "blocks", d / 100.0f, g, seed++ };
+			bench.img = is3D ? 
+				RandomImage3D(size, size, size, bench.density, g, bench.seed) : 
+				RandomImage(size, size, bench.density, g, bench.seed);
+			process(bench);
+		}
+
+	// Worst cases report their actual density
+	auto worstCase = [&](const char *pattern, int granularity, const TImage &img)
+	{
+		float density = float(std::count(img.datastart, img.datastart + img.total(), 255)) / img.total();
+		process(BenchImage{ pattern, density, granularity, 0, img });
+	};
+
+	if (is3D)
+	{
+		worstCase("snake", 1, SnakeImage3D(size, size, size));
+	}
+	else
+	{
+		worstCase("spiral", 1, SpiralImage(size, size));
+		worstCase("snake", 1, SnakeImage(size, size));
+		worstCase("checkerboard", 1, CheckerboardImage(size, size));
+		worstCase("checkerboard", 8, CheckerboardImage(size, size, 8));
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+std::vector<BenchAlg> CreateBenchAlgs(const Options &opts, bool is3D)
+{
+	std::vector<BenchAlg> algs;
+	bool useGPU = opts.useOCL != Options::OCL_CPU;
+
+	for (auto &entry : ALG_LIST)
+	{
+		if (!opts.algName.empty() && entry.first != opts.algName)
+			continue;
+
+		auto &cpu = is3D ? entry.second.cpu3d : entry.second.cpu;
+		if (cpu != nullptr)
+			algs.push_back(BenchAlg{ entry.first, "cpu", cpu() });
+
+		try
+		{
+			std::shared_ptr<IOCLLabeling> ocl = is3D ? 
+				(entry.second.ocl3d != nullptr ? entry.second.ocl3d(useGPU) : nullptr) : 
+				(entry.second.ocl != nullptr ? entry.second.ocl(useGPU) : nullptr);
+
+			if (ocl != nullptr)
+			{
+				ocl->SetSyncInterval(opts.syncInterval);
+				algs.push_back(BenchAlg{ entry.first, useGPU ? "ocl-gpu" : "ocl-cpu", ocl });
+			}
+		}
+		catch (std::exception e)
+		{
+			cout << "Skipping OpenCL " << entry.first << (is3D ? " 3D" : "") << ": " << e.what() << "\n";
+		}
+	}
+
+	return algs;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+void RunBenchmark(const Options &opts)
+{
+	static const int sizes2D[] = { 256, 512, 1024, 2048 };
+	static const int sizes3D[] = { 32, 64, 128 };
+
+	std::ofstream out(opts.benchOut);
+	THROW_IF(!out, "Cannot open benchmark output file");
+
+	out << "algorithm,device,dims,pattern,width,height,depth,density,granularity,seed,threads,cycles,min_ms,avg_ms,max_ms,p50_ms,p90_ms,p99_ms,p999_ms,mpix_s\n";
+
+	for (bool is3D : { false, true })
+	{
+		std::vector<BenchAlg> algs = CreateBenchAlgs(opts, is3D);
+		
+		for (int size : is3D ? std::vector<int>(std::begin(sizes3D), std::end(sizes3D)) : std::vector<int>(std::begin(sizes2D), std::end(sizes2D)))
+		{
+			const size_t pixels = is3D ? size_t(size) * size * size : size_t(size) * size;
+			cout << "Benchmarking " << (is3D ? "3D " : "2D ") << size << (is3D ? "^3" : "^2") << " images\n";
+
+			ForEachBenchImage(size, is3D, opts.seed, [&](const BenchImage &bench) 
+			{
+				for (auto &alg : algs)
+				{
+					if (alg.alg == nullptr)
+						continue;
+
+					TImage labels;
+					ImgTime time;
+					
+					try
+					{
+						// Warm-up call builds kernels and grows workspaces, so it isn't timed
+						for (int i = 0; i <= opts.cycles; ++i)
+						{
+							TTime curTime = alg.alg->LabelBinary(bench.img, labels, opts.numThreads, is3D ? COH_DEFAULT : opts.coh);
+							if (i) time.Add(curTime);
+						}
+					}
+					catch (std::exception e)
+					{
+						cout << "Dropping " << alg.name << " (" << alg.device << "): " << e.what() << "\n";
+						alg.alg = nullptr;
+						continue;
+					}
+
+					out << alg.name << ',' << alg.device << ',' << (is3D ? 3 : 2) << ',' << bench.pattern << ',' 
+						<< size << ',' << size << ',' << (is3D ? size : 1) << ',' << bench.density << ',' << bench.granularity << ',' 
+						<< bench.seed << ',' << opts.numThreads << ',' << opts.cycles << ','
+						<< float(time.Min()) / 1000 << ',' << float(time.Avg()) / 1000 << ',' << float(time.Max()) / 1000 << ','
+						<< float(time.Percentile(50)) / 1000 << ',' << float(time.Percentile(90)) / 1000 << ',' 
+						<< float(time.Percentile(99)) / 1000 << ',' << float(time.Percentile(99.9)) / 1000 << ','
+						<< (time.Avg() ? float(pixels) / time.Avg() : 0) << '\n';
+				}
+			});
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Number of physical cores, logical processors if it cannot be found
+int PhysicalCores(void)
+{
+#ifdef _WIN32
+	DWORD size = 0;
+	GetLogicalProcessorInformation(nullptr, &size);
+
+	std::vector<SYSTEM_LOGICAL_PROCESSOR_INFORMATION> info(size / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION));
+	if (info.empty() || !GetLogicalProcessorInformation(info.data(), &size))
+		return omp_get_num_procs();
+
+	int cores = static_cast<int>(std::count_if(info.begin(), info.end(), 
+		[](const SYSTEM_LOGICAL_PROCESSOR_INFORMATION &proc) { return proc.Relationship == RelationProcessorCore; }));
+#else
+	// Unique (physical id, core id) pairs
+	std::ifstream cpuInfo("/proc/cpuinfo");
+	std::set<std::pair<int, int>> coreIds;
+	std::string line;
+	int physId = 0;
+
+	while (std::getline(cpuInfo, line))
+	{
+		size_t sep = line.find(':');
+		if (sep == std::string::npos) 
+			continue;
+
+		if (!line.compare(0, 11, "physical id")) physId = std::stoi(line.substr(sep + 1));
+		if (!line.compare(0, 7, "core id")) coreIds.emplace(physId, std::stoi(line.substr(sep + 1)));
+	}
+
+	int cores = static_cast<int>(coreIds.size());
+#endif
+
+	return cores ? cores : omp_get_num_procs();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Powers of two up to maxThreads, physical core count and maxThreads itself
+std::set<int> ScalingThreads(int maxThreads)
+{
+	std::set<int> counts;
+
+	for (int n = 1; n < maxThreads; n *= 2)
+		counts.insert(n);
+
+	counts.insert(std::min(PhysicalCores(), maxThreads));
+	counts.insert(maxThreads);
+
+	return counts;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Input images binarized in advance or synthetic ones, so only labeling is timed
+std::vector<TImage> ScalingImages(const Options &opts)
+{
+	std::vector<TImage> imgs;
+
+	if (opts.inPath.empty())
+	{
+		if (opts.label3D)
+		{
+			imgs.push_back(RandomImage3D(128, 128, 128, 0.5f, 1, opts.seed));
+			imgs.push_back(RandomImage3D(128, 128, 128, 0.5f, 4, opts.seed + 1));
+			imgs.push_back(SnakeImage3D(128, 128, 128));
+		}
+		else
+		{
+			imgs.push_back(RandomImage(2048, 2048, 0.5f, 1, opts.seed));
+			imgs.push_back(RandomImage(2048, 2048, 0.5f, 4, opts.seed + 1));
+			imgs.push_back(RandomImage(2048, 2048, 0.5f, 16, opts.seed + 2));
+			imgs.push_back(SpiralImage(2048, 2048));
+		}
+	}
+	else if (opts.label3D)
+	{
+		imgs.push_back(Read3DImage(opts.inPath, opts));
+	}
+	else
+	{
+		for (auto &fileName : is_directory(opts.inPath) ? FindFiles(opts.inPath) : std::list<std::string>{ opts.inPath })
+		{
+			TImage img = ReadImage(fileName, opts);
+			if (!img.empty())
+				imgs.push_back(opts.binaryInput ? img : ILabeling::RGB2Gray(img));
+		}
+	}
+
+	imgs.erase(std::remove_if(imgs.begin(), imgs.end(), [](const TImage &img) { return img.empty(); }), imgs.end());
+	THROW_IF(imgs.empty(), "No images for thread scaling sweep");
+
+	return imgs;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+void RunScalingSweep(const Options &opts)
+{
+	// Variance needs a few samples, each sample is the time of labeling all images once
+	const int cycles = std::max(opts.cycles, 3);
+	const std::set<int> threadCounts = ScalingThreads(opts.numThreads != MAX_THREADS ? opts.numThreads : omp_get_num_procs());
+	const std::vector<TImage> imgs = ScalingImages(opts);
+
+	std::ofstream out(opts.scalingOut);
+	THROW_IF(!out, "Cannot open scaling output file");
+
+	out << "algorithm,dims,images,threads,cycles,mean_ms,stddev_ms,cv,min_ms,max_ms,speedup,efficiency\n";
+
+	cout << "Thread scaling over " << imgs.size() << " image(s), " << cycles << " cycles, " 
+		 << PhysicalCores() << " physical cores, " << omp_get_num_procs() << " logical processors\n";
+
+	for (auto &entry : ALG_LIST)
+	{
+		if (!opts.algName.empty() && entry.first != opts.algName)
+			continue;
+
+		auto &creator = opts.label3D ? entry.second.cpu3d : entry.second.cpu;
+		if (creator == nullptr)
+			continue;
+
+		std::shared_ptr<ILabeling> alg = creator();
+		TImage labels;
+		double baseline = 0;
+
+		cout << "\nAlgorithm: " << entry.first << "\n"
+			 << setw(8) << "Threads" << setw(12) << "Mean ms" << setw(12) << "StdDev ms" << setw(10) << "Speedup" << setw(12) << "Efficiency" << "\n";
+
+		for (int threads : threadCounts)
+		{
+			auto labelAll = [&](void) -> TTime
+			{
+				TTime time = 0;
+				for (auto &img : imgs)
+					time += alg->LabelBinary(img, labels, threads, opts.label3D ? COH_DEFAULT : opts.coh);
+				return time;
+			};
+
+			labelAll(); // Warm-up, grows workspaces and spawns the OpenMP team
+
+			ImgTime time;
+			std::vector<double> samples;
+			for (int i = 0; i < cycles; ++i)
+			{
+				TTime sample = labelAll();
+				time.Add(sample);
+				samples.push_back(sample / 1000.0);
+			}
+
+			double mean = std::accumulate(samples.begin(), samples.end(), 0.0) / samples.size(), var = 0;
+			for (double sample : samples)
+				var += (sample - mean) * (sample - mean);
+			double stddev = std::sqrt(var / (samples.size() - 1));
+
+			if (threads == 1) 
+				baseline = mean;
+
+			double speedup = mean > 0 ? baseline / mean : 0;
+			double efficiency = speedup / threads;
+
+			cout << setw(8) << threads << setw(12) << mean << setw(12) << stddev << setw(10) << speedup << setw(12) << efficiency << "\n";
+
+			out << entry.first << ',' << (opts.label3D ? 3 : 2) << ',' << imgs.size() << ',' << threads << ',' << cycles << ',' 
+				<< mean << ',' << stddev << ',' << (mean > 0 ? stddev / mean : 0) << ',' 
+				<< float(time.Min()) / 1000 << ',' << float(time.Max()) / 1000 << ',' << speedup << ',' << efficiency << '\n';
+		}
+	}
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -362,9 +1418,51 @@ void PrintHelp(void)
 	cout << "  -3           : Theat input sequence as a single 3D image\n"
 			"  -g           : Run algorithm in OpenCL mode on GPU (if available)\n"
 			"  -u           : Run algorithm in OpenCL mode on CPU (if available)\n"
+			"  -b           : Input images are binary masks (0 - background, 255 - objects),\n"
+			"                 no thresholding is done\n"
+			"  -1           : Bit pack input images (1 bit per pixel) before labeling, packing\n"
+			"                 isn't timed (not supported with -3, -n, -s, -x and -e)\n"
+			"  -q           : Also label input images into runs (not timed) and check them\n"
+			"                 against runs of labels image (not supported with -3, -s, -x\n"
+			"                 and -e)\n"
+			"  -w           : Also encode input images into run-length masks, label them (not\n"
+			"                 timed) and check labeled runs against runs of labels image\n"
+			"                 (not supported with -3, -s, -x and -e)\n"
 			"  -j <threads> : Set numer of parallel threads for OpenMP (default 0)\n"
 			"  -l <cycles>  : Set numer of cycles for each image (default 1)\n"
 			"  -c <connect> : Set connectivity (4 or 8 [default])\n"
+			"  -k <iters>   : Set OpenCL iterations per convergence check (default 1),\n"
+			"                 checks become asynchronous if more than 1\n"
+			"  -s           : Stream input directory through OpenCL batch pipeline, next image\n"
+			"                 uploads and previous one downloads while current one is labeled\n"
+			"                 (each image is labeled once)\n"
+			"  -p <dec:enc> : Pipeline input directory with dec decoding and enc encoding\n"
+			"                 threads around labeling thread, prints stage utilization\n"
+			"  -m           : Label input directory images concurrently (CPU algorithms),\n"
+			"                 one single threaded algorithm per -j thread, images too large\n"
+			"                 for that are labeled one at a time with all threads\n"
+			"  -f           : Print per phase profile of every image (last cycle)\n"
+			"  -t <file>    : Write per phase profiles to file, JSON if its extension is\n"
+			"                 .json and CSV otherwise\n"
+			"  -z           : Renumber labels to 1..N after labeling (on device for OpenCL\n"
+			"                 algorithms), -f prints N\n"
+			"  -n <file>    : Write stats (area, bounding box and centroid) of every labeled\n"
+			"                 component to CSV file, labeling times include gathering them\n"
+			"                 (not supported in -s mode)\n"
+			"  -v           : Enable OpenCL event profiling, profiles (-f, -t) get device\n"
+			"                 time of every kernel and transfer (dev: phases)\n"
+			"  -d <dir>     : Cache built OpenCL programs in dir (off by default), later runs\n"
+			"                 on the same device and driver load them instead of building\n"
+			"  -x <file>    : Run synthetic benchmark and write CSV to file, every algorithm\n"
+			"                 (or the one set by -a) runs over 2D and 3D random images of\n"
+			"                 several sizes, densities and granularities and worst cases,\n"
+			"                 OpenCL algorithms run on GPU unless -u is set\n"
+			"  -r <seed>    : Set random seed of synthetic images (default 1)\n"
+			"  -e <file>    : Run thread scaling sweep of CPU algorithms (or the one set by\n"
+			"                 -a) for powers of two up to -j threads (all processors by\n"
+			"                 default) and physical core count, write CSV to file; input\n"
+			"                 images are taken from -i or made synthetically, each thread\n"
+			"                 count has a warm-up and -l cycles (at least 3)\n"
 			"  -h           : Print this help\n\n";
 }
 
@@ -386,7 +1484,7 @@ std::shared_ptr<ILabeling> SetLabelingAlg(const std::string &algName, const Opti
 				return algCreator->second.ocl != nullptr ? algCreator->second.ocl(useGPU) : nullptr;
 		else
 			if (!useOCL)
-				return algCreator->second.cpu != nullptr ? algCreator->second.cpu() : nullptr;
+				return algCreator->second.cpu3d != nullptr ? algCreator->second.cpu3d() : nullptr;
 			else
 				return algCreator->second.ocl3d != nullptr ? algCreator->second.ocl3d(useGPU) : nullptr;				
 	}
@@ -427,10 +1525,37 @@ Options ParseInput(int argc, char** argv)
 		if (!strcmp(argv[i], "-3")) { opts.label3D = true; continue; }		
 		if (!strcmp(argv[i], "-g")) { opts.useOCL = Options::OCL_GPU; continue; }
 		if (!strcmp(argv[i], "-u")) { opts.useOCL = Options::OCL_CPU; continue; }		
+		if (!strcmp(argv[i], "-b")) { opts.binaryInput = true; continue; }
+		if (!strcmp(argv[i], "-1")) { opts.packedInput = true; continue; }
+		if (!strcmp(argv[i], "-q")) { opts.checkRuns = true; continue; }
+		if (!strcmp(argv[i], "-w")) { opts.checkMask = true; continue; }
+		if (!strcmp(argv[i], "-s")) { opts.batchMode = true; continue; }
+		if (!strcmp(argv[i], "-m")) { opts.concurrent = true; continue; }
+		if (!strcmp(argv[i], "-f")) { opts.printProfile = true; continue; }
+		if (!strcmp(argv[i], "-z")) { opts.compact = true; continue; }
+		if (!strcmp(argv[i], "-v")) { IOCLLabeling::SetEventProfiling(true); continue; }
+		if (!strcmp(argv[i], "-d")) { IOCLLabeling::SetBinaryCacheDir(ReadData(i)); continue; }
+		if (!strcmp(argv[i], "-t")) { opts.profileOut = std::make_shared<ProfileWriter>(ReadData(i)); continue; }
+		if (!strcmp(argv[i], "-n")) { opts.statsOut = std::make_shared<StatsWriter>(ReadData(i)); continue; }
+		if (!strcmp(argv[i], "-x")) { opts.benchOut = ReadData(i); continue; }
+		if (!strcmp(argv[i], "-r")) { opts.seed = std::stoul(ReadData(i)); continue; }
+		if (!strcmp(argv[i], "-e")) { opts.scalingOut = ReadData(i); continue; }
+		if (!strcmp(argv[i], "-p")) 
+		{ 
+			std::string threads = ReadData(i);
+			size_t sep = threads.find(':');
+			THROW_IF(sep == std::string::npos, "Wrong input parameters (pipeline threads are expected as dec:enc)");
+
+			opts.decoders = std::stoi(threads.substr(0, sep));
+			opts.encoders = std::stoi(threads.substr(sep + 1));
+			THROW_IF(opts.decoders < 1 || opts.encoders < 1, "Wrong input parameters (at least one pipeline thread per stage is needed)");
+			continue; 
+		}
 		
 		if (!strcmp(argv[i], "-j")) { opts.numThreads = std::stoi(ReadData(i)); continue; }
 		if (!strcmp(argv[i], "-l")) { opts.cycles = std::stoi(ReadData(i)); continue; }
 		if (!strcmp(argv[i], "-c")) { opts.coh = ReadData(i) == "4" ? COH_4 : COH_8; continue; }
+		if (!strcmp(argv[i], "-k")) { opts.syncInterval = std::stoi(ReadData(i)); continue; }
 		
 		if (!strcmp(argv[i], "-h")) { PrintHelp(); opts.quickExit = true; return opts; }
 
@@ -440,8 +1565,30 @@ Options ParseInput(int argc, char** argv)
 		throw std::exception(msg.str().c_str());
 	}
 
+	opts.algName = algName;
+
+	THROW_IF(opts.statsOut && opts.label3D, "Component stats are supported for 2D images only");
+	THROW_IF(opts.statsOut && opts.batchMode, "Component stats are not supported in batch mode");
+	THROW_IF(opts.packedInput && opts.label3D, "Bit packed input is supported for 2D images only");
+	THROW_IF(opts.packedInput && (opts.statsOut || opts.batchMode || !opts.benchOut.empty() || !opts.scalingOut.empty()), 
+			 "Bit packed input is not supported with stats, batch mode, benchmark and scaling sweep");
+	THROW_IF((opts.checkRuns || opts.checkMask) && (opts.label3D || opts.batchMode || !opts.benchOut.empty() || !opts.scalingOut.empty()), 
+			 "Run output checks are not supported with 3D images, batch mode, benchmark and scaling sweep");
+
+	// Benchmark and scaling sweep create their own algorithms
+	if (!opts.benchOut.empty() || !opts.scalingOut.empty())
+	{
+		THROW_IF(!algName.empty() && ALG_LIST.find(algName) == ALG_LIST.end(), "Unknown labeling algorithm");
+		return opts;
+	}
+
 	opts.labelingAlg = SetLabelingAlg(algName, opts);
 	THROW_IF(opts.labelingAlg == nullptr, "Chosen algorithm doesn't support specified capabilities");
+	opts.labelingAlg->SetCompaction(opts.compact);
+
+	auto oclAlg = std::dynamic_pointer_cast<IOCLLabeling>(opts.labelingAlg);
+	if (oclAlg)
+		oclAlg->SetSyncInterval(opts.syncInterval);
 
 	return opts;
 }
@@ -458,7 +1605,8 @@ void PrintTime(const std::string fileName, ImgTime &time, const Options &opts)
 		cout << "Processing time:\n Min = " <<
 			float(time.Min()) / 1000 << "ms\n Avg = " <<
 			float(time.Avg()) / 1000 << "ms\n Max = " <<
-			float(time.Max()) / 1000 << "ms\n";
+			float(time.Max()) / 1000 << "ms\n " << 
+			Percentiles(time) << "\n";
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -474,9 +1622,12 @@ void Process2DImages(const Options &opts)
 		std::string fileName(path(opts.inPath).filename().string());
 
 		ImgTime time;
-		TImage im = ProcessImage(cv::imread(opts.inPath), opts, time);
+		TStats stats;
+		TImage im = ProcessImage(ReadImage(opts.inPath, opts), opts, time, opts.statsOut ? &stats : nullptr);
 
 		PrintTime(fileName, time, opts);
+		ReportProfile(fileName, im, *opts.labelingAlg, opts);
+		ReportStats(fileName, stats, opts);
 
 		if (is_directory(opts.outPath))
 		{
@@ -497,9 +1648,10 @@ void Process3DImages(const Options &opts)
 	if (is_directory(opts.inPath))
 	{
 		ImgTime time;
-		TImage im = Process3DImage(Read3DImage(opts.inPath), opts, time);
+		TImage im = Process3DImage(Read3DImage(opts.inPath, opts), opts, time);
 
 		PrintTime(opts.inPath, time, opts);
+		ReportProfile(opts.inPath, im, *opts.labelingAlg, opts);
 
 		if (is_directory(opts.outPath))
 		{
@@ -519,7 +1671,11 @@ void Run(const Options &opts)
 {
 	if (opts.quickExit) return;
 
-	if (!opts.label3D)
+	if (!opts.benchOut.empty())
+		RunBenchmark(opts);
+	else if (!opts.scalingOut.empty())
+		RunScalingSweep(opts);
+	else if (!opts.label3D)
 		Process2DImages(opts);
 	else
 		Process3DImages(opts);
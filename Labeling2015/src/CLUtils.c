@@ -7,9 +7,21 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <memory.h>
 
-static char *ReadSource(const char *fileName)
+#ifdef _WIN32
+#   include <direct.h>
+#   define MAKE_DIR(path) _mkdir(path)
+#else
+#   include <sys/stat.h>
+#   define MAKE_DIR(path) mkdir(path, 0755)
+#endif
+
+#define CL_CACHE_KEY_SIZE 1024
+#define CL_CACHE_PATH_SIZE (CL_CACHE_DIR_SIZE + 32)
+
+static char *ReadFile(const char *fileName, size_t *fileSize)
 {
     FILE *file = fopen(fileName, "rb");
 	long size = 0;
@@ -54,9 +66,155 @@ static char *ReadSource(const char *fileName)
     src[size] = '\0'; /* NULL terminated */
     fclose(file);
 
+    if (fileSize)
+    {
+        *fileSize = (size_t)size;
+    }
+
     return src;
 }
 
+static char *ReadSource(const char *fileName)
+{
+    return ReadFile(fileName, NULL);
+}
+
+// FNV-1a hash
+static unsigned long long HashData(unsigned long long hash, const char *data, size_t size)
+{
+    size_t i;
+
+    for (i = 0; i < size; i++)
+    {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+#define HASH_INIT 14695981039346656037ULL
+
+// Cache key holds everything the binary depends on, file name is the key hash
+static int GetCacheKey(char *key, char *path, cl_device_id deviceID, const clInitParams *params, const char *sourceCode)
+{
+    char deviceName[CL_DEVICE_NAME_SIZE] = "";
+    char driverVersion[CL_DEVICE_NAME_SIZE] = "";
+    unsigned long long srcHash = HashData(HASH_INIT, sourceCode, strlen(sourceCode));
+    int len;
+
+    if (clGetDeviceInfo(deviceID, CL_DEVICE_NAME, sizeof(deviceName), deviceName, NULL) != CL_SUCCESS ||
+        clGetDeviceInfo(deviceID, CL_DRIVER_VERSION, sizeof(driverVersion), driverVersion, NULL) != CL_SUCCESS)
+    {
+        return 1;
+    }
+
+    len = snprintf(key, CL_CACHE_KEY_SIZE, "%s\n%s\n%s\n%016llx", deviceName, driverVersion, params->build_params, srcHash);
+    if (len < 0 || len >= CL_CACHE_KEY_SIZE)
+    {
+        return 1;
+    }
+
+    len = snprintf(path, CL_CACHE_PATH_SIZE, "%s/%016llx.bin", params->binary_cache_dir, HashData(HASH_INIT, key, len));
+    if (len < 0 || len >= CL_CACHE_PATH_SIZE)
+    {
+        return 1;
+    }
+
+    return 0;
+}
+
+// Cache file is the key followed by '\0' and program binary, returned program still has to be built
+static cl_program LoadCachedProgram(cl_context context, cl_device_id deviceID, const char *path, const char *key)
+{
+    size_t size = 0, keySize = strlen(key) + 1, binSize;
+    char *data = ReadFile(path, &size);
+    const unsigned char *bin;
+    cl_program program;
+    cl_int errNum, binStatus;
+
+    if (!data)
+    {
+        return NULL;
+    }
+
+    if (size <= keySize || memcmp(data, key, keySize))
+    {
+        free(data);
+        return NULL; // Stale binary, it'll be rebuilt from source
+    }
+
+    bin = (const unsigned char *)data + keySize;
+    binSize = size - keySize;
+
+    program = clCreateProgramWithBinary(context, 1, &deviceID, &binSize, &bin, &binStatus, &errNum);
+    free(data);
+
+    if (program == NULL || errNum != CL_SUCCESS || binStatus != CL_SUCCESS)
+    {
+        if (program)
+        {
+            clReleaseProgram(program);
+        }
+        return NULL;
+    }
+
+    return program;
+}
+
+// Cache is just an optimization, so any failure here is ignored
+static void SaveCachedProgram(cl_program program, const char *cacheDir, const char *path, const char *key)
+{
+    char tmpPath[CL_CACHE_PATH_SIZE + 4];
+    size_t binSize = 0, keySize = strlen(key) + 1;
+    unsigned char *bin;
+    FILE *file;
+    int ok;
+
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &binSize, NULL) != CL_SUCCESS || binSize == 0)
+    {
+        return;
+    }
+
+    bin = (unsigned char *)malloc(binSize);
+    if (!bin)
+    {
+        return;
+    }
+
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(unsigned char *), &bin, NULL) != CL_SUCCESS)
+    {
+        free(bin);
+        return;
+    }
+
+    MAKE_DIR(cacheDir);
+
+    // Other processes may read the cache, so file is written aside and renamed
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+    file = fopen(tmpPath, "wb");
+    if (!file)
+    {
+        free(bin);
+        return;
+    }
+
+    ok = fwrite(key, 1, keySize, file) == keySize && fwrite(bin, 1, binSize, file) == binSize;
+    ok = !fclose(file) && ok;
+    free(bin);
+
+    if (ok)
+    {
+        remove(path);
+        ok = !rename(tmpPath, path);
+    }
+
+    if (!ok)
+    {
+        remove(tmpPath);
+    }
+}
+
 int TerminateOpenCL( clState* state )
 {
     if( state == NULL )
@@ -94,6 +252,9 @@ int InitOpenCL( clState* state, clInitParams* params )
     cl_platform_id platformID;
     cl_device_id deviceID = (cl_device_id)0;
     char* sourceCode = NULL;
+    char cacheKey[CL_CACHE_KEY_SIZE];
+    char cachePath[CL_CACHE_PATH_SIZE];
+    int useCache, fromBinary;
     int notFound = 1;
     cl_uint i;
 
@@ -168,7 +329,7 @@ int InitOpenCL( clState* state, clInitParams* params )
     }
 
     //create command queue
-    state->queue = clCreateCommandQueue(state->context, deviceID, 0, NULL);
+    state->queue = clCreateCommandQueue(state->context, deviceID, params->queue_properties, NULL);
     if(state->queue == NULL)
     {
         TerminateOpenCL(state);
@@ -182,7 +343,19 @@ int InitOpenCL( clState* state, clInitParams* params )
         TerminateOpenCL(state);
         return 4; //can't find kernel source file
     }
-    state->program = clCreateProgramWithSource(state->context, 1, (const char**)&sourceCode, NULL, NULL);
+
+    //try cached binary first
+    useCache = params->binary_cache_dir[0] && !GetCacheKey(cacheKey, cachePath, deviceID, params, sourceCode);
+    if(useCache)
+    {
+        state->program = LoadCachedProgram(state->context, deviceID, cachePath, cacheKey);
+    }
+    fromBinary = state->program != NULL;
+
+    if(!fromBinary)
+    {
+        state->program = clCreateProgramWithSource(state->context, 1, (const char**)&sourceCode, NULL, NULL);
+    }
     if(state->program == NULL)
     {
         TerminateOpenCL(state);
@@ -193,6 +366,23 @@ int InitOpenCL( clState* state, clInitParams* params )
     //build program
     errNum = clBuildProgram(state->program, 0, NULL, params->build_params, NULL, NULL);
 
+    //binary was rejected by driver, so fall back to source
+    if(errNum != CL_SUCCESS && fromBinary)
+    {
+        clReleaseProgram(state->program);
+        fromBinary = 0;
+
+        state->program = clCreateProgramWithSource(state->context, 1, (const char**)&sourceCode, NULL, NULL);
+        if(state->program == NULL)
+        {
+            TerminateOpenCL(state);
+            free((void*)sourceCode);
+            return 5; //can't create create program with source
+        }
+
+        errNum = clBuildProgram(state->program, 0, NULL, params->build_params, NULL, NULL);
+    }
+
     if(errNum != CL_SUCCESS)
     {
         size_t len = 0;
@@ -209,6 +399,13 @@ int InitOpenCL( clState* state, clInitParams* params )
         return 6; //can't build program
     }
 
+    if(useCache && !fromBinary)
+    {
+        SaveCachedProgram(state->program, params->binary_cache_dir, cachePath, cacheKey);
+    }
+
+    free((void*)sourceCode);
+
     // Setting up device info
     state->device_info.device_ID = deviceID;
 
@@ -221,6 +418,9 @@ int InitOpenCL( clState* state, clInitParams* params )
 	errNum |= clGetDeviceInfo(deviceID, CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof(cl_uint),
 		&state->device_info.min_align, NULL);
 
+	errNum |= clGetDeviceInfo(deviceID, CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(cl_bool),
+		&state->device_info.host_unified_memory, NULL);
+
 	if(errNum != CL_SUCCESS)
 	{
 		TerminateOpenCL(state);
@@ -20,6 +20,7 @@ extern "C"
 #define CL_DEVICE_NAME_SIZE 256
 #define CL_KERNEL_FILE_NAME_SIZE 256
 #define CL_BUILD_PARAMS_STRING_SIZE 256
+#define CL_CACHE_DIR_SIZE 256
 
 //CL device info
 typedef struct clDeficeInfo
@@ -28,6 +29,7 @@ typedef struct clDeficeInfo
     int				num_cores;	
     char			device_name[CL_DEVICE_NAME_SIZE];
     cl_uint			min_align;
+    cl_bool			host_unified_memory; // Device and host share memory (CPU devices)
 }
 clDeviceInfo;
 
@@ -54,9 +56,21 @@ typedef struct clInitParams
     cl_device_type  device_type;
     char            build_params[CL_BUILD_PARAMS_STRING_SIZE];
     char            kernel_source_file_name[CL_KERNEL_FILE_NAME_SIZE];
+    char            binary_cache_dir[CL_CACHE_DIR_SIZE]; // Program binaries cache, empty to build from source only
+    cl_command_queue_properties queue_properties;       // Command queue properties (e.g. CL_QUEUE_PROFILING_ENABLE)
 }
 clInitParams;
 
+/**
+  * @brief      Creates context, queue and program for the first device of requested type
+  * @param		[out]	state			Pointer to CL context structure
+  * @param		[in]	params			Pointer to init params
+  * @return		                        0 if successful, non-0 on error
+  *
+  * If binary_cache_dir is set, program binary is taken from the cache when its key
+  * (device name, driver version, build params and source hash) matches, otherwise
+  * program is built from source and stored in the cache.
+  */
 int InitOpenCL( clState* state, clInitParams* params );
 int TerminateOpenCL( clState* state );
 
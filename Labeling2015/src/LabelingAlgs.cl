@@ -11,6 +11,137 @@ typedef enum TCoherence
 	COH_DEFAULT
 } TCoherence;
 
+// Labeled run, same as LabelingTools::TLabelRun
+typedef struct
+{
+	uint row;
+	uint l, r;
+	TLabel label;
+} TLabelRun;
+
+///////////////////////////////////////////////////////////////////////////////
+// IOCLLabeling kernels
+///////////////////////////////////////////////////////////////////////////////
+
+__kernel void ClearLabelsKernel(
+	__global TLabel	*labels	 // Image labels
+	)
+{
+	labels[get_global_id(0)] = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+__kernel void UnpackBitsKernel(
+	__global ulong	*bits,		// Bit packed image, pixel x is bit x % 64 of row word x / 64
+	__global TPixel	*pixels,	// Aligned image pixels
+	         uint	 stride,	// Words per packed row
+	         uint	 rows,		// Packed image height
+	         uint	 width		// Aligned image width
+	)
+{
+	const uint w = get_global_id(0);
+	const uint y = get_global_id(1);
+
+	const ulong word = w < stride && y < rows ? bits[y * stride + w] : 0;
+	const uint first = w << 6;
+	const uint last = min(first + 64, width);
+
+	__global TPixel *px = pixels + y * width;
+
+	for (uint x = first; x < last; ++x)
+		px[x] = (word >> (x - first)) & 1 ? 255 : 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Label compaction: used labels are flagged, exclusive prefix sum of flags is found block by block
+// (sums of blocks, scan of sums in the top level, scan inside blocks) and labels gather their sums
+
+__kernel void CompactMarkKernel(
+	__global TLabel	*labels, // Image labels
+	__global uint	*flags	 // Used label flags (cleared)
+	)
+{
+	const TLabel label = labels[get_global_id(0)];
+
+	if (label)
+		flags[label] = 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+__kernel void CompactSumKernel(
+	__global uint	*data,	// Level values
+	__global uint	*sums,	// Sums of level blocks
+	         uint	 count,	// Level size
+	         uint	 block	// Block size
+	)
+{
+	const uint first = get_global_id(0) * block;
+	const uint last = min(first + block, count);
+	uint sum = 0;
+
+	for (uint i = first; i < last; ++i)
+		sum += data[i];
+
+	sums[get_global_id(0)] = sum;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+__kernel void CompactScanTopKernel(
+	__global uint	*data,	// Top level values, total sum goes to data[count]
+	         uint	 count	// Level size
+	)
+{
+	uint sum = 0;
+
+	for (uint i = 0; i < count; ++i)
+	{
+		const uint value = data[i];
+		data[i] = sum;
+		sum += value;
+	}
+
+	data[count] = sum;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+__kernel void CompactScanKernel(
+	__global uint	*data,		// Level values
+	__global uint	*offsets,	// Scanned sums of level blocks
+	         uint	 count,		// Level size
+	         uint	 block		// Block size
+	)
+{
+	const uint first = get_global_id(0) * block;
+	const uint last = min(first + block, count);
+	uint sum = offsets[get_global_id(0)];
+
+	for (uint i = first; i < last; ++i)
+	{
+		const uint value = data[i];
+		data[i] = sum;
+		sum += value;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+__kernel void CompactGatherKernel(
+	__global TLabel	*labels, // Image labels
+	__global uint	*sums	 // Scanned used label flags
+	)
+{
+	const size_t pos = get_global_id(0);
+	const TLabel label = labels[pos];
+
+	if (label)
+		labels[pos] = sums[label] + 1;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // TOCLBinLabeling kernels
 ///////////////////////////////////////////////////////////////////////////////
@@ -198,9 +329,10 @@ __kernel void LBEQ2_Init(
 
 	testPattern = RemoveBorderBlocks(testPattern, px, py, w, h);
 
-	if (testPattern) {
-		sLabels[spos] = spos + 1;
+	// Scratch buffer is reused between calls, so background super pixels are cleared too
+	sLabels[spos] = testPattern ? spos + 1 : 0;
 
+	if (testPattern) {
 		if ((testPattern & 1        && TestBit(pixels, px, py, -1, -1, w, h)))
 			conn = 1;
 		if ((testPattern & 1 << 0x1 && TestBit(pixels, px, py,  0, -1, w, h)) ||
@@ -400,6 +532,34 @@ __kernel void REFindRunsKernel(
 
 ///////////////////////////////////////////////////////////////////////////////
 
+__kernel void REFillRunsKernel(
+	__global TLabelRun	*maskRuns,  // Run-length encoded mask
+	__global uint		*offsets,   // First mask run of every row
+	__global TRun		*runs,      // Image runs
+	__global uint		*runNum,    // Run count in row
+	         uint        width      // Image width
+	)
+{
+	const size_t row = get_global_id(0);
+
+	uint rowPos = row * (width >> 1);
+	uint first = offsets[row];
+
+	__global TRun *curRun = runs + rowPos;
+
+	for (uint i = first; i < offsets[row + 1]; ++i)
+	{
+		curRun->lb = rowPos + i - first + 1;
+		curRun->l = maskRuns[i].l;
+		curRun->r = maskRuns[i].r;
+		++curRun;
+	}
+
+	runNum[row] = offsets[row + 1] - first;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
 int IsNeib(__global const TRun *r1, __global const TRun *r2)
 {
 	return
@@ -615,6 +775,31 @@ __kernel void RELabelKernel(
 	}
 }
 
+///////////////////////////////////////////////////////////////////////////////
+
+__kernel void REEmitRunsKernel(
+	__global TRun		*runs,      // Image runs
+	__global uint		*runNum,    // Run count inside a row
+	__global uint		*offsets,   // Scanned run counts, first output run of every row
+	__global TLabelRun	*out,       // Labeled runs
+	         uint        width      // Image width
+	)
+{
+	const size_t row = get_global_id(0);
+
+	__global TLabelRun *rowOut = out + offsets[row];
+
+	for (uint run = 0; run < runNum[row]; ++run)
+	{
+		const TRun curRun = runs[row * (width >> 1) + run];
+
+		rowOut[run].row = row;
+		rowOut[run].l = curRun.l;
+		rowOut[run].r = curRun.r;
+		rowOut[run].label = curRun.lb;
+	}
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // TOCLBinLabeling3D kernels
 ///////////////////////////////////////////////////////////////////////////////
@@ -824,9 +1009,10 @@ __kernel void BLEQ3D_Init(
 
 	testPattern = RemoveBorderBlocks3D(testPattern, sp, ssz);
 
-	if (testPattern) {
-		sLabels[spos] = spos + 1;
+	// Scratch buffer is reused between calls, so background super voxels are cleared too
+	sLabels[spos] = testPattern ? spos + 1 : 0;
 
+	if (testPattern) {
 		//            B    C1    C2    C3    C4    PX1 PY1 PZ1  PX2 PY2 PZ2  PX3 PY3 PZ3  PX3 PY3 PZ3
 		TEST_CONN1(  0,     0,                     -1, -1, -1);                                        // Slice 1
 		TEST_CONN2(  1,     1,    2,                0, -1, -1,   1, -1, -1);
@@ -7,6 +7,7 @@
 #include "cvlabeling_imagelab.h"
 
 #include <limits>
+#include <atomic>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv/cv.h>
@@ -27,12 +28,14 @@ namespace LabelingTools
 		TPixel *pix = pixels.data;
 		TLabel *lb = reinterpret_cast<TLabel*>(labels.data);
 
-#		pragma omp parallel for
-		for (int i = 0; i < pixels.total(); ++i)
-		{
-			if (pixels.data[i])
-				lb[i] = 1;			
-		}
+		profile_.Run("Binarize", pixels.total() * (sizeof(TPixel) + sizeof(TLabel)), [&] {
+#			pragma omp parallel for
+			for (int i = 0; i < pixels.total(); ++i)
+			{
+				if (pixels.data[i])
+					lb[i] = 1;			
+			}
+		});
 	}
 
 	///////////////////////////////////////////////////////////////////////////////
@@ -41,25 +44,87 @@ namespace LabelingTools
 
 	void TOpenCVLabeling::DoLabel(const TImage& pixels, TImage& labels, char threads, TCoherence coh)
 	{
-		cv::connectedComponents(pixels, labels, coh == COH_8 ? 8 : 4, CV_32SC1);
+		profile_.Run("Label", pixels.total() * (sizeof(TPixel) + sizeof(TLabel)), [&] {
+			labelCount_ = cv::connectedComponents(pixels, labels, coh == COH_8 ? 8 : 4, CV_32SC1) - 1; // Background is counted too
+		});
 	}
 
 	///////////////////////////////////////////////////////////////////////////////
 	// TBlockGranaLabeling declaration
 	///////////////////////////////////////////////////////////////////////////////
 
+	TBlockGranaLabeling::TBlockGranaLabeling(bool useUnionFind)
+		: useUnionFind_(useUnionFind)
+	{
+		/* Empty */
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
 	void TBlockGranaLabeling::DoLabel(const TImage& pixels, TImage& labels, char threads, TCoherence coh)
 	{
 		THROW_IF(coh == COH_4, "TLabelEquivalenceX2::DoLabel : Method does not support 4x connectivity");
 
+		SetupThreads(threads);
+
 		int numLabels;
-		cvLabelingImageLab(&IplImage(pixels), &IplImage(labels), 255, &numLabels);
+		const size_t bufferSize = cvLabelingImageLabBufferSize(labels.cols, labels.rows);
+		int *buffer = workspace_.Get<int>(WS_ALG, bufferSize);
+
+		// Second scan passes every block row to stats right after its labels are written
+		CvLabelingRowsDone addRows = [](IplImage *dst, int y0, int y1, void *stats)
+		{
+			for (int y = y0; y < y1; ++y)
+				static_cast<TStatsAccumulator*>(stats)->AddRow(reinterpret_cast<TLabel*>(dst->imageData + y * dst->widthStep), y, dst->width);
+		};
+
+		const size_t pixBytes = packed_ ? packed_->Bytes() : pixels.total() * sizeof(TPixel);
+
+		profile_.Run("Label", pixBytes + labels.total() * sizeof(TLabel) + bufferSize * sizeof(int), [&] {
+			if (packed_)
+				cvLabelingImageLabPacked(packed_->Row(0), packed_->Stride(), &IplImage(labels), &numLabels, useUnionFind_, buffer,
+										 stats_.Active() ? addRows : nullptr, &stats_);
+			else
+				cvLabelingImageLabParallel(&IplImage(pixels), &IplImage(labels), 255, &numLabels, useUnionFind_, buffer,
+										   stats_.Active() ? addRows : nullptr, &stats_);
+		});
+
+		stats_.SetCollected();
+		labelCount_ = numLabels; // Labels are consecutive already
 	}
 
 	///////////////////////////////////////////////////////////////////////////////
 	// TRunLabeling declaration
 	///////////////////////////////////////////////////////////////////////////////
 
+	// Provisional labels form a forest where parent is always smaller than child
+	inline TLabel FindRunLabel(const vector<TLabel>& objects, TLabel label)
+	{
+		while (objects[label] != label)
+			label = objects[label];
+
+		return label;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	// Merges two label trees and returns the new root
+	inline TLabel MergeRunLabels(vector<TLabel>& objects, TLabel lb1, TLabel lb2)
+	{
+		lb1 = FindRunLabel(objects, lb1);
+		lb2 = FindRunLabel(objects, lb2);
+
+		if (lb1 < lb2) {
+			objects[lb2] = lb1;
+			return lb1;
+		}
+		
+		objects[lb1] = lb2;
+		return lb2;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
 	TRunLabeling::TRunLabeling(void)
 	{
 		Top = 0;
@@ -76,55 +141,126 @@ namespace LabelingTools
 
 	///////////////////////////////////////////////////////////////////////////////
 
-	void TRunLabeling::SetRunLabel(void)
+	void TRunLabeling::ShrinkWorkspace(void)
+	{
+		ILabeling::ShrinkWorkspace();
+
+		Runs.shrink_to_fit();
+		Objects.shrink_to_fit();
+
+		for (auto &strip : Strips)
+			strip->ShrinkWorkspace();
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	void TRunLabeling::ResetWorkspace(void)
+	{
+		ILabeling::ResetWorkspace();
+
+		TRuns().swap(Runs);
+		vector<TLabel>().swap(Objects);
+		Strips.clear();
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	void TRunLabeling::SetRunLabel(TRun& run)
 	{
-		CurRun->Label = UINT_MAX; //setting up maximum value for current label
-		LabelStack.clear();
+		run.Label = 0;
 
-		//for all runs in previous row
-		for (int i = 0; i < LastRow.size(); i++)
+		//skipping upper row runs which lie to the left of current one
+		while (LastRow < CurRow && Runs[LastRow].r + ConPix < run.l)
+			++LastRow;
+
+		//merging provisional labels of all connected runs in upper row
+		for (size_t i = LastRow; i < CurRow && Runs[i].l <= run.r + ConPix; ++i)
 		{
-			//if run is connected to current
-			if ((int)LastRow[i]->r >= (int)CurRun->l - ConPix &&
-				LastRow[i]->l <= CurRun->r + ConPix)
-			{
-				//Getting it's provisional label
-				//if provisional label is smaller than current run label, we're assigning it to 
-				//current run and adding to stack
-				if (Objects[LastRow[i]->Label] < CurRun->Label)
-				{
-					CurRun->Label = Objects[LastRow[i]->Label];
-					LabelStack.push_back(CurRun->Label);
-				}
-				else
-				{
-					//if not then we're adding provisional label to stack
-					LabelStack.push_back(Objects[LastRow[i]->Label]);
-				}
-			}
+			run.Label = run.Label ? MergeRunLabels(Objects, run.Label, Runs[i].Label)
+								  : FindRunLabel(Objects, Runs[i].Label);
 		}
 
 		//if there's no connected runs, we're assigning new label
-		if (CurRun->Label == UINT_MAX)
+		if (!run.Label)
 		{
-			Objects.push_back(Objects.size());
-			CurRun->Label = Objects.size() - 1;
+			run.Label = Objects.size();
+			Objects.push_back(run.Label);
 		}
-		else
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	void TRunLabeling::Scan(const TImage& pixels, uint top, uint bottom)
+	{
+		Runs.clear();
+		Objects.assign(1, 0);
+		LastRow = CurRow = 0;
+
+		for (uint row = top; row < bottom; ++row)
 		{
-			//if there are then we're reassigning all provisional labels to current
-//#			pragma omp parallel for
-			for (int i = 1; i < Objects.size(); ++i)
+			const TPixel *px = pixels.ptr<TPixel>(row);
+			CurRow = Runs.size();
+
+			for (uint i = 0; i < uint(pixels.cols); ++i)
 			{
-				for (int j = 0; j < LabelStack.size(); ++j)
-				{
-					if (Objects[i] == LabelStack[j])
-					{
-						Objects[i] = CurRun->Label;
-						continue;
-					}
-				}
+				if (!px[i])
+					continue;
+
+				TRun run;
+				run.l = i;
+				run.Row = row;
+
+				while (i + 1 < uint(pixels.cols) && px[i + 1])
+					++i;
+
+				run.r = i;
+
+				SetRunLabel(run);
+				Runs.push_back(run);
 			}
+
+			LastRow = CurRow;
+		}
+
+		//flattening provisional labels, parents always go first
+		for (size_t i = 1; i < Objects.size(); ++i)
+			Objects[i] = Objects[Objects[i]];
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	void TRunLabeling::MergeStrips(const TRunLabeling& upper, uint upperOffset, uint lowerOffset, vector<TLabel>& parents) const
+	{
+		//finding first run in upper strip bottom row
+		size_t u = upper.Runs.size();
+		while (u > 0 && upper.Runs[u - 1].Row == upper.Bottom - 1)
+			--u;
+
+		//merging it with top row of current strip
+		for (size_t i = 0; i < Runs.size() && Runs[i].Row == Top; ++i)
+		{
+			while (u < upper.Runs.size() && upper.Runs[u].r + ConPix < Runs[i].l)
+				++u;
+
+			for (size_t j = u; j < upper.Runs.size() && upper.Runs[j].l <= Runs[i].r + ConPix; ++j)
+				MergeRunLabels(parents, upperOffset + upper.Runs[j].Label, lowerOffset + Runs[i].Label);
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	void TRunLabeling::SetLabels(TImage& labels, const vector<TLabel>& parents, uint offset, TStatsAccumulator *stats)
+	{
+		for (const TRun& run : Runs)
+		{
+			TLabel label = FindRunLabel(parents, offset + run.Label);
+			TLabel *lb = labels.ptr<TLabel>(run.Row);
+
+			for (uint i = run.l; i <= run.r; ++i)
+				lb[i] = label;
+
+			if (stats)
+				stats->AddRun(label, run.Row, run.l, run.r);
 		}
 	}
 
@@ -132,76 +268,83 @@ namespace LabelingTools
 
 	void TRunLabeling::DoLabel(const TImage& pixels, TImage& labels, char threads, TCoherence coh)
 	{
-		//Setting thread count
-		if (Bottom == 0)
-			SetupThreads(threads);
+		const int MIN_STRIP_HEIGHT = 16; //avoids strips with more boundary than body rows
 
 		ConPix = int(coh == COH_8); //represents if we need additional 
 									//pixels at left and right due to the 8x coherence
 
-		Objects.reserve((pixels.rows * pixels.cols) >> 2);
-		Runs.reserve(Objects.size());
-		LastRow.reserve(pixels.cols >> 1);
-		CurRow.reserve(LastRow.size());
-		LabelStack.reserve(pixels.rows);
-
-		CurRun = 0; //current run
-		Objects.push_back(0);
-		if (Top > Bottom || Bottom > labels.rows - 1 || Bottom == 0)
+		//labeling only the given strip
+		if (Bottom != 0)
 		{
-			Top = 0;
-			Bottom = labels.rows - 1;
+			THROW_IF(Top >= Bottom || Bottom > uint(pixels.rows), "TRunLabeling::DoLabel : Wrong strip bounds");
+
+			Scan(pixels, Top, Bottom);
+			SetLabels(labels, Objects, 0, stats_.Active() ? &stats_ : nullptr);
+			stats_.SetCollected();
+			return;
 		}
 
-		//Main cycle
-		for (unsigned int Row = Top; Row < Bottom; ++Row)
+		SetupThreads(threads);
+
+		//splitting image into horizontal strips, one per thread
+		const int stripCount = max(1, min(omp_get_max_threads(), pixels.rows / MIN_STRIP_HEIGHT));
+
+		while (Strips.size() < stripCount)
+			Strips.push_back(std::make_shared<TRunLabeling>());
+
+		for (int i = 0; i < stripCount; ++i)
 		{
-			//scanning pixels in current row
-			for (unsigned int i = 0; i < labels.cols; ++i)
+			Strips[i]->Top = pixels.rows * i / stripCount;
+			Strips[i]->Bottom = pixels.rows * (i + 1) / stripCount;
+			Strips[i]->ConPix = ConPix;
+		}
+
+		profile_.Run("Scan", pixels.total() * sizeof(TPixel), [&] {
+#			pragma omp parallel for schedule(dynamic)
+			for (int i = 0; i < stripCount; ++i)
 			{
-				//if current pixel is black or it's row end
-				if (!pixels.data[Row * labels.cols + i] || i == labels.cols - 1)
-				{
-					//if we're in run
-					if (i > 0)
-						if (CurRun != 0)
-						{
-							//saving current run end
-							CurRun->r = i - 1;
-							//checking run label
-							SetRunLabel();
-							CurRun = 0;
-						}
-				}
-				else
-				{ //if it's white
-					//if it's first pixel in run
-					if (CurRun == 0)
-					{
-						//creating new run
-						CurRun = new TRun;
-						CurRun->l = i;
-						CurRun->Row = Row;
-						Runs.push_back(CurRun);
-						CurRow.push_back(CurRun);
-					}
-				}
+				Strips[i]->Scan(pixels, Strips[i]->Top, Strips[i]->Bottom);
 			}
-			//moving to next row
-			LastRow.clear();
-			LastRow = CurRow;
-			CurRow.clear();
-		}
+		});
+
+		//gathering strip labels into the single forest
+		vector<uint> offsets(stripCount);
+		uint labelCount = 0;
 
-		//setting up labels
-//#		pragma omp parallel for
-		for (long int i = 0; i < Runs.size(); ++i)
+		for (int i = 0; i < stripCount; ++i)
 		{
-			for (long int j = Runs[i]->l; j <= Runs[i]->r; ++j)
+			offsets[i] = labelCount;
+			labelCount += Strips[i]->Objects.size() - 1;
+		}
+
+		Objects.resize(labelCount + 1);
+		Objects[0] = 0;
+
+		profile_.Run("MergeStrips", 2 * Objects.size() * sizeof(TLabel), [&] {
+#			pragma omp parallel for
+			for (int i = 0; i < stripCount; ++i)
 			{
-				labels.at<TLabel>(Runs[i]->Row, j) = Objects[Runs[i]->Label];
+				for (size_t j = 1; j < Strips[i]->Objects.size(); ++j)
+					Objects[offsets[i] + j] = offsets[i] + Strips[i]->Objects[j];
 			}
-		}
+
+			//merging labels across strip boundaries
+			for (int i = 1; i < stripCount; ++i)
+				Strips[i]->MergeStrips(*Strips[i - 1], offsets[i - 1], offsets[i], Objects);
+		});
+
+		//setting up labels, strips add them to stats of the whole image
+		TStatsAccumulator *stats = stats_.Active() ? &stats_ : nullptr;
+
+		profile_.Run("SetLabels", labels.total() * sizeof(TLabel), [&] {
+#			pragma omp parallel for schedule(dynamic)
+			for (int i = 0; i < stripCount; ++i)
+			{
+				Strips[i]->SetLabels(labels, Objects, offsets[i], stats);
+			}
+		});
+
+		stats_.SetCollected();
 	}
 
 	///////////////////////////////////////////////////////////////////////////////
@@ -213,11 +356,14 @@ namespace LabelingTools
 		if (coh == COH_DEFAULT) coh = COH_4;
 
 		SetupThreads(threads);
-		InitMap(pixels, labels);
+
+		const size_t lbBytes = labels.total() * sizeof(TLabel);
+		profile_.Run("InitMap", pixels.total() * sizeof(TPixel) + lbBytes, [&] { InitMap(pixels, labels); });
 		
 		while (true) {
-			if (Scan(labels, coh)) break;
-			Analyze(labels);			
+			++profile_.iterations;
+			if (profile_.Run("Scan", lbBytes, [&] { return Scan(labels, coh); })) break;
+			profile_.Run("Analyze", lbBytes, [&] { Analyze(labels); });
 		}
 	}
 
@@ -225,8 +371,6 @@ namespace LabelingTools
 
 	void TLabelDistribution::InitMap(const TImage& pixels, TImage& labels)
 	{
-		labels = TImage(pixels.rows, pixels.cols, CV_32SC1);
-
 		TLabel *lb = reinterpret_cast<TLabel*>(labels.data);
 		TPixel *px = reinterpret_cast<TPixel*>(pixels.data);
 
@@ -329,6 +473,147 @@ namespace LabelingTools
 		}
 	}
 
+	///////////////////////////////////////////////////////////////////////////////
+	// TLabelUnionFind declaration
+	///////////////////////////////////////////////////////////////////////////////
+
+	typedef std::atomic<TLabel> TAtomicLabel;
+
+	static_assert(sizeof(TAtomicLabel) == sizeof(TLabel), "Atomic label must have the same layout as TLabel");
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	// Labels are 1-based parent links: lb[label - 1] == label means label is a root
+	inline TLabel FindRoot(const TAtomicLabel *lb, TLabel label)
+	{
+		TLabel parent = lb[label - 1].load(std::memory_order_relaxed);
+
+		while (parent != label) {
+			label = parent;
+			parent = lb[label - 1].load(std::memory_order_relaxed);
+		}
+
+		return label;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	// Atomically sets lb = min(lb, label) and returns the previous value
+	inline TLabel AtomicMin(TAtomicLabel &lb, TLabel label)
+	{
+		TLabel old = lb.load(std::memory_order_relaxed);
+		while (label < old && !lb.compare_exchange_weak(old, label, std::memory_order_relaxed));
+
+		return old;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	// Merges two trees, the smaller root always becomes the parent. If another thread
+	// relinks a root in between, the displaced parent is merged on the next round.
+	inline void Union(TAtomicLabel *lb, TLabel lb1, TLabel lb2)
+	{
+		bool done = false;
+
+		while (!done) {
+			lb1 = FindRoot(lb, lb1);
+			lb2 = FindRoot(lb, lb2);
+
+			if (lb1 < lb2) {
+				TLabel old = AtomicMin(lb[lb2 - 1], lb1);
+				done = old == lb2;
+				lb2 = old;
+			} else if (lb2 < lb1) {
+				TLabel old = AtomicMin(lb[lb1 - 1], lb2);
+				done = old == lb1;
+				lb1 = old;
+			} else {
+				done = true;
+			}
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	void TLabelUnionFind::DoLabel(const TImage& pixels, TImage& labels, char threads, TCoherence coh)
+	{
+		if (coh == COH_DEFAULT) coh = COH_4;
+
+		SetupThreads(threads);
+
+		const size_t pixBytes = pixels.total() * sizeof(TPixel), lbBytes = labels.total() * sizeof(TLabel);
+
+		profile_.Run("InitMap", pixBytes + lbBytes, [&] { InitMap(pixels, labels); });
+		profile_.Run("Link", pixBytes + lbBytes, [&] { Link(pixels, labels, coh); });
+		profile_.Run("Flatten", lbBytes, [&] { Flatten(labels); });
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	void TLabelUnionFind::InitMap(const TImage& pixels, TImage& labels)
+	{
+		TLabel *lb = reinterpret_cast<TLabel*>(labels.data);
+		const TPixel *px = pixels.data;
+
+		#pragma omp parallel for
+		for (long int i = 0; i < labels.total(); ++i)
+		{
+			lb[i] = px[i] ? i + 1 : 0;
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	void TLabelUnionFind::Link(const TImage& pixels, TImage& labels, TCoherence coh)
+	{
+		TAtomicLabel *lb = reinterpret_cast<TAtomicLabel*>(labels.data);
+		const TPixel *px = pixels.data;
+		const int w = pixels.cols, h = pixels.rows;
+
+		#pragma omp parallel for
+		for (int y = 0; y < h; ++y) {
+			for (int x = 0; x < w; ++x) {
+				const size_t pos = x + y * w;
+
+				if (!px[pos]) continue;
+
+				const TLabel label = pos + 1;
+				const bool hasN = y > 0 && px[pos - w];
+
+				// For 8x coherence NW, NE and W pixels touch N one, so they
+				// are merged through it and may be skipped
+				if (hasN)
+					Union(lb, label, pos - w + 1);
+
+				if (x > 0 && px[pos - 1] && (coh == COH_4 || !hasN))
+					Union(lb, label, pos);
+
+				if (coh == COH_8 && !hasN && y > 0) {
+					if (x > 0 && px[pos - w - 1])
+						Union(lb, label, pos - w);
+					if (x < w - 1 && px[pos - w + 1])
+						Union(lb, label, pos - w + 2);
+				}
+			}
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	void TLabelUnionFind::Flatten(TImage& labels)
+	{
+		TAtomicLabel *lb = reinterpret_cast<TAtomicLabel*>(labels.data);
+
+		#pragma omp parallel for
+		for (long int i = 0; i < labels.total(); ++i)
+		{
+			TLabel label = lb[i].load(std::memory_order_relaxed);
+
+			if (label)
+				lb[i].store(FindRoot(lb, label), std::memory_order_relaxed);
+		}
+	}
+
 	///////////////////////////////////////////////////////////////////////////////
 	// TLabelEquivalenceX2 declaration
 	///////////////////////////////////////////////////////////////////////////////
@@ -338,14 +623,19 @@ namespace LabelingTools
 		THROW_IF(coh == COH_4, "TLabelEquivalenceX2::DoLabel : Method does not support 4x connectivity");		
 
 		SetupThreads(threads);
-		TSPixels sPixels = InitSPixels(pixels);
+
+		const size_t pixBytes = pixels.total() * sizeof(TPixel), lbBytes = labels.total() * sizeof(TLabel);
+		const size_t spBytes = ((pixels.cols + 1) / 2) * ((pixels.rows + 1) / 2) * sizeof(TSPixel);
+
+		TSPixels sPixels = profile_.Run("InitSPixels", pixBytes + spBytes, [&] { return InitSPixels(pixels); });
 			
 		while (true) {
-			if (Scan(sPixels)) break;
-			Analyze(sPixels);
+			++profile_.iterations;
+			if (profile_.Run("Scan", spBytes, [&] { return Scan(sPixels); })) break;
+			profile_.Run("Analyze", spBytes, [&] { Analyze(sPixels); });
 		}
 
-		SetFinalLabels(pixels, labels, sPixels);
+		profile_.Run("SetFinalLabels", pixBytes + spBytes + lbBytes, [&] { SetFinalLabels(pixels, labels, sPixels); });
 	}
 
 	///////////////////////////////////////////////////////////////////////////////
@@ -379,7 +669,8 @@ namespace LabelingTools
 
 	TLabelEquivalenceX2::TSPixels TLabelEquivalenceX2::InitSPixels(const TImage& pixels)
 	{
-		TSPixels sPixels(ceil(static_cast<float>(pixels.cols) / 2), ceil(static_cast<float>(pixels.rows) / 2));
+		const size_t spw = (pixels.cols + 1) / 2, sph = (pixels.rows + 1) / 2;
+		TSPixels sPixels(workspace_.Get<TSPixel>(WS_ALG, spw * sph), spw, sph);
 		int w = pixels.cols, h = pixels.rows;
 		TPixel *pix = pixels.data;
 		
@@ -437,7 +728,7 @@ namespace LabelingTools
 	bool TLabelEquivalenceX2::Scan(TSPixels& sPixels)
 	{
 		bool noChanges = true;
-		TSPixel *sPix = sPixels.data.data();
+		TSPixel *sPix = sPixels.data;
 
 		#pragma omp parallel for
 		for (int y = 0; y < sPixels.h; ++y) {
@@ -469,7 +760,7 @@ namespace LabelingTools
 	TLabel TLabelEquivalenceX2::MinSPixLabel(const TSPixels& sPixels, int x, int y)
 	{		
 		TLabel minLabel;
-		const TSPixel *sPix = sPixels.data.data();
+		const TSPixel *sPix = sPixels.data;
 		uchar conn = sPix[x + y * sPixels.w].conn;
 		int w = sPixels.w, h = sPixels.h;
 
@@ -512,26 +803,104 @@ namespace LabelingTools
 		//labels = TImage(pixels.rows, pixels.cols, CV_32SC1, cv::Scalar(0));
 		TLabel *lb = reinterpret_cast<TLabel*>(labels.data);
 		TPixel *pix = pixels.data;
+		const bool wantStats = stats_.Active();
 
 		#pragma omp parallel for
 		for (int y = 0; y < pixels.rows; ++y) {
+			TLabel runLabel = 0; // Stats get runs of equal labels
+			int runLeft = 0;
+
 			for (int x = 0; x < pixels.cols; ++x) {				
 				const size_t sPos = x / 2 + y / 2 * sPixels.w;
 				const size_t pos = x + y * pixels.cols;
 
-				TLabel label = sPixels[sPos].lb;
+				TLabel label = pix[pos] ? sPixels[sPos].lb + 1 : 0;
+
+				if (label) {
+					lb[pos] = label;
+				}
+
+				if (wantStats && label != runLabel) {
+					if (runLabel)
+						stats_.AddRun(runLabel, y, runLeft, x - 1);
 
-				if (pix[pos]) {
-					lb[pos] = label + 1;
+					runLabel = label;
+					runLeft = x;
 				}
 			}
+
+			if (runLabel)
+				stats_.AddRun(runLabel, y, runLeft, pixels.cols - 1);
 		}
+
+		if (wantStats)
+			stats_.SetCollected();
 	}
 
 	///////////////////////////////////////////////////////////////////////////////
 	// TRunEqivLabeling declaration
 	///////////////////////////////////////////////////////////////////////////////
 
+	TTime TRunEqivLabeling::LabelRuns(const TImage& pixels, TLabelRuns& runs, char threads, TCoherence coh, bool binary)
+	{
+		THROW_IF(pixels.dims > 2, "TRunEqivLabeling::LabelRuns : Runs are supported for 2D images only");
+
+		return LabelIntoRuns(BinaryInput(pixels, binary), runs, threads, coh);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	TTime TRunEqivLabeling::LabelRuns(const TRunMask& mask, TLabelRuns& runs, char threads, TCoherence coh)
+	{
+		mask_ = &mask;
+		try
+		{
+			LabelIntoRuns(TImage(), runs, threads, coh);
+		}
+		catch (...)
+		{
+			mask_ = nullptr;
+			throw;
+		}
+		mask_ = nullptr;
+
+		return profile_.total;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	TTime TRunEqivLabeling::LabelIntoRuns(const TImage& binImg, TLabelRuns& runs, char threads, TCoherence coh)
+	{
+		TImage labels; // Stays empty
+
+		profile_.Reset();
+		labelCount_ = 0;
+
+		watch_.reset();
+		watch_.start();
+
+		runsOut_ = &runs;
+		try
+		{
+			DoLabel(binImg, labels, threads, coh);
+		}
+		catch (...)
+		{
+			runsOut_ = nullptr;
+			throw;
+		}
+		runsOut_ = nullptr;
+
+		if (Compaction())
+			labelCount_ = profile_.Run("Compact", runs.size() * sizeof(TLabelRun), [&] { return CompactLabels(runs, threads); });
+
+		watch_.stop();
+
+		return profile_.total = watch_.getTime() * 1000;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
 	void TRunEqivLabeling::DoLabel(const TImage& pixels, TImage& labels, char threads, TCoherence coh)
 	{
 		THROW_IF(coh == COH_4, "TRunEqivLabeling::DoLabel : 4x connectivity is not implemented for this method");
@@ -540,27 +909,33 @@ namespace LabelingTools
 
 		pixels_ = &pixels;
 		labels_ = &labels;
-		width_ = pixels_->cols;
-		height_ = pixels_->rows;
+		width_ = mask_ ? mask_->cols : packed_ ? packed_->cols : pixels_->cols;
+		height_ = mask_ ? mask_->rows : packed_ ? packed_->rows : pixels_->rows;
 
-		InitRuns();
-		FindRuns();
-		FindNeibRuns();
-		Scan();
-		SetFinalLabels();
+		const size_t pixBytes = packed_ ? packed_->Bytes() : pixels.total() * sizeof(TPixel), lbBytes = labels.total() * sizeof(TLabel);
+		const size_t runBytes = height_ * ((width_ >> 1) + 2) * sizeof(TRun);
 
-		delete runs_;
-		delete runNum_;
+		profile_.Run("InitRuns", height_ * sizeof(uint), [&] { InitRuns(); });
+		if (mask_)
+			profile_.Run("FillRuns", mask_->runs.size() * (sizeof(TLabelRun) + sizeof(TRun)), [&] { FillRuns(); });
+		else if (packed_)
+			profile_.Run("FindRuns", pixBytes + runBytes, [&] { FindPackedRuns(); });
+		else
+			profile_.Run("FindRuns", pixBytes + runBytes, [&] { FindRuns(); });
+		profile_.Run("FindNeibRuns", runBytes, [&] { FindNeibRuns(); });
+		Scan();
+		profile_.Run("SetFinalLabels", runBytes + lbBytes, [&] { SetFinalLabels(); });
 	}
 
 	///////////////////////////////////////////////////////////////////////////////
 
 	void TRunEqivLabeling::InitRuns(void)
 	{
-		size_ = height_ * (width_ >> 1);
+		runWidth_ = (width_ >> 1) + 2; // odd width runs and the row end mark
+		size_ = height_ * runWidth_;
 
-		runs_ = new TRun[size_];
-		runNum_ = new uint[height_];
+		runs_ = workspace_.Get<TRun>(WS_RUNS, size_);
+		runNum_ = workspace_.Get<uint>(WS_RUN_NUM, height_);
 
 		memset(runNum_, 0, sizeof(uint) * height_);
 	}
@@ -573,10 +948,10 @@ namespace LabelingTools
 		for (int row = 0; row < height_; ++row)
 		{
 			uint pixPos = row * width_;
-			uint rowPos = row * (width_ >> 1);
+			uint rowPos = row * runWidth_;
 
 			TPixel *curPix = reinterpret_cast<TPixel*>(pixels_->data) + pixPos;
-			TRun *curRun = runs_ + row * (width_ >> 1);
+			TRun *curRun = runs_ + row * runWidth_;
 
 			uint runPos = 0;
 			curRun->lb = 0;
@@ -607,147 +982,552 @@ namespace LabelingTools
 
 	///////////////////////////////////////////////////////////////////////////////
 
-	bool TRunEqivLabeling::IsNeib(const TRun *r1, const TRun *r2) const
+	void TRunEqivLabeling::FindPackedRuns(void)
 	{
-		return
-			(r1->l >= r2->l && r1->l <= r2->r) ||
-			(r1->r >= r2->l && r1->r <= r2->r) ||
-			(r2->r >= r1->l && r2->r <= r1->r) ||
-			(r2->r >= r1->l && r2->r <= r1->r);
+		const int stride = packed_->Stride();
+
+#		pragma omp parallel for schedule(dynamic)
+		for (int row = 0; row < height_; ++row)
+		{
+			const uint64 *bits = packed_->Row(row);
+			uint rowPos = row * runWidth_;
+			TRun *curRun = runs_ + rowPos;
+
+			uint runPos = 0;
+			bool inRun = false;
+
+			// Every bit scan finds the next run start or the next run end, empty words cost a single test
+			for (int w = 0; w < stride; ++w)
+			{
+				const uint64 word = bits[w];
+				uint bit = 0;
+
+				while (bit < 64)
+				{
+					const uint64 rest = (inRun ? ~word : word) >> bit;
+					if (!rest)
+						break;
+
+					bit += CountTrailingZeros(rest);
+
+					if (!inRun) {
+						curRun->lb = rowPos + ++runPos;
+						curRun->l = (w << 6) + bit;
+					} else {
+						curRun->r = (w << 6) + bit - 1;
+						++curRun;
+					}
+					inRun = !inRun;
+				}
+			}
+
+			// Bits past image width are zero, so only rows of full words may end in a run
+			if (inRun) {
+				curRun->r = width_ - 1;
+				++curRun;
+			}
+
+			curRun->lb = 0;
+			runNum_[row] = runPos;
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	void TRunEqivLabeling::FillRuns(void)
+	{
+		const vector<uint> offsets = MaskRowOffsets(*mask_);
+		const TLabelRun *maskRuns = mask_->runs.data();
+
+#		pragma omp parallel for
+		for (int row = 0; row < height_; ++row)
+		{
+			uint rowPos = row * runWidth_;
+			TRun *curRun = runs_ + rowPos;
+
+			runNum_[row] = offsets[row + 1] - offsets[row];
+
+			for (uint i = offsets[row]; i < offsets[row + 1]; ++i)
+			{
+				curRun->lb = rowPos + i - offsets[row] + 1;
+				curRun->l = maskRuns[i].l;
+				curRun->r = maskRuns[i].r;
+				++curRun;
+			}
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	bool TRunEqivLabeling::IsNeib(const TRun *r1, const TRun *r2) const
+	{
+		return
+			(r1->l >= r2->l && r1->l <= r2->r) ||
+			(r1->r >= r2->l && r1->r <= r2->r) ||
+			(r2->r >= r1->l && r2->r <= r1->r) ||
+			(r2->r >= r1->l && r2->r <= r1->r);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	void TRunEqivLabeling::FindNeibRuns(TRun *curRun, TRunSize *neibSize, const TRun *neibRow, uint *neibPos, uint runWidth)
+	{
+		int noNeib = 0;
+		neibSize->l = 1;
+		neibSize->r = 0;
+
+		while (*neibPos < runWidth && !noNeib)
+		{
+			if (IsNeib(curRun, neibRow + *neibPos)) {
+				if (neibSize->l > neibSize->r) {
+					neibSize->l = neibRow[*neibPos].lb - 1;
+				}
+				neibSize->r = neibRow[*neibPos].lb - 1;
+
+				if (*neibPos + 1 < runWidth   &&
+					neibRow[*neibPos + 1].lb &&
+					neibRow[*neibPos + 1].l <= curRun->r)
+				{
+					++(*neibPos);
+				}
+				else {
+					noNeib = 1;
+				}
+			}
+			else {
+				if (neibRow[*neibPos].r < curRun->l) {
+					++(*neibPos);
+				}
+				else {
+					noNeib = 1;
+				}
+			}
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	void TRunEqivLabeling::FindNeibRuns(void)
+	{		
+		uint runWidth = runWidth_;
+		TRun *runs = runs_;
+		
+#		pragma omp parallel for
+		for (int row = 0; row < height_; ++row)
+		{
+			TRun *curRun = runs + row * runWidth;
+			const TRun *topRow = curRun - runWidth;
+			const TRun *botRow = curRun + runWidth;
+
+			uint topPos = 0;
+			uint botPos = 0;
+
+			for (uint pos = 0; pos < runNum_[row]; ++pos)
+			{
+				if (row > 0) {					
+					FindNeibRuns(curRun, &curRun->top, topRow, &topPos, runNum_[row - 1]);
+				}else{
+					curRun->top.l = 1;
+					curRun->top.r = 0;
+				}
+
+				if (row < height_ - 1) {					
+					FindNeibRuns(curRun, &curRun->bot, botRow, &botPos, runNum_[row + 1]);
+				}else{
+					curRun->bot.l = 1;
+					curRun->bot.r = 0;
+				}
+
+				++curRun;
+			}
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	TLabel TRunEqivLabeling::MinRunLabel(uint pos)
+	{
+		TLabel minLabel = UINT_MAX;
+		TRun *runs = runs_;
+		TRun curRun = runs[pos];
+
+		if (curRun.top.l <= curRun.top.r) {
+			for (uint i = curRun.top.l; i < curRun.top.r + 1; ++i) {
+				minLabel = min(minLabel, runs[i].lb);
+			}
+		}
+
+		if (curRun.bot.l <= curRun.bot.r) {
+			for (uint i = curRun.bot.l; i < curRun.bot.r + 1; ++i) {
+				minLabel = min(minLabel, runs[i].lb);
+			}
+		}
+
+		return minLabel;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	void TRunEqivLabeling::Scan(void)
+	{
+		const size_t runBytes = size_ * sizeof(TRun);
+
+		while (true) {
+			++profile_.iterations;
+			if (profile_.Run("Scan", runBytes, [&] { return ScanRuns(); })) break;
+			profile_.Run("Analyze", runBytes, [&] { AnalyzeRuns(); });
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	bool TRunEqivLabeling::ScanRuns(void)
+	{
+		bool noChanges = true;
+		TRun *runs = runs_;
+		
+#		pragma omp parallel for
+		for (int row = 0; row < height_; ++row)
+		{
+			for (int pos = 0; pos < runNum_[row]; ++pos)
+			{				
+				TLabel label = runs[row * runWidth_ + pos].lb;
+
+				if (label)
+				{
+					TLabel minLabel = MinRunLabel(row * runWidth_ + pos);
+					
+					if (minLabel < label)
+					{
+						TLabel tmpLabel = runs[label - 1].lb;						
+
+						runs[label - 1].lb = min(tmpLabel, minLabel);
+						noChanges = false;
+					}
+				}
+			}
+		}
+
+		return noChanges;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	void TRunEqivLabeling::AnalyzeRuns(void)
+	{
+		TRun *runs = runs_;
+
+#		pragma omp parallel for
+		for (int row = 0; row < height_; ++row)
+		{
+			for (int pos = 0; pos < runNum_[row]; ++pos)
+			{
+				TRun *curRun = &runs[row * runWidth_ + pos];
+				TLabel label = curRun->lb;
+
+				if (label){
+					TLabel curLabel = runs[label - 1].lb;
+					while (curLabel != label)
+					{
+						label = runs[curLabel - 1].lb;
+						curLabel = runs[label - 1].lb;
+					}										
+
+					curRun->lb = label;
+				}
+			}
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	void TRunEqivLabeling::SetFinalLabels(void)
+	{
+		TRun *runs = runs_;
+		uint runWidth = runWidth_;
+		const bool wantStats = stats_.Active();
+
+		if (runsOut_)
+		{
+			// Row offsets in output come from run counts, so rows are filled in parallel
+			vector<uint> offsets(height_ + 1, 0);
+			for (uint row = 0; row < height_; ++row)
+				offsets[row + 1] = offsets[row] + runNum_[row];
+
+			runsOut_->resize(offsets[height_]);
+			TLabelRun *out = runsOut_->data();
+
+#			pragma omp parallel for
+			for (int row = 0; row < height_; ++row)
+			{
+				for (int run = 0; run < runNum_[row]; ++run)
+				{
+					const TRun &curRun = runs[row * runWidth + run];
+					out[offsets[row] + run] = TLabelRun{ uint(row), curRun.l, curRun.r, curRun.lb };
+
+					if (wantStats)
+						stats_.AddRun(curRun.lb, row, curRun.l, curRun.r);
+				}
+			}
+
+			if (wantStats)
+				stats_.SetCollected();
+
+			return;
+		}
+
+		TLabel *labels = reinterpret_cast<TLabel*>(labels_->data);
+
+#		pragma omp parallel for
+		for (int row = 0; row < height_; ++row)
+		{
+			for (int run = 0; run < runNum_[row]; ++run)
+			{				
+				TRun curRun = runs[row * runWidth_ + run];
+
+				if (curRun.lb) {
+					for (uint i = curRun.l; i < curRun.r + 1; ++i)
+					{
+						labels[row * width_ + i] = curRun.lb;
+					}
+
+					if (wantStats)
+						stats_.AddRun(curRun.lb, row, curRun.l, curRun.r);
+				}
+			}
+		}
+
+		if (wantStats)
+			stats_.SetCollected();
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// TLabelEquivalence3D declaration
+	///////////////////////////////////////////////////////////////////////////////
+
+	// Returns voxel value or 0 for voxels out of the image, OpenCV address style
+	template <typename T>
+	inline T GetVoxel(const T *data, int x, int y, int z, int w, int h, int d)
+	{
+		return x >= 0 && y >= 0 && z >= 0 && x < w && y < h && z < d 
+			? data[(static_cast<size_t>(x) * h + y) * d + z] 
+			: 0;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	void TLabelEquivalence3D::DoLabel(const TImage& pixels, TImage& labels, char threads, TCoherence coh)
+	{
+		SetupThreads(threads);
+
+		const size_t lbBytes = labels.total() * sizeof(TLabel);
+		profile_.Run("InitMap", pixels.total() * sizeof(TPixel) + lbBytes, [&] { InitMap(pixels, labels); });
+
+		while (true) {
+			++profile_.iterations;
+			if (profile_.Run("Scan", lbBytes, [&] { return Scan(labels); })) break;
+			profile_.Run("Analyze", lbBytes, [&] { Analyze(labels); });
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	void TLabelEquivalence3D::InitMap(const TImage& pixels, TImage& labels)
+	{
+		TLabel *lb = reinterpret_cast<TLabel*>(labels.data);
+		const TPixel *px = pixels.data;
+		const long int total = pixels.total();
+
+		#pragma omp parallel for
+		for (long int i = 0; i < total; ++i)
+		{
+			lb[i] = px[i] ? i + 1 : 0;
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	TLabel TLabelEquivalence3D::MinVoxelLabel(const TLabel *lb, int x, int y, int z, int w, int h, int d) const
+	{
+		TLabel minLabel = UINT_MAX;
+
+		for (int dx = -1; dx <= 1; ++dx)
+			for (int dy = -1; dy <= 1; ++dy)
+				for (int dz = -1; dz <= 1; ++dz)
+				{
+					TLabel label = GetVoxel(lb, x + dx, y + dy, z + dz, w, h, d);
+					if (label && label < minLabel)
+						minLabel = label;
+				}
+
+		return minLabel;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	bool TLabelEquivalence3D::Scan(TImage& labels)
+	{
+		bool noChanges = true;
+
+		TLabel *lb = reinterpret_cast<TLabel*>(labels.data);
+		const int w = labels.size[0], h = labels.size[1], d = labels.size[2];
+
+		#pragma omp parallel for
+		for (int x = 0; x < w; ++x) {
+			for (int y = 0; y < h; ++y) {
+				for (int z = 0; z < d; ++z) {
+					TLabel label = lb[(static_cast<size_t>(x) * h + y) * d + z];
+
+					if (label) {
+						TLabel minLabel = MinVoxelLabel(lb, x, y, z, w, h, d);
+
+						if (minLabel < label) {
+							TLabel tmpLabel = lb[label - 1];
+							lb[label - 1] = min(tmpLabel, minLabel);
+							noChanges = false;
+						}
+					}
+				}
+			}
+		}
+
+		return noChanges;
 	}
 
 	///////////////////////////////////////////////////////////////////////////////
 
-	void TRunEqivLabeling::FindNeibRuns(TRun *curRun, TRunSize *neibSize, const TRun *neibRow, uint *neibPos, uint runWidth)
+	void TLabelEquivalence3D::Analyze(TImage& labels)
 	{
-		int noNeib = 0;
-		neibSize->l = 1;
-		neibSize->r = 0;
+		TLabel *lb = reinterpret_cast<TLabel*>(labels.data);
+		const long int total = labels.total();
 
-		while (*neibPos < runWidth && !noNeib)
+		#pragma omp parallel for
+		for (long int i = 0; i < total; ++i)
 		{
-			if (IsNeib(curRun, neibRow + *neibPos)) {
-				if (neibSize->l > neibSize->r) {
-					neibSize->l = neibRow[*neibPos].lb - 1;
-				}
-				neibSize->r = neibRow[*neibPos].lb - 1;
+			TLabel label = lb[i];
 
-				if (*neibPos + 1 < runWidth   &&
-					neibRow[*neibPos + 1].lb &&
-					neibRow[*neibPos + 1].l <= curRun->r)
-				{
-					++(*neibPos);
-				}
-				else {
-					noNeib = 1;
-				}
-			}
-			else {
-				if (neibRow[*neibPos].r < curRun->l) {
-					++(*neibPos);
-				}
-				else {
-					noNeib = 1;
-				}
+			if (label) {
+				while (lb[label - 1] != label)
+					label = lb[label - 1];
+
+				lb[i] = label;
 			}
 		}
 	}
 
+	///////////////////////////////////////////////////////////////////////////////
+	// TBlockEquivalence3D declaration
 	///////////////////////////////////////////////////////////////////////////////
 
-	void TRunEqivLabeling::FindNeibRuns(void)
-	{		
-		uint runWidth = width_ >> 1;
-		TRun *runs = runs_;
-		
-#		pragma omp parallel for
-		for (int row = 0; row < height_; ++row)
-		{
-			TRun *curRun = runs + row * runWidth;
-			const TRun *topRow = curRun - runWidth;
-			const TRun *botRow = curRun + runWidth;
+	typedef unsigned long long TPattern3D; // Search block pattern, 4x4x4 voxels
 
-			uint topPos = 0;
-			uint botPos = 0;
+	#define SPT3D 0x77707770777ull // Search pattern for voxel A1, see BLEQ3D kernels for layout
+	#define BPT3D(X, Y, Z) ( SPT3D << (X) << (4 * (Y)) << (16 * (Z)) ) // Search pattern for (x, y, z) voxel
 
-			for (uint pos = 0; pos < runNum_[row]; ++pos)
-			{
-				if (row > 0) {					
-					FindNeibRuns(curRun, &curRun->top, topRow, &topPos, runNum_[row - 1]);
-				}else{
-					curRun->top.l = 1;
-					curRun->top.r = 0;
-				}
+	///////////////////////////////////////////////////////////////////////////////
 
-				if (row < height_ - 1) {					
-					FindNeibRuns(curRun, &curRun->bot, botRow, &botPos, runNum_[row + 1]);
-				}else{
-					curRun->bot.l = 1;
-					curRun->bot.r = 0;
+	// Tests if any voxel of neighbour block (dx, dy, dz) touches current block, 
+	// only voxels of the search block adjacent to current one are checked
+	inline bool TestNeibBlock(const TPixel *pix, TPattern3D testPattern, int px, int py, int pz, 
+		int dx, int dy, int dz, int w, int h, int d)
+	{
+		for (int vx = dx > 0 ? 2 : dx; vx <= (dx < 0 ? -1 : dx + 1); ++vx)
+			for (int vy = dy > 0 ? 2 : dy; vy <= (dy < 0 ? -1 : dy + 1); ++vy)
+				for (int vz = dz > 0 ? 2 : dz; vz <= (dz < 0 ? -1 : dz + 1); ++vz)
+				{
+					const int bit = (vx + 1) + 4 * (vy + 1) + 16 * (vz + 1);
+
+					if (testPattern >> bit & 1 && GetVoxel(pix, px + vx, py + vy, pz + vz, w, h, d))
+						return true;
 				}
 
-				++curRun;
-			}
-		}
+		return false;
 	}
 
 	///////////////////////////////////////////////////////////////////////////////
 
-	TLabel TRunEqivLabeling::MinRunLabel(uint pos)
+	TBlockEquivalence3D::TSVoxels TBlockEquivalence3D::InitSVoxels(const TImage& pixels)
 	{
-		TLabel minLabel = UINT_MAX;
-		TRun *runs = runs_;
-		TRun curRun = runs[pos];
+		const int w = pixels.size[0], h = pixels.size[1], d = pixels.size[2];
+		const TPixel *pix = pixels.data;
 
-		if (curRun.top.l <= curRun.top.r) {
-			for (uint i = curRun.top.l; i < curRun.top.r + 1; ++i) {
-				minLabel = min(minLabel, runs[i].lb);
-			}
-		}
+		const int spw = (w + 1) / 2, sph = (h + 1) / 2, spd = (d + 1) / 2;
+		TSVoxels sVoxels(workspace_.Get<TSVoxel>(WS_ALG, static_cast<size_t>(spw) * sph * spd), spw, sph, spd);
 
-		if (curRun.bot.l <= curRun.bot.r) {
-			for (uint i = curRun.bot.l; i < curRun.bot.r + 1; ++i) {
-				minLabel = min(minLabel, runs[i].lb);
+		#pragma omp parallel for
+		for (int spx = 0; spx < sVoxels.w; ++spx) {
+			for (int spy = 0; spy < sVoxels.h; ++spy) {
+				for (int spz = 0; spz < sVoxels.d; ++spz) {
+					const size_t spos = (static_cast<size_t>(spx) * sVoxels.h + spy) * sVoxels.d + spz;
+					const int px = spx * 2, py = spy * 2, pz = spz * 2;
+
+					TSVoxel sVox = { 0, 0 };
+					TPattern3D testPattern = 0;
+
+					for (int i = 0; i < 8; ++i) {
+						if (GetVoxel(pix, px + (i & 1), py + (i >> 1 & 1), pz + (i >> 2), w, h, d))
+							testPattern |= BPT3D(i & 1, i >> 1 & 1, i >> 2);
+					}
+
+					if (testPattern) {
+						sVox.lb = spos + 1;
+
+						// Connectivity bit of (dx, dy, dz) neighbour block is (dx + 1) + 3 * (dy + 1) + 9 * (dz + 1)
+						for (int dz = -1; dz <= 1; ++dz)
+							for (int dy = -1; dy <= 1; ++dy)
+								for (int dx = -1; dx <= 1; ++dx)
+								{
+									if ((dx || dy || dz) && TestNeibBlock(pix, testPattern, px, py, pz, dx, dy, dz, w, h, d))
+										sVox.conn |= 1u << ((dx + 1) + 3 * (dy + 1) + 9 * (dz + 1));
+								}
+					}
+
+					sVoxels[spos] = sVox;
+				}
 			}
 		}
 
-		return minLabel;
+		return sVoxels;
 	}
 
 	///////////////////////////////////////////////////////////////////////////////
 
-	void TRunEqivLabeling::Scan(void)
+	TLabel TBlockEquivalence3D::MinSVoxelLabel(const TSVoxels& sVoxels, int x, int y, int z) const
 	{
-		while (true) {
-			if (ScanRuns()) break;
-			AnalyzeRuns();
-		}
+		TLabel minLabel = UINT_MAX;
+		const uint conn = sVoxels[(static_cast<size_t>(x) * sVoxels.h + y) * sVoxels.d + z].conn;
+
+		for (int dz = -1; dz <= 1; ++dz)
+			for (int dy = -1; dy <= 1; ++dy)
+				for (int dx = -1; dx <= 1; ++dx)
+				{
+					if (conn & 1u << ((dx + 1) + 3 * (dy + 1) + 9 * (dz + 1)))
+						minLabel = min(minLabel, sVoxels[(static_cast<size_t>(x + dx) * sVoxels.h + y + dy) * sVoxels.d + z + dz].lb);
+				}
+
+		return minLabel;
 	}
 
 	///////////////////////////////////////////////////////////////////////////////
 
-	bool TRunEqivLabeling::ScanRuns(void)
+	bool TBlockEquivalence3D::Scan(TSVoxels& sVoxels)
 	{
 		bool noChanges = true;
-		TRun *runs = runs_;
-		
-#		pragma omp parallel for
-		for (int row = 0; row < height_; ++row)
-		{
-			for (int pos = 0; pos < runNum_[row]; ++pos)
-			{				
-				TLabel label = runs[row * (width_ >> 1) + pos].lb;
-
-				if (label)
-				{
-					TLabel minLabel = MinRunLabel(row * (width_ >> 1) + pos);
-					
-					if (minLabel < label)
-					{
-						TLabel tmpLabel = runs[label - 1].lb;						
 
-						runs[label - 1].lb = min(tmpLabel, minLabel);
-						noChanges = false;
+		#pragma omp parallel for
+		for (int x = 0; x < sVoxels.w; ++x) {
+			for (int y = 0; y < sVoxels.h; ++y) {
+				for (int z = 0; z < sVoxels.d; ++z) {
+					TLabel label = sVoxels[(static_cast<size_t>(x) * sVoxels.h + y) * sVoxels.d + z].lb;
+
+					if (label) {
+						TLabel minLabel = MinSVoxelLabel(sVoxels, x, y, z);
+
+						if (minLabel < label) {
+							TLabel tmpLabel = sVoxels[label - 1].lb;
+							sVoxels[label - 1].lb = min(tmpLabel, minLabel);
+							noChanges = false;
+						}
 					}
 				}
 			}
@@ -758,57 +1538,67 @@ namespace LabelingTools
 
 	///////////////////////////////////////////////////////////////////////////////
 
-	void TRunEqivLabeling::AnalyzeRuns(void)
+	void TBlockEquivalence3D::Analyze(TSVoxels& sVoxels)
 	{
-		TRun *runs = runs_;
+		const long int total = sVoxels.w * sVoxels.h * sVoxels.d;
 
-#		pragma omp parallel for
-		for (int row = 0; row < height_; ++row)
+		#pragma omp parallel for
+		for (long int i = 0; i < total; ++i)
 		{
-			for (int pos = 0; pos < runNum_[row]; ++pos)
-			{
-				TRun *curRun = &runs[row * (width_ >> 1) + pos];
-				TLabel label = curRun->lb;
+			TLabel label = sVoxels[i].lb;
 
-				if (label){
-					TLabel curLabel = runs[label - 1].lb;
-					while (curLabel != label)
-					{
-						label = runs[curLabel - 1].lb;
-						curLabel = runs[label - 1].lb;
-					}										
+			if (label) {
+				while (sVoxels[label - 1].lb != label)
+					label = sVoxels[label - 1].lb;
 
-					curRun->lb = label;
-				}
+				sVoxels[i].lb = label;
 			}
 		}
 	}
 
 	///////////////////////////////////////////////////////////////////////////////
 
-	void TRunEqivLabeling::SetFinalLabels(void)
+	void TBlockEquivalence3D::SetFinalLabels(const TImage& pixels, TImage& labels, const TSVoxels& sVoxels)
 	{
-		TLabel *labels = reinterpret_cast<TLabel*>(labels_->data);
-		TRun *runs = runs_;
-		uint runWidth = width_ >> 1;
-
-#		pragma omp parallel for
-		for (int row = 0; row < height_; ++row)
-		{
-			for (int run = 0; run < runNum_[row]; ++run)
-			{				
-				TRun curRun = runs[row * (width_ >> 1) + run];
+		const int w = pixels.size[0], h = pixels.size[1], d = pixels.size[2];
+		const TPixel *pix = pixels.data;
+		TLabel *lb = reinterpret_cast<TLabel*>(labels.data);
 
-				if (curRun.lb) {
-					for (uint i = curRun.l; i < curRun.r + 1; ++i)
-					{
-						labels[row * width_ + i] = curRun.lb;
-					}
+		#pragma omp parallel for
+		for (int x = 0; x < w; ++x) {
+			for (int y = 0; y < h; ++y) {
+				for (int z = 0; z < d; ++z) {
+					const size_t pos = (static_cast<size_t>(x) * h + y) * d + z;
+					const size_t spos = (static_cast<size_t>(x >> 1) * sVoxels.h + (y >> 1)) * sVoxels.d + (z >> 1);
+
+					if (pix[pos])
+						lb[pos] = sVoxels[spos].lb;
 				}
 			}
 		}
 	}
 
+	///////////////////////////////////////////////////////////////////////////////
+
+	void TBlockEquivalence3D::DoLabel(const TImage& pixels, TImage& labels, char threads, TCoherence coh)
+	{
+		SetupThreads(threads);
+
+		const size_t pixBytes = pixels.total() * sizeof(TPixel), lbBytes = labels.total() * sizeof(TLabel);
+		const size_t svBytes = static_cast<size_t>((pixels.size[0] + 1) / 2) * ((pixels.size[1] + 1) / 2) * 
+							   ((pixels.size[2] + 1) / 2) * sizeof(TSVoxel);
+
+		TSVoxels sVoxels = profile_.Run("InitSVoxels", pixBytes + svBytes, [&] { return InitSVoxels(pixels); });
+
+		while (true) {
+			++profile_.iterations;
+			if (profile_.Run("Scan", svBytes, [&] { return Scan(sVoxels); })) break;
+			profile_.Run("Analyze", svBytes, [&] { Analyze(sVoxels); });
+		}
+
+		profile_.Run("SetFinalLabels", pixBytes + svBytes + lbBytes, [&] { SetFinalLabels(pixels, labels, sVoxels); });
+	}
+
 	///////////////////////////////////////////////////////////////////////////////
 	// TOCLBinLabeling declaration
 	///////////////////////////////////////////////////////////////////////////////
@@ -850,14 +1640,14 @@ namespace LabelingTools
 		unsigned int imgHeight, TCoherence Coherence)
 	{
 		cl_int clError;
-		size_t workSize = pixels.Buffer().size();
+		size_t workSize = pixels.Size();
 
 		clError = clSetKernelArg(binKernel, 0, sizeof(cl_mem), (void*)&pixels.buffer);
 		clError |= clSetKernelArg(binKernel, 1, sizeof(cl_mem), (void*)&labels.buffer);
 
 		THROW_IF_OCL(clError, "TOCLBinLabeling::DoOCLLabel");
 
-		clEnqueueNDRangeKernel(State.queue, binKernel, 1, NULL, &workSize, NULL, 0, NULL, NULL);
+		clEnqueueNDRangeKernel(State.queue, binKernel, 1, NULL, &workSize, NULL, 0, NULL, KernelEvent(binKernel));
 	}
 
 	///////////////////////////////////////////////////////////////////////////////
@@ -913,11 +1703,11 @@ namespace LabelingTools
 		clError |= clSetKernelArg(initKernel, 1, sizeof(cl_mem), (void*)&labels.buffer);
 		THROW_IF_OCL(clError, "TOCLLabelDistribution::DoOCLLabel");
 
-		clError = clEnqueueNDRangeKernel(State.queue, initKernel, 1, NULL, &workSize, NULL, 0, NULL, NULL);
+		clError = clEnqueueNDRangeKernel(State.queue, initKernel, 1, NULL, &workSize, NULL, 0, NULL, KernelEvent(initKernel));
 		THROW_IF_OCL(clError, "TOCLLabelDistribution::DoOCLLabel");
 
 		// Labeling
-		TOCLBuffer<char> noChanges(*this, WRITE_ONLY, 1);
+		TOCLBuffer<char> &noChanges = NoChanges();
 
 		clError = clSetKernelArg(scanKernel, 0, sizeof(cl_mem), (void*)&labels.buffer);
 		clError |= clSetKernelArg(scanKernel, 1, sizeof(unsigned int), (void*)&imgWidth);
@@ -927,18 +1717,10 @@ namespace LabelingTools
 		clError |= clSetKernelArg(analizeKernel, 0, sizeof(cl_mem), (void*)&labels.buffer);
 		THROW_IF_OCL(clError, "TOCLLabelDistribution::DoOCLLabel");
 
-		unsigned int iter = 0;
-		while (true) {
-			noChanges[0] = 1;
-			noChanges.Push();
-
-			clError |= clEnqueueNDRangeKernel(State.queue, scanKernel, 1, NULL, &workSize, NULL, 0, NULL, NULL);
-
-			noChanges.Pull();
-			if (noChanges[0]) break;
-
-			clError |= clEnqueueNDRangeKernel(State.queue, analizeKernel, 1, NULL, &workSize, NULL, 0, NULL, NULL);
-		}
+		RunTillConverged(
+			[&] { clError |= clEnqueueNDRangeKernel(State.queue, scanKernel, 1, NULL, &workSize, NULL, 0, NULL, KernelEvent(scanKernel)); },
+			[&] { clError |= clEnqueueNDRangeKernel(State.queue, analizeKernel, 1, NULL, &workSize, NULL, 0, NULL, KernelEvent(analizeKernel)); });
+		THROW_IF_OCL(clError, "TOCLLabelDistribution::DoOCLLabel");
 	}
 
 	///////////////////////////////////////////////////////////////////////////////
@@ -949,7 +1731,9 @@ namespace LabelingTools
 		: initKernel(NULL),
 		  scanKernel(NULL),
 		  analyzeKernel(NULL),
-		  setFinalLabelsKernel(NULL)
+		  setFinalLabelsKernel(NULL),
+		  sLabels(*this),
+		  sConn(*this)
 	{
 		cl_device_type devType;
 		if (runOnGPU)
@@ -993,19 +1777,18 @@ namespace LabelingTools
 		spWidth = ceil(static_cast<float>(imgWidth) / 2);
 		spHeight = ceil(static_cast<float>(imgHeight) / 2);		
 
-		sLabels = clCreateBuffer(State.context, CL_MEM_READ_WRITE, sizeof(TLabel) * spHeight * spWidth, NULL, &clError);
-		sConn   = clCreateBuffer(State.context, CL_MEM_READ_WRITE, sizeof(char) * spHeight * spWidth, NULL, &clError);
-		THROW_IF_OCL(clError, "TOCLRunEquivLabeling::DoOCLLabel");
+		sLabels.Reserve(sizeof(TLabel) * spHeight * spWidth);
+		sConn.Reserve(sizeof(char) * spHeight * spWidth);
 
 		clError  = clSetKernelArg(initKernel, 0, sizeof(cl_mem), (void*)&pix->buffer);				
-		clError |= clSetKernelArg(initKernel, 1, sizeof(cl_mem), (void*)&sLabels);
-		clError |= clSetKernelArg(initKernel, 2, sizeof(cl_mem), (void*)&sConn);
+		clError |= clSetKernelArg(initKernel, 1, sizeof(cl_mem), (void*)&sLabels.buffer);
+		clError |= clSetKernelArg(initKernel, 2, sizeof(cl_mem), (void*)&sConn.buffer);
 		clError |= clSetKernelArg(initKernel, 3, sizeof(cl_mem), (void*)&imgWidth);		
 		clError |= clSetKernelArg(initKernel, 4, sizeof(cl_mem), (void*)&imgHeight);
 		THROW_IF_OCL(clError, "TOCLLabelEquivalenceX2::InitSPixels");
 
 		size_t workSize[] = { spWidth, spHeight };
-		clError = clEnqueueNDRangeKernel(State.queue, initKernel, 2, NULL, workSize, NULL, 0, NULL, NULL);
+		clError = clEnqueueNDRangeKernel(State.queue, initKernel, 2, NULL, workSize, NULL, 0, NULL, KernelEvent(initKernel));
 		THROW_IF_OCL(clError, "TOCLLabelEquivalenceX2::InitSPixels");
 	}
 
@@ -1017,25 +1800,18 @@ namespace LabelingTools
 		const size_t scanWorkSize[] = { spWidth, spHeight };
 		const size_t analyzeWorkSize[] = { scanWorkSize[0] * scanWorkSize[1] };
 	
-		TOCLBuffer<char> noChanges(*this, WRITE_ONLY, 1);		
+		TOCLBuffer<char> &noChanges = NoChanges();		
 
-		clError  = clSetKernelArg(scanKernel, 0, sizeof(cl_mem), (void*)&sLabels);
-		clError |= clSetKernelArg(scanKernel, 1, sizeof(cl_mem), (void*)&sConn);
+		clError  = clSetKernelArg(scanKernel, 0, sizeof(cl_mem), (void*)&sLabels.buffer);
+		clError |= clSetKernelArg(scanKernel, 1, sizeof(cl_mem), (void*)&sConn.buffer);
 		clError |= clSetKernelArg(scanKernel, 2, sizeof(cl_mem), (void*)&noChanges.buffer);
-		clError |= clSetKernelArg(analyzeKernel, 0, sizeof(cl_mem), (void*)&sLabels);
+		clError |= clSetKernelArg(analyzeKernel, 0, sizeof(cl_mem), (void*)&sLabels.buffer);
 		THROW_IF_OCL(clError, "TOCLLabelEquivalenceX2::LabelSPixels");
 		
-		while (true) {
-			noChanges[0] = 1;
-			noChanges.Push();
-
-			clError |= clEnqueueNDRangeKernel(State.queue, scanKernel, 2, NULL, scanWorkSize, NULL, 0, NULL, NULL);
-
-			noChanges.Pull();
-			if (noChanges[0]) break;
-
-			clError |= clEnqueueNDRangeKernel(State.queue, analyzeKernel, 1, NULL, analyzeWorkSize, NULL, 0, NULL, NULL);					
-		}
+		RunTillConverged(
+			[&] { clError |= clEnqueueNDRangeKernel(State.queue, scanKernel, 2, NULL, scanWorkSize, NULL, 0, NULL, KernelEvent(scanKernel)); },
+			[&] { clError |= clEnqueueNDRangeKernel(State.queue, analyzeKernel, 1, NULL, analyzeWorkSize, NULL, 0, NULL, KernelEvent(analyzeKernel)); });
+		THROW_IF_OCL(clError, "TOCLLabelEquivalenceX2::LabelSPixels");
 	}
 
 	///////////////////////////////////////////////////////////////////////////////
@@ -1047,23 +1823,15 @@ namespace LabelingTools
 
 		clError = clSetKernelArg(setFinalLabelsKernel, 0, sizeof(cl_mem), (void*)&pix->buffer);
 		clError |= clSetKernelArg(setFinalLabelsKernel, 1, sizeof(cl_mem), (void*)&lb->buffer);
-		clError |= clSetKernelArg(setFinalLabelsKernel, 2, sizeof(cl_mem), (void*)&sLabels);
+		clError |= clSetKernelArg(setFinalLabelsKernel, 2, sizeof(cl_mem), (void*)&sLabels.buffer);
 		THROW_IF_OCL(clError, "TOCLLabelEquivalenceX2::SetFinalLabels");
 
-		clError |= clEnqueueNDRangeKernel(State.queue, setFinalLabelsKernel, 2, NULL, workSize, NULL, 0, NULL, NULL);
+		clError |= clEnqueueNDRangeKernel(State.queue, setFinalLabelsKernel, 2, NULL, workSize, NULL, 0, NULL, KernelEvent(setFinalLabelsKernel));
 		THROW_IF_OCL(clError, "TOCLLabelEquivalenceX2::SetFinalLabels");
 	}
 
 	///////////////////////////////////////////////////////////////////////////////
 
-	void TOCLLabelEquivalenceX2::FreeSPixels(void)
-	{
-		clReleaseMemObject(sLabels);
-		clReleaseMemObject(sConn);
-	}
-
-	///////////////////////////////////////////////////////////////////////////////
-
 	void TOCLLabelEquivalenceX2::DoOCLLabel(TOCLBuffer<TPixel> &pixels, TOCLBuffer<TLabel> &labels, unsigned int imWidth,
 		unsigned int imHeight, TCoherence coh)
 	{
@@ -1080,7 +1848,6 @@ namespace LabelingTools
 		InitSPixels();
 		LabelSPixels();
 		SetFinalLabels();
-		FreeSPixels();		
 	}
 
 	///////////////////////////////////////////////////////////////////////////////
@@ -1088,11 +1855,17 @@ namespace LabelingTools
 	///////////////////////////////////////////////////////////////////////////////
 
 	TOCLRunEquivLabeling::TOCLRunEquivLabeling(bool runOnGPU)
-		: findRunsKernel(NULL),
+		: initKernel(NULL),
+		findRunsKernel(NULL),
 		findNeibKernel(NULL),
 		scanKernel(NULL),
 		analizeKernel(NULL),
-		labelKernel(NULL)
+		labelKernel(NULL),
+		emitRunsKernel(NULL),
+		fillRunsKernel(NULL),
+		runs(*this),
+		runNum(*this),
+		runOffsets(*this)
 	{
 		cl_device_type devType;
 		if (runOnGPU)
@@ -1115,6 +1888,8 @@ namespace LabelingTools
 		scanKernel = clCreateKernel(State.program, "REScanKernel", &clError);
 		analizeKernel = clCreateKernel(State.program, "REAnalizeKernel", &clError);
 		labelKernel = clCreateKernel(State.program, "RELabelKernel", &clError);
+		emitRunsKernel = clCreateKernel(State.program, "REEmitRunsKernel", &clError);
+		fillRunsKernel = clCreateKernel(State.program, "REFillRunsKernel", &clError);
 
 		THROW_IF_OCL(clError, "TOCLRunEquivLabeling::InitKernels");
 	}
@@ -1128,6 +1903,8 @@ namespace LabelingTools
 		if (scanKernel)	   clReleaseKernel(scanKernel);
 		if (analizeKernel)  clReleaseKernel(analizeKernel);
 		if (labelKernel)	   clReleaseKernel(labelKernel);		
+		if (emitRunsKernel) clReleaseKernel(emitRunsKernel);
+		if (fillRunsKernel) clReleaseKernel(fillRunsKernel);
 	};
 
 	///////////////////////////////////////////////////////////////////////////////
@@ -1137,11 +1914,11 @@ namespace LabelingTools
 		cl_int clError;
 
 		// Find runs
-		clError = clSetKernelArg(initKernel, 0, sizeof(cl_mem), (void*)&runNum);
+		clError = clSetKernelArg(initKernel, 0, sizeof(cl_mem), (void*)&runNum.buffer);
 		THROW_IF_OCL(clError, "TOCLRunEquivLabeling::InitRuns");
 
 		size_t workSize = height;
-		clError = clEnqueueNDRangeKernel(State.queue, initKernel, 1, NULL, &workSize, NULL, 0, NULL, NULL);
+		clError = clEnqueueNDRangeKernel(State.queue, initKernel, 1, NULL, &workSize, NULL, 0, NULL, KernelEvent(initKernel));
 		THROW_IF_OCL(clError, "TOCLRunEquivLabeling::InitRuns");
 	}
 
@@ -1153,13 +1930,13 @@ namespace LabelingTools
 
 		// Find runs
 		clError  = clSetKernelArg(findRunsKernel, 0, sizeof(cl_mem), (void*)&pix->buffer);
-		clError |= clSetKernelArg(findRunsKernel, 1, sizeof(cl_mem), (void*)&runs);
-		clError |= clSetKernelArg(findRunsKernel, 2, sizeof(cl_mem), (void*)&runNum);
+		clError |= clSetKernelArg(findRunsKernel, 1, sizeof(cl_mem), (void*)&runs.buffer);
+		clError |= clSetKernelArg(findRunsKernel, 2, sizeof(cl_mem), (void*)&runNum.buffer);
 		clError |= clSetKernelArg(findRunsKernel, 3, sizeof(unsigned int), (void*)&width);
 		THROW_IF_OCL(clError, "TOCLRunEquivLabeling::FindRuns");
 
 		size_t workSize = height;
-		clError = clEnqueueNDRangeKernel(State.queue, findRunsKernel, 1, NULL, &workSize, NULL, 0, NULL, NULL);
+		clError = clEnqueueNDRangeKernel(State.queue, findRunsKernel, 1, NULL, &workSize, NULL, 0, NULL, KernelEvent(findRunsKernel));
 		THROW_IF_OCL(clError, "TOCLRunEquivLabeling::FindRuns");
 	}
 
@@ -1170,13 +1947,13 @@ namespace LabelingTools
 		cl_int clError;
 
 		// Find neighbour runs
-		clError  = clSetKernelArg(findNeibKernel, 0, sizeof(cl_mem), (void*)&runs);
-		clError |= clSetKernelArg(findNeibKernel, 1, sizeof(cl_mem), (void*)&runNum);
+		clError  = clSetKernelArg(findNeibKernel, 0, sizeof(cl_mem), (void*)&runs.buffer);
+		clError |= clSetKernelArg(findNeibKernel, 1, sizeof(cl_mem), (void*)&runNum.buffer);
 		clError |= clSetKernelArg(findNeibKernel, 2, sizeof(unsigned int), (void*)&width);
 		THROW_IF_OCL(clError, "TOCLRunEquivLabeling::FindNeibRuns");
 
 		size_t workSize = height;
-		clError = clEnqueueNDRangeKernel(State.queue, findNeibKernel, 1, NULL, &workSize, NULL, 0, NULL, NULL);
+		clError = clEnqueueNDRangeKernel(State.queue, findNeibKernel, 1, NULL, &workSize, NULL, 0, NULL, KernelEvent(findNeibKernel));
 		THROW_IF_OCL(clError, "TOCLRunEquivLabeling::FindNeibRuns");
 	}
 
@@ -1187,32 +1964,21 @@ namespace LabelingTools
 		cl_int clError;
 
 		// Labeling
-		TOCLBuffer<char> noChanges(*this, WRITE_ONLY, 1);
+		TOCLBuffer<char> &noChanges = NoChanges();
 
-		clError  = clSetKernelArg(scanKernel, 0, sizeof(cl_mem), (void*)&runs);
-		clError |= clSetKernelArg(scanKernel, 1, sizeof(cl_mem), (void*)&runNum);
+		clError  = clSetKernelArg(scanKernel, 0, sizeof(cl_mem), (void*)&runs.buffer);
+		clError |= clSetKernelArg(scanKernel, 1, sizeof(cl_mem), (void*)&runNum.buffer);
 		clError |= clSetKernelArg(scanKernel, 2, sizeof(unsigned int), (void*)&width);
 		clError |= clSetKernelArg(scanKernel, 3, sizeof(cl_mem), (void*)&noChanges.buffer);
-		clError |= clSetKernelArg(analizeKernel, 0, sizeof(cl_mem), (void*)&runs);
-		clError |= clSetKernelArg(analizeKernel, 1, sizeof(cl_mem), (void*)&runNum);
+		clError |= clSetKernelArg(analizeKernel, 0, sizeof(cl_mem), (void*)&runs.buffer);
+		clError |= clSetKernelArg(analizeKernel, 1, sizeof(cl_mem), (void*)&runNum.buffer);
 		clError |= clSetKernelArg(analizeKernel, 2, sizeof(unsigned int), (void*)&width);
 		THROW_IF_OCL(clError, "TOCLRunEquivLabeling::Scan");
 
 		size_t workSize = height;
-		while (true) {
-			noChanges[0] = 1;
-			noChanges.Push();
-
-			clError = clEnqueueNDRangeKernel(State.queue, scanKernel, 1, NULL, &workSize, NULL, 0, NULL, NULL);	
-
-			noChanges.Pull();
-			if (noChanges[0]) break;
-
-			clError |= clEnqueueNDRangeKernel(State.queue, analizeKernel, 1, NULL, &workSize, NULL, 0, NULL, NULL);
-			
-			THROW_IF_OCL(clError, "TOCLRunEquivLabeling::Scan");					
-		}
-
+		RunTillConverged(
+			[&] { clError |= clEnqueueNDRangeKernel(State.queue, scanKernel, 1, NULL, &workSize, NULL, 0, NULL, KernelEvent(scanKernel)); },
+			[&] { clError |= clEnqueueNDRangeKernel(State.queue, analizeKernel, 1, NULL, &workSize, NULL, 0, NULL, KernelEvent(analizeKernel)); });
 		THROW_IF_OCL(clError, "TOCLRunEquivLabeling::Scan");
 	}
 
@@ -1223,14 +1989,14 @@ namespace LabelingTools
 		cl_int clError;
 
 		// Find neighbour runs
-		clError  = clSetKernelArg(labelKernel, 0, sizeof(cl_mem), (void*)&runs);
-		clError |= clSetKernelArg(labelKernel, 1, sizeof(cl_mem), (void*)&runNum);
+		clError  = clSetKernelArg(labelKernel, 0, sizeof(cl_mem), (void*)&runs.buffer);
+		clError |= clSetKernelArg(labelKernel, 1, sizeof(cl_mem), (void*)&runNum.buffer);
 		clError |= clSetKernelArg(labelKernel, 2, sizeof(cl_mem), (void*)&lb->buffer);
 		clError |= clSetKernelArg(labelKernel, 3, sizeof(unsigned int), (void*)&width);
 		THROW_IF_OCL(clError, "TOCLRunEquivLabeling::SetFinalLabels");
 
 		size_t workSize = height;// *(width >> 1);
-		clError = clEnqueueNDRangeKernel(State.queue, labelKernel, 1, NULL, &workSize, NULL, 0, NULL, NULL);
+		clError = clEnqueueNDRangeKernel(State.queue, labelKernel, 1, NULL, &workSize, NULL, 0, NULL, KernelEvent(labelKernel));
 		THROW_IF_OCL(clError, "TOCLRunEquivLabeling::SetFinalLabels");
 	}
 
@@ -1249,22 +2015,106 @@ namespace LabelingTools
 		this->width = imgWidth;
 
 		// Initialization
-		runs = clCreateBuffer(State.context, CL_MEM_READ_WRITE,
-			sizeof(TRun) * imgHeight * (imgWidth >> 1), NULL, &clError);
-		THROW_IF_OCL(clError, "TOCLRunEquivLabeling::DoOCLLabel");
-
-		runNum = clCreateBuffer(State.context, CL_MEM_READ_WRITE,
-			sizeof(uint) * imgHeight, NULL, &clError);
-		THROW_IF_OCL(clError, "TOCLRunEquivLabeling::DoOCLLabel");
+		runs.Reserve(sizeof(TRun) * imgHeight * (imgWidth >> 1));
+		runNum.Reserve(sizeof(uint) * imgHeight);
 
 		InitRuns();
 		FindRuns();
 		FindNeibRuns();
 		Scan();
 		SetFinalLabels();
+	}
 
-		clReleaseMemObject(runs);
-		clReleaseMemObject(runNum);
+	///////////////////////////////////////////////////////////////////////////////
+
+	cl_uint TOCLRunEquivLabeling::DoOCLLabelRuns(TOCLBuffer<TPixel> &pixels, TOCLDeviceBuffer &runsOut, uint imgWidth, 
+												 uint imgHeight, TCoherence coh)
+	{
+		THROW_IF(coh == COH_4, "TOCLRunEquivLabeling::DoOCLLabelRuns : 4x connectivity is not implemented for this method");
+
+		cl_int clError;
+
+		this->pix = &pixels;
+		this->lb = nullptr;
+		this->height = imgHeight;
+		this->width = imgWidth;
+
+		// Initialization
+		runs.Reserve(sizeof(TRun) * imgHeight * (imgWidth >> 1));
+		runNum.Reserve(sizeof(uint) * imgHeight);
+		runOffsets.Reserve(sizeof(uint) * (imgHeight + 1));
+
+		InitRuns();
+		FindRuns();
+		FindNeibRuns();
+		Scan();
+
+		// Output position of every row is exclusive sum of run counts above it
+		clError = clEnqueueCopyBuffer(State.queue, runNum.buffer, runOffsets.buffer, 0, 0, sizeof(uint) * imgHeight, 
+									  0, NULL, ProfileEvent("CopyRunNum", sizeof(uint) * imgHeight));
+		THROW_IF_OCL(clError, "TOCLRunEquivLabeling::DoOCLLabelRuns");
+
+		const cl_uint count = ScanDevice(runOffsets.buffer, imgHeight);
+		runsOut.Reserve(sizeof(TLabelRun) * max(count, cl_uint(1)));
+
+		EmitRuns(runOffsets.buffer, runsOut.buffer);
+
+		return count;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	void TOCLRunEquivLabeling::DoOCLLabelRuns(TOCLDeviceBuffer &maskRuns, TOCLDeviceBuffer &rowOffsets, TOCLDeviceBuffer &runsOut, 
+											  uint maskWidth, uint maskHeight, TCoherence coh)
+	{
+		THROW_IF(coh == COH_4, "TOCLRunEquivLabeling::DoOCLLabelRuns : 4x connectivity is not implemented for this method");
+
+		cl_int clError;
+
+		this->pix = nullptr;
+		this->lb = nullptr;
+		this->height = maskHeight;
+		this->width = maskWidth + 1; // Row holds up to (maskWidth + 1) / 2 runs
+
+		// Initialization
+		runs.Reserve(sizeof(TRun) * height * (width >> 1));
+		runNum.Reserve(sizeof(uint) * height);
+
+		// Runs are taken from mask instead of InitRuns and FindRuns
+		clError  = clSetKernelArg(fillRunsKernel, 0, sizeof(cl_mem), (void*)&maskRuns.buffer);
+		clError |= clSetKernelArg(fillRunsKernel, 1, sizeof(cl_mem), (void*)&rowOffsets.buffer);
+		clError |= clSetKernelArg(fillRunsKernel, 2, sizeof(cl_mem), (void*)&runs.buffer);
+		clError |= clSetKernelArg(fillRunsKernel, 3, sizeof(cl_mem), (void*)&runNum.buffer);
+		clError |= clSetKernelArg(fillRunsKernel, 4, sizeof(unsigned int), (void*)&width);
+		THROW_IF_OCL(clError, "TOCLRunEquivLabeling::DoOCLLabelRuns");
+
+		size_t workSize = height;
+		clError = clEnqueueNDRangeKernel(State.queue, fillRunsKernel, 1, NULL, &workSize, NULL, 0, NULL, KernelEvent(fillRunsKernel));
+		THROW_IF_OCL(clError, "TOCLRunEquivLabeling::DoOCLLabelRuns");
+
+		FindNeibRuns();
+		Scan();
+
+		// Row offsets of mask are row offsets of output as well
+		EmitRuns(rowOffsets.buffer, runsOut.buffer);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	void TOCLRunEquivLabeling::EmitRuns(const cl_mem &offsets, const cl_mem &runsOut)
+	{
+		cl_int clError;
+
+		clError  = clSetKernelArg(emitRunsKernel, 0, sizeof(cl_mem), (void*)&runs.buffer);
+		clError |= clSetKernelArg(emitRunsKernel, 1, sizeof(cl_mem), (void*)&runNum.buffer);
+		clError |= clSetKernelArg(emitRunsKernel, 2, sizeof(cl_mem), (void*)&offsets);
+		clError |= clSetKernelArg(emitRunsKernel, 3, sizeof(cl_mem), (void*)&runsOut);
+		clError |= clSetKernelArg(emitRunsKernel, 4, sizeof(unsigned int), (void*)&width);
+		THROW_IF_OCL(clError, "TOCLRunEquivLabeling::EmitRuns");
+
+		size_t workSize = height;
+		clError = clEnqueueNDRangeKernel(State.queue, emitRunsKernel, 1, NULL, &workSize, NULL, 0, NULL, KernelEvent(emitRunsKernel));
+		THROW_IF_OCL(clError, "TOCLRunEquivLabeling::EmitRuns");
 	}
 
 	///////////////////////////////////////////////////////////////////////////////
@@ -1307,14 +2157,14 @@ namespace LabelingTools
 	void TOCLBinLabeling3D::DoOCLLabel3D(TOCLBuffer<TPixel> &pixels, TOCLBuffer<TLabel> &labels, uint imgWidth, uint imgHeight, uint imgDepth)
 	{
 		cl_int clError;
-		size_t workSize = pixels.Buffer().size();
+		size_t workSize = pixels.Size();
 
 		clError = clSetKernelArg(binKernel, 0, sizeof(cl_mem), (void*)&pixels.buffer);
 		clError |= clSetKernelArg(binKernel, 1, sizeof(cl_mem), (void*)&labels.buffer);
 
 		THROW_IF_OCL(clError, "TOCLBinLabeling3D::DoOCLLabel3D");
 
-		clEnqueueNDRangeKernel(State.queue, binKernel, 1, NULL, &workSize, NULL, 0, NULL, NULL);
+		clEnqueueNDRangeKernel(State.queue, binKernel, 1, NULL, &workSize, NULL, 0, NULL, KernelEvent(binKernel));
 	}
 
 	///////////////////////////////////////////////////////////////////////////////
@@ -1370,29 +2220,21 @@ namespace LabelingTools
 		clError |= clSetKernelArg(initKernel, 1, sizeof(cl_mem), (void*)&labels.buffer);
 		THROW_IF_OCL(clError, "TOCLLabelDistribution3D::DoOCLLabel3D");
 
-		clError = clEnqueueNDRangeKernel(State.queue, initKernel, 1, NULL, &workSizeLine, NULL, 0, NULL, NULL);
+		clError = clEnqueueNDRangeKernel(State.queue, initKernel, 1, NULL, &workSizeLine, NULL, 0, NULL, KernelEvent(initKernel));
 		THROW_IF_OCL(clError, "TOCLLabelDistribution3D::DoOCLLabel3D");
 
 		// Labeling
-		TOCLBuffer<char> noChanges(*this, WRITE_ONLY, 1);
+		TOCLBuffer<char> &noChanges = NoChanges();
 
 		clError = clSetKernelArg(scanKernel, 0, sizeof(cl_mem), (void*)&labels.buffer);
 		clError |= clSetKernelArg(scanKernel, 1, sizeof(cl_mem), (void*)&noChanges.buffer);
 		clError |= clSetKernelArg(analyzeKernel, 0, sizeof(cl_mem), (void*)&labels.buffer);
 		THROW_IF_OCL(clError, "TOCLLabelDistribution3D::DoOCLLabel3D");
 
-		unsigned int iter = 0;
-		while (true) {
-			noChanges[0] = 1;
-			noChanges.Push();
-
-			clError |= clEnqueueNDRangeKernel(State.queue, scanKernel, 3, NULL, workSize, NULL, 0, NULL, NULL);
-
-			noChanges.Pull();
-			if (noChanges[0]) break;
-
-			clError |= clEnqueueNDRangeKernel(State.queue, analyzeKernel, 1, NULL, &workSizeLine, NULL, 0, NULL, NULL);
-		}
+		RunTillConverged(
+			[&] { clError |= clEnqueueNDRangeKernel(State.queue, scanKernel, 3, NULL, workSize, NULL, 0, NULL, KernelEvent(scanKernel)); },
+			[&] { clError |= clEnqueueNDRangeKernel(State.queue, analyzeKernel, 1, NULL, &workSizeLine, NULL, 0, NULL, KernelEvent(analyzeKernel)); });
+		THROW_IF_OCL(clError, "TOCLLabelDistribution3D::DoOCLLabel3D");
 	}
 
 	///////////////////////////////////////////////////////////////////////////////
@@ -1403,7 +2245,9 @@ namespace LabelingTools
 		: initKernel(NULL),
 		scanKernel(NULL),
 		analyzeKernel(NULL),
-		setFinalLabelsKernel(NULL)
+		setFinalLabelsKernel(NULL),
+		sLabels(*this),
+		sConn(*this)
 	{
 		cl_device_type devType;
 		if (runOnGPU)
@@ -1448,17 +2292,16 @@ namespace LabelingTools
 		spHeight = imgHeight >> 1;
 		spDepth = imgDepth >> 1;
 
-		sLabels = clCreateBuffer(State.context, CL_MEM_READ_WRITE, sizeof(TLabel) * spHeight * spWidth * spDepth, NULL, &clError);
-		sConn = clCreateBuffer(State.context, CL_MEM_READ_WRITE, sizeof(int) * spHeight * spWidth * spDepth, NULL, &clError);
-		THROW_IF_OCL(clError, "TOCLBlockEquivalence3D::InitSPixels");
+		sLabels.Reserve(sizeof(TLabel) * spHeight * spWidth * spDepth);
+		sConn.Reserve(sizeof(int) * spHeight * spWidth * spDepth);
 
 		clError  = clSetKernelArg(initKernel, 0, sizeof(cl_mem), (void*)&pix->buffer);
-		clError |= clSetKernelArg(initKernel, 1, sizeof(cl_mem), (void*)&sLabels);
-		clError |= clSetKernelArg(initKernel, 2, sizeof(cl_mem), (void*)&sConn);
+		clError |= clSetKernelArg(initKernel, 1, sizeof(cl_mem), (void*)&sLabels.buffer);
+		clError |= clSetKernelArg(initKernel, 2, sizeof(cl_mem), (void*)&sConn.buffer);
 		THROW_IF_OCL(clError, "TOCLBlockEquivalence3D::InitSPixels");
 
 		const size_t workSize[] = { spWidth, spHeight, spDepth };
-		clError = clEnqueueNDRangeKernel(State.queue, initKernel, 3, NULL, workSize, NULL, 0, NULL, NULL);
+		clError = clEnqueueNDRangeKernel(State.queue, initKernel, 3, NULL, workSize, NULL, 0, NULL, KernelEvent(initKernel));
 		THROW_IF_OCL(clError, "TOCLBlockEquivalence3D::InitSPixels");
 	}
 
@@ -1470,25 +2313,18 @@ namespace LabelingTools
 		const size_t scanWorkSize[] = { spWidth, spHeight, spDepth };		
 		const size_t analyzeWorkSize[] = { scanWorkSize[0] * scanWorkSize[1] * scanWorkSize[2] };
 
-		TOCLBuffer<char> noChanges(*this, WRITE_ONLY, 1);
+		TOCLBuffer<char> &noChanges = NoChanges();
 
-		clError = clSetKernelArg(scanKernel, 0, sizeof(cl_mem), (void*)&sLabels);
-		clError |= clSetKernelArg(scanKernel, 1, sizeof(cl_mem), (void*)&sConn);
+		clError = clSetKernelArg(scanKernel, 0, sizeof(cl_mem), (void*)&sLabels.buffer);
+		clError |= clSetKernelArg(scanKernel, 1, sizeof(cl_mem), (void*)&sConn.buffer);
 		clError |= clSetKernelArg(scanKernel, 2, sizeof(cl_mem), (void*)&noChanges.buffer);
-		clError |= clSetKernelArg(analyzeKernel, 0, sizeof(cl_mem), (void*)&sLabels);
+		clError |= clSetKernelArg(analyzeKernel, 0, sizeof(cl_mem), (void*)&sLabels.buffer);
 		THROW_IF_OCL(clError, "TOCLBlockEquivalence3D::LabelSPixels");
 		
-		while (true) {
-			noChanges[0] = 1;
-			noChanges.Push();
-
-			clError |= clEnqueueNDRangeKernel(State.queue, scanKernel, 3, NULL, scanWorkSize, NULL, 0, NULL, NULL);
-
-			noChanges.Pull();
-			if (noChanges[0]) break;
-
-			clError |= clEnqueueNDRangeKernel(State.queue, analyzeKernel, 1, NULL, analyzeWorkSize, NULL, 0, NULL, NULL);
-		}
+		RunTillConverged(
+			[&] { clError |= clEnqueueNDRangeKernel(State.queue, scanKernel, 3, NULL, scanWorkSize, NULL, 0, NULL, KernelEvent(scanKernel)); },
+			[&] { clError |= clEnqueueNDRangeKernel(State.queue, analyzeKernel, 1, NULL, analyzeWorkSize, NULL, 0, NULL, KernelEvent(analyzeKernel)); });
+		THROW_IF_OCL(clError, "TOCLBlockEquivalence3D::LabelSPixels");
 	}
 
 	///////////////////////////////////////////////////////////////////////////////
@@ -1500,23 +2336,15 @@ namespace LabelingTools
 		
 		clError = clSetKernelArg(setFinalLabelsKernel, 0, sizeof(cl_mem), (void*)&pix->buffer);
 		clError |= clSetKernelArg(setFinalLabelsKernel, 1, sizeof(cl_mem), (void*)&lb->buffer);
-		clError |= clSetKernelArg(setFinalLabelsKernel, 2, sizeof(cl_mem), (void*)&sLabels);
+		clError |= clSetKernelArg(setFinalLabelsKernel, 2, sizeof(cl_mem), (void*)&sLabels.buffer);
 		THROW_IF_OCL(clError, "TOCLBlockEquivalence3D::SetFinalLabels");
 
-		clError |= clEnqueueNDRangeKernel(State.queue, setFinalLabelsKernel, 3, NULL, workSize, NULL, 0, NULL, NULL);
+		clError |= clEnqueueNDRangeKernel(State.queue, setFinalLabelsKernel, 3, NULL, workSize, NULL, 0, NULL, KernelEvent(setFinalLabelsKernel));
 		THROW_IF_OCL(clError, "TOCLBlockEquivalence3D::SetFinalLabels");
 	}
 
 	///////////////////////////////////////////////////////////////////////////////
 
-	void TOCLBlockEquivalence3D::FreeSPixels(void)
-	{
-		clReleaseMemObject(sLabels);
-		clReleaseMemObject(sConn);
-	}
-
-	///////////////////////////////////////////////////////////////////////////////
-
 	void TOCLBlockEquivalence3D::DoOCLLabel3D(TOCLBuffer<TPixel> &pixels, TOCLBuffer<TLabel> &labels,
 												uint imWidth, uint imHeight, uint imDepth)
 	{		
@@ -1532,7 +2360,6 @@ namespace LabelingTools
 		InitSPixels();
 		LabelSPixels();
 		SetFinalLabels();
-		FreeSPixels();
 	}
 
 	///////////////////////////////////////////////////////////////////////////////
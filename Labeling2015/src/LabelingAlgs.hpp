@@ -48,7 +48,17 @@ namespace LabelingTools
 
 	class TBlockGranaLabeling final : public ILabeling
 	{
+	public:
+		// useUnionFind selects union-find with path halving instead of linked lists for equivalences
+		TBlockGranaLabeling(bool useUnionFind = false);
+
+	protected:
+		// Blocks are read right from packed rows
+		virtual bool PackedInput(void) const override { return true; }
+
 	private:
+		bool useUnionFind_;
+
 		virtual void DoLabel(const TImage& pixels, TImage& labels, char threads, TCoherence coh) override;
 	};
 
@@ -64,34 +74,43 @@ namespace LabelingTools
 		uint Row;		// Represents run's row
 	};
 
-	typedef vector<TRun*> TRuns; // Represents runs array	
+	typedef vector<TRun> TRuns; // Represents runs array	
 
 	class TRunLabeling final : public ILabeling
 	{
 	public:
-		unsigned int Top;
-		unsigned int Bottom;
+		unsigned int Top;		// First row of the strip
+		unsigned int Bottom;	// Row after the last one of the strip, 
+								// 0 means the whole image split into per thread strips
 
 		// Constructor
 		TRunLabeling(void);
 		TRunLabeling(unsigned int aTop, unsigned int aBottom);
 
+		virtual void ShrinkWorkspace(void) override;
+		virtual void ResetWorkspace(void) override;
+
 	private:
 		int ConPix; //represents if we need additional 
 					//pixels at left and right due to the 8x coherence
-		TRun* CurRun; //current run
 
 		TRuns Runs; //runs array
-		TRuns LastRow; //represents all runs in upper row
-		TRuns CurRow; //represents all runs in current row
-		vector<TLabel> Objects; //represents provisional labels as 
-								//Objects[Current_Label] = Real_Label
-		vector<TLabel> LabelStack;
+		size_t LastRow; //index of the first run in upper row
+		size_t CurRow; //index of the first run in current row
+		vector<TLabel> Objects; //represents provisional labels as union-find forest
+								//Objects[Label] = Parent_Label, Objects[Root] = Root
+		vector<shared_ptr<TRunLabeling>> Strips; //per thread strips, kept between calls
 
 		//labeling itself
 		virtual void DoLabel(const TImage& pixels, TImage& labels, char threads, TCoherence coh) override;
+		//scans strip rows and finds provisional labels
+		void Scan(const TImage& pixels, uint top, uint bottom);
 		//sets run label
-		void SetRunLabel(void);
+		void SetRunLabel(TRun& run);
+		//merges provisional labels of two strips divided by top row of the lower one
+		void MergeStrips(const TRunLabeling& upper, uint upperOffset, uint lowerOffset, vector<TLabel>& parents) const;
+		//writes final labels of strip runs, adds them to stats if given
+		void SetLabels(TImage& labels, const vector<TLabel>& parents, uint offset, TStatsAccumulator *stats);
 	};
 
 	///////////////////////////////////////////////////////////////////////////////
@@ -112,6 +131,20 @@ namespace LabelingTools
 		inline TLabel GetLabel(const TLabel* labels, uint pos, uint maxPos) const;
 	};
 
+	///////////////////////////////////////////////////////////////////////////////
+	// TLabelUnionFind :: OpenMP lock-free Union-Find labeling algorithm
+	///////////////////////////////////////////////////////////////////////////////
+
+	class TLabelUnionFind final : public ILabeling
+	{
+	private:
+		virtual void DoLabel(const TImage& pixels, TImage& labels, char threads, TCoherence coh) override;
+
+		virtual void InitMap(const TImage& pixels, TImage& labels);
+		virtual void Link(const TImage& pixels, TImage& labels, TCoherence coh);
+		virtual void Flatten(TImage& labels);
+	};
+
 	///////////////////////////////////////////////////////////////////////////////
 	// TLabelEquivalenceX2 :: OpenMP Label Equivalence X2 algorithm
 	///////////////////////////////////////////////////////////////////////////////
@@ -129,10 +162,10 @@ namespace LabelingTools
 	{	
 	private:				
 		struct TSPixels {
-			std::vector<TSPixel> data;
+			TSPixel *data; // Points to workspace
 			size_t w, h;
 
-			TSPixels(size_t width, size_t height) : w(width), h(height), data(width * height) { /* Empty */ }
+			TSPixels(TSPixel *buffer, size_t width, size_t height) : data(buffer), w(width), h(height) { /* Empty */ }
 			inline TSPixel& operator[](size_t pos) { return const_cast<TSPixel&>(static_cast<const TSPixels&>(*this).operator[](pos)); }
 			inline const TSPixel& operator[](size_t pos) const { return data[pos]; }
 		};
@@ -154,6 +187,19 @@ namespace LabelingTools
 
 	class TRunEqivLabeling final : public ILabeling
 	{
+	public:
+		// Runs are written straight from the run table, labels image is not filled
+		virtual TTime LabelRuns(const TImage& pixels, TLabelRuns& runs, char threads = MAX_THREADS, 
+								TCoherence coh = TCoherence::COH_DEFAULT, bool binary = false) override;
+
+		// Run table is filled from mask runs, no pixels are scanned
+		virtual TTime LabelRuns(const TRunMask& mask, TLabelRuns& runs, char threads = MAX_THREADS, 
+								TCoherence coh = TCoherence::COH_DEFAULT) override;
+
+	protected:
+		// Runs are found in packed rows by bit scans
+		virtual bool PackedInput(void) const override { return true; }
+
 	private:		
 		typedef struct
 		{
@@ -168,16 +214,24 @@ namespace LabelingTools
 			TRunSize bot;	// Bottom row bl and br
 		} TRun;
 
-		TRun *runs_;
-		uint *runNum_;
-		uint width_, height_, size_;
+		enum { WS_RUNS = WS_ALG, WS_RUN_NUM };
+
+		TRun *runs_;	// Points to workspace
+		uint *runNum_;	// Points to workspace
+		uint width_, height_, size_, runWidth_;
 		const TImage *pixels_; 
 		TImage *labels_;
+		TLabelRuns *runsOut_ = nullptr; // Set by LabelRuns, SetFinalLabels fills it instead of labels
+		const TRunMask *mask_ = nullptr; // Set by LabelRuns, FillRuns replaces FindRuns then
 
 		virtual void DoLabel(const TImage& pixels, TImage& labels, char threads, TCoherence coh) override;
 
+		TTime LabelIntoRuns(const TImage& binImg, TLabelRuns& runs, char threads, TCoherence coh);
+
 		virtual void InitRuns(void);
 		virtual void FindRuns(void);
+		virtual void FindPackedRuns(void);
+		virtual void FillRuns(void);
 		virtual void FindNeibRuns(void);
 		virtual void Scan(void);
 		virtual void SetFinalLabels(void);
@@ -189,6 +243,53 @@ namespace LabelingTools
 		inline void AnalyzeRuns(void);
 	};
 
+	///////////////////////////////////////////////////////////////////////////////
+	// TLabelEquivalence3D :: OpenMP Label Equivalence for 3D images
+	///////////////////////////////////////////////////////////////////////////////
+
+	class TLabelEquivalence3D final : public ILabeling3D
+	{
+	private:
+		virtual void DoLabel(const TImage& pixels, TImage& labels, char threads, TCoherence coh) override;
+
+		virtual void InitMap(const TImage& pixels, TImage& labels);
+		virtual bool Scan(TImage& labels);
+		virtual void Analyze(TImage& labels);
+
+		inline TLabel MinVoxelLabel(const TLabel *lb, int x, int y, int z, int w, int h, int d) const;
+	};
+
+	///////////////////////////////////////////////////////////////////////////////
+	// TBlockEquivalence3D :: OpenMP Block Equivalence for 3D images
+	///////////////////////////////////////////////////////////////////////////////
+
+	class TBlockEquivalence3D final : public ILabeling3D
+	{
+	private:
+		struct TSVoxel {
+			TLabel lb;		// Super voxel label
+			uint conn;		// Super voxel connectivity, see BLEQ3D_Init kernel for layout
+		};
+
+		struct TSVoxels {
+			TSVoxel *data; // Points to workspace
+			int w, h, d;
+
+			TSVoxels(TSVoxel *buffer, int width, int height, int depth) : data(buffer), w(width), h(height), d(depth) { /* Empty */ }
+			inline TSVoxel& operator[](size_t pos) { return data[pos]; }
+			inline const TSVoxel& operator[](size_t pos) const { return data[pos]; }
+		};
+
+		virtual TSVoxels InitSVoxels(const TImage& pixels);
+		virtual bool Scan(TSVoxels& sVoxels);
+		virtual void Analyze(TSVoxels& sVoxels);
+		virtual void SetFinalLabels(const TImage& pixels, TImage& labels, const TSVoxels& sVoxels);
+
+		inline TLabel MinSVoxelLabel(const TSVoxels& sVoxels, int x, int y, int z) const;
+
+		void DoLabel(const TImage& pixels, TImage& labels, char threads, TCoherence coh) override;
+	};
+
 	///////////////////////////////////////////////////////////////////////////////
 	// TOCLBinLabeling :: OCL Binarization
 	///////////////////////////////////////////////////////////////////////////////
@@ -247,7 +348,7 @@ namespace LabelingTools
 		TOCLBuffer<TPixel> *pix;
 		TOCLBuffer<TLabel> *lb;
 
-		cl_mem sLabels, sConn;
+		TOCLDeviceBuffer sLabels, sConn;	// Kept between calls
 
 		unsigned int imgWidth, imgHeight, spWidth, spHeight;
 
@@ -257,7 +358,6 @@ namespace LabelingTools
 		void InitSPixels(void);
 		void LabelSPixels(void);
 		void SetFinalLabels(void);
-		void FreeSPixels(void);
 
 		void DoOCLLabel(TOCLBuffer<TPixel> &pixels, TOCLBuffer<TLabel> &labels, unsigned int imgWidth,
 			unsigned int imgHeight, TCoherence Coherence) override;
@@ -272,6 +372,14 @@ namespace LabelingTools
 	public:
 		TOCLRunEquivLabeling(bool runOnGPU = true);		
 
+	protected:
+		// Runs are written straight from the run table, labels buffer is neither filled nor read back
+		virtual bool HasRunsOutput(void) const override { return true; }
+		virtual cl_uint DoOCLLabelRuns(TOCLBuffer<TPixel> &pixels, TOCLDeviceBuffer &runsOut, uint imgWidth, uint imgHeight, 
+									   TCoherence coh) override;
+		virtual void DoOCLLabelRuns(TOCLDeviceBuffer &maskRuns, TOCLDeviceBuffer &rowOffsets, TOCLDeviceBuffer &runsOut, 
+									uint maskWidth, uint maskHeight, TCoherence coh) override;
+
 	private:	
 		typedef struct
 		{
@@ -291,9 +399,11 @@ namespace LabelingTools
 				  findNeibKernel,
 				  scanKernel,
 				  analizeKernel,
-				  labelKernel;
+				  labelKernel,
+				  emitRunsKernel,
+				  fillRunsKernel;
 
-		cl_mem runs, runNum;
+		TOCLDeviceBuffer runs, runNum, runOffsets;	// Kept between calls
 
 		TOCLBuffer<TPixel> *pix;
 		TOCLBuffer<TLabel> *lb;
@@ -312,6 +422,7 @@ namespace LabelingTools
 		void FindNeibRuns(void);
 		void Scan(void);
 		void SetFinalLabels(void);
+		void EmitRuns(const cl_mem &offsets, const cl_mem &runsOut);
 	};
 
 	///////////////////////////////////////////////////////////////////////////////
@@ -371,7 +482,7 @@ namespace LabelingTools
 		TOCLBuffer<TPixel> *pix;
 		TOCLBuffer<TLabel> *lb;
 
-		cl_mem sLabels, sConn;
+		TOCLDeviceBuffer sLabels, sConn;	// Kept between calls
 
 		unsigned int 
 			imgWidth, imgHeight, imgDepth, 
@@ -383,7 +494,6 @@ namespace LabelingTools
 		void InitSPixels(void);
 		void LabelSPixels(void);
 		void SetFinalLabels(void);
-		void FreeSPixels(void);
 
 		void DoOCLLabel3D(TOCLBuffer<TPixel> &pixels, TOCLBuffer<TLabel> &labels, 
 			uint imgWidth, uint imgHeight, uint imgDepth) override;
@@ -7,143 +7,1885 @@
 
 #include <opencv2/imgproc/imgproc.hpp>
 #include <array>
+#include <map>
+#include <mutex>
+#include <algorithm>
 
 ///////////////////////////////////////////////////////////////////////////////
 
 namespace LabelingTools
 {
 
+	///////////////////////////////////////////////////////////////////////////////
+	// TWorkspace declaration
+	///////////////////////////////////////////////////////////////////////////////
+
+	char* TWorkspace::GetBytes(size_t slot, size_t bytes)
+	{
+		if (slot >= slots_.size())
+			slots_.resize(slot + 1);
+
+		TSlot &s = slots_[slot];
+
+		if (s.size < bytes)
+		{
+			s.data.reset(); // Old contents are not needed, so we don't keep both buffers
+			s.data.reset(new char[bytes]);
+			s.size = bytes;
+		}
+
+		s.used = bytes;
+
+		return s.data.get();
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	void TWorkspace::Shrink(void)
+	{
+		for (auto &s : slots_)
+		{
+			if (s.size > s.used)
+			{
+				s.data.reset(s.used ? new char[s.used] : nullptr);
+				s.size = s.used;
+			}
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	void TWorkspace::Reset(void)
+	{
+		slots_.clear();
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	size_t TWorkspace::Size(void) const
+	{
+		size_t size = 0;
+
+		for (auto &s : slots_)
+			size += s.size;
+
+		return size;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// TProfile declaration
+	///////////////////////////////////////////////////////////////////////////////
+
+	void TProfile::Reset(void)
+	{
+		phases.clear();
+		iterations = 0;
+		total = 0;
+		endToEnd = 0;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	void TProfile::Add(const char *name, TTime time, size_t bytes, uint runs)
+	{
+		for (auto &phase : phases)
+		{
+			if (phase.name == name)
+			{
+				phase.time += time;
+				phase.bytes += bytes;
+				phase.runs += runs;
+				return;
+			}
+		}
+
+		phases.push_back(TPhase{ name, time, runs, bytes });
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// TStatsAccumulator declaration
+	///////////////////////////////////////////////////////////////////////////////
+
+	void TStatsAccumulator::Begin(int threads)
+	{
+		// Tables keep their buckets between calls
+		tables_.resize(max(threads, 1));
+
+		for (auto &table : tables_)
+			table.clear();
+
+		active_ = true;
+		collected_ = false;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	void TStatsAccumulator::End(TStats& stats)
+	{
+		active_ = false;
+
+		// Moments of every label are merged into the first table having it
+		for (size_t i = 1; i < tables_.size(); ++i)
+		{
+			for (auto &item : tables_[i])
+			{
+				auto res = tables_[0].insert(item);
+				if (res.second)
+					continue;
+
+				TMoments &m = res.first->second;
+				const TMoments &t = item.second;
+
+				m.area += t.area;
+				m.sumX += t.sumX;
+				m.sumY += t.sumY;
+				m.left = min(m.left, t.left);
+				m.top = min(m.top, t.top);
+				m.right = max(m.right, t.right);
+				m.bottom = max(m.bottom, t.bottom);
+			}
+		}
+
+		stats.clear();
+		stats.reserve(tables_.empty() ? 0 : tables_[0].size());
+
+		for (auto &item : tables_[0])
+		{
+			const TMoments &m = item.second;
+
+			stats.push_back(TComponentStats{ item.first, uint(m.area), 
+				cv::Rect(m.left, m.top, m.right - m.left + 1, m.bottom - m.top + 1),
+				cv::Point2d(double(m.sumX) / m.area, double(m.sumY) / m.area) });
+		}
+
+		std::sort(stats.begin(), stats.end(), [](const TComponentStats &a, const TComponentStats &b) { return a.label < b.label; });
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	void TStatsAccumulator::AddRow(const TLabel *labels, int row, int width)
+	{
+		for (int x = 0; x < width; ++x)
+		{
+			const TLabel label = labels[x];
+			if (!label)
+				continue;
+
+			const int left = x;
+			while (x + 1 < width && labels[x + 1] == label)
+				++x;
+
+			AddRun(label, row, left, x);
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// TBitImage declaration
+	///////////////////////////////////////////////////////////////////////////////
+
+	void TBitImage::Create(int rows, int cols)
+	{
+		this->rows = rows;
+		this->cols = cols;
+		stride_ = (cols + 63) >> 6;
+
+		words_.assign(size_t(rows) * stride_, 0);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	void TBitImage::Pack(const TImage& binImg)
+	{
+		THROW_IF(binImg.dims > 2 || binImg.type() != CV_8UC1, "TBitImage::Pack : Input image is not a CV_8UC1 binary image");
+
+		Create(binImg.rows, binImg.cols);
+
+#		pragma omp parallel for
+		for (int y = 0; y < rows; ++y)
+		{
+			const TPixel *px = binImg.ptr<TPixel>(y);
+			uint64 *row = Row(y);
+
+			for (int w = 0; w < stride_; ++w)
+			{
+				const TPixel *wordPx = px + (w << 6);
+				const int last = min(cols - (w << 6), 64);
+				uint64 word = 0;
+
+				for (int b = 0; b < last; ++b)
+					word |= uint64(wordPx[b] != 0) << b;
+
+				row[w] = word;
+			}
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	void TBitImage::Unpack(TImage& binImg) const
+	{
+		binImg.create(rows, cols, CV_8UC1);
+
+#		pragma omp parallel for
+		for (int y = 0; y < rows; ++y)
+		{
+			TPixel *px = binImg.ptr<TPixel>(y);
+			const uint64 *row = Row(y);
+
+			for (int x = 0; x < cols; ++x)
+				px[x] = (row[x >> 6] >> (x & 63)) & 1 ? 255 : 0;
+		}
+	}
+
 	///////////////////////////////////////////////////////////////////////////////
 	// ILabeling declaration
 	///////////////////////////////////////////////////////////////////////////////
 
-	TTime ILabeling::Label(const TImage& pixels, TImage& labels, char threads, TCoherence coh)
+	TTime ILabeling::Label(const TImage& pixels, TImage& labels, char threads, TCoherence coh)
+	{
+		THROW_IF(pixels.empty(), "ILabeling::Label : Input image is empty");
+
+		return LabelBinary(BinaryInput(pixels, false), labels, threads, coh);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	TTime ILabeling::LabelBinary(const TImage& binImg, TImage& labels, char threads, TCoherence coh)
+	{
+		THROW_IF(binImg.empty(), "ILabeling::LabelBinary : Input image is empty");
+		THROW_IF(binImg.type() != CV_8UC1, "ILabeling::LabelBinary : Input image is not a CV_8UC1 binary image");
+
+		TImage pixels = BinaryInput(binImg, true);
+
+		labels.create(pixels.rows, pixels.cols, CV_32SC1);
+		labels.setTo(0);
+
+		profile_.Reset();
+		labelCount_ = 0;
+
+		watch_.reset();
+		watch_.start();
+		
+		DoLabel(pixels, labels, threads, coh);
+		CompactIfNeeded(labels, threads);
+
+		watch_.stop();
+
+		return profile_.total = watch_.getTime() * 1000;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	TTime ILabeling::LabelWithStats(const TImage& pixels, TImage& labels, TStats& stats, char threads, TCoherence coh, bool binary)
+	{
+		THROW_IF(pixels.dims > 2, "ILabeling::LabelWithStats : Stats are supported for 2D images only");
+
+		// Threads are set up here as well, so tables cover the team algorithm runs
+		SetupThreads(threads);
+		stats_.Begin(omp_get_max_threads());
+		compactMap_ = nullptr;
+
+		TTime time;
+		try 
+		{
+			time = binary ? LabelBinary(pixels, labels, threads, coh) : Label(pixels, labels, threads, coh);
+		}
+		catch (...)
+		{
+			stats_.End(stats);
+			throw;
+		}
+
+		const bool fused = stats_.Collected();
+
+		if (!fused)
+		{
+			StopWatchWin watch;
+			watch.start();
+
+#			pragma omp parallel for
+			for (int y = 0; y < labels.rows; ++y)
+				stats_.AddRow(labels.ptr<TLabel>(y), y, labels.cols);
+
+			watch.stop();
+
+			const TTime statsTime = watch.getTime() * 1000;
+			profile_.Add("Stats", statsTime, labels.total() * sizeof(TLabel));
+
+			time = profile_.total += statsTime;
+		}
+
+		stats_.End(stats);
+
+		// Fused stats got labels before compaction, renumbering keeps their order
+		if (fused && compactMap_)
+		{
+			for (auto &st : stats)
+				st.label = compactMap_[st.label];
+		}
+
+		return time;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	template <typename F>
+	uint ILabeling::CompactLabels(size_t count, F label, char threads)
+	{
+		SetupThreads(threads);
+
+		const int BLOCK = 1 << 14; // Elements per iteration of parallel loops
+		const int blocks = int((count + BLOCK - 1) / BLOCK);
+
+		// Largest label gives size of flags
+		TLabel *blockMax = workspace_.Get<TLabel>(WS_COMPACT_SUMS, blocks);
+
+#		pragma omp parallel for
+		for (int b = 0; b < blocks; ++b)
+		{
+			TLabel maxLabel = 0;
+			for (size_t i = size_t(b) * BLOCK; i < min(count, size_t(b + 1) * BLOCK); ++i)
+				maxLabel = max(maxLabel, label(i));
+			blockMax[b] = maxLabel;
+		}
+
+		TLabel maxLabel = 0;
+		for (int b = 0; b < blocks; ++b)
+			maxLabel = max(maxLabel, blockMax[b]);
+
+		// Flags of used labels, concurrent writes of the same flag store the same value
+		const size_t flagCount = size_t(maxLabel) + 1;
+		const int flagBlocks = int((flagCount + BLOCK - 1) / BLOCK);
+		TLabel *flags = workspace_.Get<TLabel>(WS_COMPACT, flagCount);
+		TLabel *sums = workspace_.Get<TLabel>(WS_COMPACT_SUMS, flagBlocks);
+
+#		pragma omp parallel for
+		for (int b = 0; b < flagBlocks; ++b)
+			memset(flags + size_t(b) * BLOCK, 0, (min(flagCount, size_t(b + 1) * BLOCK) - size_t(b) * BLOCK) * sizeof(TLabel));
+
+#		pragma omp parallel for
+		for (int b = 0; b < blocks; ++b)
+		{
+			for (size_t i = size_t(b) * BLOCK; i < min(count, size_t(b + 1) * BLOCK); ++i)
+				if (label(i))
+					flags[label(i)] = 1;
+		}
+
+		// Prefix sum over flags: block sums, their exclusive scan and numbering inside blocks
+#		pragma omp parallel for
+		for (int b = 0; b < flagBlocks; ++b)
+		{
+			TLabel sum = 0;
+			for (size_t i = size_t(b) * BLOCK; i < min(flagCount, size_t(b + 1) * BLOCK); ++i)
+				sum += flags[i];
+			sums[b] = sum;
+		}
+
+		TLabel labelCount = 0;
+		for (int b = 0; b < flagBlocks; ++b)
+		{
+			const TLabel sum = sums[b];
+			sums[b] = labelCount;
+			labelCount += sum;
+		}
+
+#		pragma omp parallel for
+		for (int b = 0; b < flagBlocks; ++b)
+		{
+			TLabel newLabel = sums[b];
+			for (size_t i = size_t(b) * BLOCK; i < min(flagCount, size_t(b + 1) * BLOCK); ++i)
+				if (flags[i])
+					flags[i] = ++newLabel;
+		}
+
+		// Flags became new labels
+#		pragma omp parallel for
+		for (int b = 0; b < blocks; ++b)
+		{
+			for (size_t i = size_t(b) * BLOCK; i < min(count, size_t(b + 1) * BLOCK); ++i)
+				if (label(i))
+					label(i) = flags[label(i)];
+		}
+
+		compactMap_ = flags;
+
+		return labelCount;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	uint ILabeling::CompactLabels(TImage& labels, char threads)
+	{
+		THROW_IF(labels.type() != CV_32SC1 || !labels.isContinuous(), "ILabeling::CompactLabels : Labels must be continuous CV_32SC1 image");
+
+		TLabel *lb = reinterpret_cast<TLabel*>(labels.data);
+
+		return CompactLabels(labels.total(), [lb](size_t i) -> TLabel& { return lb[i]; }, threads);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	uint ILabeling::CompactLabels(TLabelRuns& runs, char threads)
+	{
+		TLabelRun *rn = runs.data();
+
+		return CompactLabels(runs.size(), [rn](size_t i) -> TLabel& { return rn[i].label; }, threads);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	void ILabeling::CompactIfNeeded(TImage& labels, char threads)
+	{
+		if (compact_ && !labelCount_)
+			labelCount_ = profile_.Run("Compact", 3 * labels.total() * sizeof(TLabel), [&] { return CompactLabels(labels, threads); });
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	TTime ILabeling::LabelRuns(const TImage& pixels, TLabelRuns& runs, char threads, TCoherence coh, bool binary)
+	{
+		THROW_IF(pixels.dims > 2, "ILabeling::LabelRuns : Runs are supported for 2D images only");
+
+		// Labels image is kept, so following calls don't allocate it
+		TTime time = binary ? LabelBinary(pixels, runsLabels_, threads, coh) : Label(pixels, runsLabels_, threads, coh);
+
+		StopWatchWin watch;
+		watch.start();
+
+		LabelsToRuns(runsLabels_, runs);
+
+		watch.stop();
+
+		const TTime runsTime = watch.getTime() * 1000;
+		profile_.Add("Runs", runsTime, runsLabels_.total() * sizeof(TLabel) + runs.size() * sizeof(TLabelRun));
+
+		return profile_.total = time + runsTime;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	TTime ILabeling::LabelPacked(const TBitImage& bits, TImage& labels, char threads, TCoherence coh)
+	{
+		THROW_IF(bits.Empty(), "ILabeling::LabelPacked : Input image is empty");
+
+		if (!PackedInput())
+		{
+			StopWatchWin watch;
+			watch.start();
+
+			TImage binImg(bits.rows, bits.cols, CV_8UC1, workspace_.Get<TPixel>(WS_BIN_IMAGE, bits.rows * bits.cols));
+			bits.Unpack(binImg);
+
+			watch.stop();
+
+			TTime time = LabelBinary(binImg, labels, threads, coh);
+
+			const TTime unpackTime = watch.getTime() * 1000;
+			profile_.Add("Unpack", unpackTime, bits.Bytes() + binImg.total() * sizeof(TPixel));
+
+			return profile_.total = time + unpackTime;
+		}
+
+		labels.create(bits.rows, bits.cols, CV_32SC1);
+		labels.setTo(0);
+
+		profile_.Reset();
+		labelCount_ = 0;
+
+		watch_.reset();
+		watch_.start();
+
+		packed_ = &bits;
+		try
+		{
+			DoLabel(TImage(), labels, threads, coh);
+		}
+		catch (...)
+		{
+			packed_ = nullptr;
+			throw;
+		}
+		packed_ = nullptr;
+
+		CompactIfNeeded(labels, threads);
+
+		watch_.stop();
+
+		return profile_.total = watch_.getTime() * 1000;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	TTime ILabeling::LabelRuns(const TRunMask& mask, TLabelRuns& runs, char threads, TCoherence coh)
+	{
+		StopWatchWin watch;
+		watch.start();
+
+		RunsToImage(mask, runsMask_);
+
+		watch.stop();
+
+		TTime time = LabelRuns(runsMask_, runs, threads, coh, true);
+
+		const TTime decodeTime = watch.getTime() * 1000;
+		profile_.Add("Decode", decodeTime, mask.runs.size() * sizeof(TLabelRun) + runsMask_.total() * sizeof(TPixel));
+
+		return profile_.total = time + decodeTime;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	void ILabeling::RunsToImage(const TRunMask& mask, TImage& binImg)
+	{
+		const vector<uint> offsets = MaskRowOffsets(mask);
+
+		binImg.create(mask.rows, mask.cols, CV_8UC1);
+		binImg.setTo(0);
+
+#		pragma omp parallel for
+		for (int y = 0; y < mask.rows; ++y)
+		{
+			TPixel *px = binImg.ptr<TPixel>(y);
+
+			for (uint i = offsets[y]; i < offsets[y + 1]; ++i)
+				memset(px + mask.runs[i].l, 255, mask.runs[i].r - mask.runs[i].l + 1);
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	void ILabeling::ImageToRuns(const TImage& binImg, TRunMask& mask)
+	{
+		THROW_IF(binImg.dims > 2 || binImg.type() != CV_8UC1, "ILabeling::ImageToRuns : Input image is not a CV_8UC1 binary image");
+
+		mask.rows = binImg.rows;
+		mask.cols = binImg.cols;
+
+		// Runs are counted per row, so every row knows where its runs go
+		vector<uint> offsets(binImg.rows + 1, 0);
+
+		auto forEachRun = [&binImg](int y, const std::function<void(uint l, uint r)> &run)
+		{
+			const TPixel *px = binImg.ptr<TPixel>(y);
+
+			for (int x = 0; x < binImg.cols; ++x)
+			{
+				if (!px[x])
+					continue;
+
+				const int l = x;
+				while (x + 1 < binImg.cols && px[x + 1])
+					++x;
+
+				run(l, x);
+			}
+		};
+
+#		pragma omp parallel for
+		for (int y = 0; y < binImg.rows; ++y)
+		{
+			uint count = 0;
+			forEachRun(y, [&count](uint, uint) { ++count; });
+			offsets[y + 1] = count;
+		}
+
+		for (int y = 0; y < binImg.rows; ++y)
+			offsets[y + 1] += offsets[y];
+
+		mask.runs.resize(offsets[binImg.rows]);
+
+#		pragma omp parallel for
+		for (int y = 0; y < binImg.rows; ++y)
+		{
+			TLabelRun *run = mask.runs.data() + offsets[y];
+			forEachRun(y, [&run, y](uint l, uint r) { *run++ = TLabelRun{ uint(y), l, r, 0 }; });
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	vector<uint> ILabeling::MaskRowOffsets(const TRunMask& mask)
+	{
+		THROW_IF(mask.rows <= 0 || mask.cols <= 0, "ILabeling::MaskRowOffsets : Mask is empty");
+
+		vector<uint> offsets(mask.rows + 1, 0);
+		int row = 0;
+
+		for (size_t i = 0; i < mask.runs.size(); ++i)
+		{
+			const TLabelRun &run = mask.runs[i];
+
+			THROW_IF(run.row >= uint(mask.rows) || run.row < uint(row) || run.l > run.r || run.r >= uint(mask.cols), 
+					 "ILabeling::MaskRowOffsets : Mask runs are out of order or out of mask");
+			THROW_IF(i && run.row == mask.runs[i - 1].row && run.l <= mask.runs[i - 1].r + 1,
+					 "ILabeling::MaskRowOffsets : Mask runs overlap or touch");
+
+			while (row < int(run.row))
+				offsets[++row] = uint(i);
+		}
+
+		while (row < mask.rows)
+			offsets[++row] = uint(mask.runs.size());
+
+		return offsets;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	void ILabeling::LabelsToRuns(const TImage& labels, TLabelRuns& runs)
+	{
+		THROW_IF(labels.dims > 2 || labels.type() != CV_32SC1, "ILabeling::LabelsToRuns : Labels must be 2D CV_32SC1 image");
+
+		// Runs are counted per row, so every row knows where its runs go
+		vector<uint> offsets(labels.rows + 1, 0);
+
+		auto forEachRun = [&labels](int y, const std::function<void(uint l, uint r, TLabel label)> &run)
+		{
+			const TLabel *lb = labels.ptr<TLabel>(y);
+
+			for (int x = 0; x < labels.cols; ++x)
+			{
+				if (!lb[x])
+					continue;
+
+				const int l = x;
+				while (x + 1 < labels.cols && lb[x + 1] == lb[l])
+					++x;
+
+				run(l, x, lb[l]);
+			}
+		};
+
+#		pragma omp parallel for
+		for (int y = 0; y < labels.rows; ++y)
+		{
+			uint count = 0;
+			forEachRun(y, [&count](uint, uint, TLabel) { ++count; });
+			offsets[y + 1] = count;
+		}
+
+		for (int y = 0; y < labels.rows; ++y)
+			offsets[y + 1] += offsets[y];
+
+		runs.resize(offsets[labels.rows]);
+
+#		pragma omp parallel for
+		for (int y = 0; y < labels.rows; ++y)
+		{
+			TLabelRun *run = runs.data() + offsets[y];
+			forEachRun(y, [&run, y](uint l, uint r, TLabel label) { *run++ = TLabelRun{ uint(y), l, r, label }; });
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	TImage ILabeling::BinaryInput(const TImage& pixels, bool binary)
+	{
+		THROW_IF(pixels.empty(), "ILabeling::BinaryInput : Input image is empty");
+
+		TImage binImg;
+
+		if (!binary)
+		{
+			binImg = TImage(pixels.rows, pixels.cols, CV_8UC1, workspace_.Get<TPixel>(WS_BIN_IMAGE, pixels.rows * pixels.cols));
+			RGB2Gray(pixels, binImg);
+
+			return binImg;
+		}
+
+		THROW_IF(pixels.type() != CV_8UC1, "ILabeling::BinaryInput : Input image is not a CV_8UC1 binary image");
+
+		// Algorithms address pixels without row step, so only ROIs get copied
+		if (pixels.isContinuous())
+			return pixels;
+
+		binImg = TImage(pixels.rows, pixels.cols, CV_8UC1, workspace_.Get<TPixel>(WS_BIN_IMAGE, pixels.rows * pixels.cols));
+		pixels.copyTo(binImg);
+
+		return binImg;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	TImage ILabeling::RGB2Gray(const TImage& img)
+	{
+		TImage binImg;
+		RGB2Gray(img, binImg);
+		
+		return binImg;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	void ILabeling::RGB2Gray(const TImage& img, TImage& binImg)
+	{
+		if (img.channels() > 1)
+		{
+			cv::cvtColor(img, binImg, cv::COLOR_RGB2GRAY);
+			cv::threshold(binImg, binImg, cv::THRESH_OTSU, 255, CV_8UC1);
+		}
+		else
+			cv::threshold(img, binImg, cv::THRESH_OTSU, 255, CV_8UC1);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	void ILabeling::ShrinkWorkspace(void)
+	{
+		workspace_.Shrink();
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	void ILabeling::ResetWorkspace(void)
+	{
+		workspace_.Reset();
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	void ILabeling::SetupThreads(char threadCount)
+	{
+		// Default is taken once since omp_get_max_threads returns the last count set.
+		// Settings are per calling thread and only touched on change, so repeated calls
+		// with the same count don't resize the OpenMP team
+		static const int defaultThreads = omp_get_max_threads();
+		static thread_local int lastCount = -1;
+
+		if (lastCount == threadCount)
+			return;
+
+		lastCount = threadCount;
+
+		if (threadCount != MAX_THREADS)
+		{
+			omp_set_dynamic(0);
+			omp_set_num_threads(threadCount);
+		}
+		else
+		{
+			omp_set_dynamic(1);
+			omp_set_num_threads(defaultThreads);
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// ILabeling3D declaration
+	///////////////////////////////////////////////////////////////////////////////
+
+	TTime ILabeling3D::Label(const TImage& pixels, TImage& labels, char threads, TCoherence coh)
+	{
+		THROW_IF(pixels.empty(), "ILabeling3D::Label : Input image is empty");
+		THROW_IF(pixels.dims != 3, "ILabeling3D::Label : Input image is not a 3D image");
+		THROW_IF(coh != TCoherence::COH_DEFAULT, "ILabeling3D::Label : Only default coherence is supported for 3D labeling");
+
+		labels = cv::Mat::zeros(3, pixels.size, CV_32SC1);
+
+		profile_.Reset();
+		labelCount_ = 0;
+
+		watch_.reset();
+		watch_.start();
+
+		DoLabel(pixels, labels, threads, coh);
+		CompactIfNeeded(labels, threads);
+
+		watch_.stop();
+
+		return profile_.total = watch_.getTime() * 1000;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	TTime ILabeling3D::LabelBinary(const TImage& binImg, TImage& labels, char threads, TCoherence coh)
+	{
+		return Label(binImg, labels, threads, coh);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// TOCLSession declaration
+	///////////////////////////////////////////////////////////////////////////////
+
+	TOCLSession::TOCLSession(void)
+		: State(state)
+	{
+		memset(&state, 0, sizeof(state));
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	TOCLSession::~TOCLSession(void)
+	{
+		TerminateOpenCL(&state);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	std::shared_ptr<TOCLSession> TOCLSession::Get(cl_device_type deviceType, const std::string& buildParams, 
+												  const std::string& srcFileName, const std::string& binaryCacheDir,
+												  cl_command_queue_properties queueProps)
+	{
+		static std::mutex sessionsLock;
+		static std::map<std::string, std::weak_ptr<TOCLSession>> sessions;
+
+		const std::string key = std::to_string(deviceType) + '\n' + buildParams + '\n' + srcFileName + '\n' + std::to_string(queueProps);
+
+		// Lock is held while building, so concurrent instances wait for a single build
+		std::lock_guard<std::mutex> lock(sessionsLock);
+
+		// Sessions of released devices are dropped, so registry holds only live ones
+		for (auto it = sessions.begin(); it != sessions.end();)
+			it = it->second.expired() ? sessions.erase(it) : std::next(it);
+
+		auto session = sessions[key].lock();
+		if (session)
+			return session;
+
+		clInitParams params = { deviceType, "", "", "", queueProps };
+		strcpy_s(params.build_params, buildParams.c_str());
+		strcpy_s(params.kernel_source_file_name, srcFileName.c_str());
+		strcpy_s(params.binary_cache_dir, binaryCacheDir.c_str());
+
+		session.reset(new TOCLSession);
+
+		int err = InitOpenCL(&session->state, &params);
+		THROW_IF_OCL(err, "TOCLSession::Get::InitOpenCL");
+
+		sessions[key] = session;
+
+		return session;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// IOCLLabeling declaration
+	///////////////////////////////////////////////////////////////////////////////
+
+	std::string IOCLLabeling::binaryCacheDir;
+	bool IOCLLabeling::eventProfiling = false;
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	IOCLLabeling::IOCLLabeling(void)
+		: isInitialized(false),
+		  Initialized(isInitialized),
+		  State(OCLState),
+		  clearKernel(NULL),
+		  unpackKernel(NULL),
+		  compactMarkKernel(NULL),
+		  compactSumKernel(NULL),
+		  compactScanTopKernel(NULL),
+		  compactScanKernel(NULL),
+		  compactGatherKernel(NULL),
+		  transferQueue(NULL),
+		  syncInterval(1),
+		  hostMemory(false),
+		  profiling(false)
+	{
+		/* Empty */
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	void IOCLLabeling::Init(cl_device_type deviceType, const std::string& buildParams, const std::string& srcFileName)
+	{
+		TerminateOCL();
+
+		session = TOCLSession::Get(deviceType, buildParams, srcFileName, binaryCacheDir, 
+								   eventProfiling ? CL_QUEUE_PROFILING_ENABLE : 0);
+		OCLState = session->State;
+		hostMemory = State.device_info.host_unified_memory == CL_TRUE;
+		profiling = eventProfiling;
+		isInitialized = true;
+
+		cl_int err;
+		clearKernel = clCreateKernel(State.program, "ClearLabelsKernel", &err);
+		THROW_IF_OCL(err, "IOCLLabeling::Init");
+		unpackKernel = clCreateKernel(State.program, "UnpackBitsKernel", &err);
+		THROW_IF_OCL(err, "IOCLLabeling::Init");
+
+		compactMarkKernel = clCreateKernel(State.program, "CompactMarkKernel", &err);
+		THROW_IF_OCL(err, "IOCLLabeling::Init");
+		compactSumKernel = clCreateKernel(State.program, "CompactSumKernel", &err);
+		THROW_IF_OCL(err, "IOCLLabeling::Init");
+		compactScanTopKernel = clCreateKernel(State.program, "CompactScanTopKernel", &err);
+		THROW_IF_OCL(err, "IOCLLabeling::Init");
+		compactScanKernel = clCreateKernel(State.program, "CompactScanKernel", &err);
+		THROW_IF_OCL(err, "IOCLLabeling::Init");
+		compactGatherKernel = clCreateKernel(State.program, "CompactGatherKernel", &err);
+		THROW_IF_OCL(err, "IOCLLabeling::Init");
+
+		InitKernels();		
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	void IOCLLabeling::SetBinaryCacheDir(const std::string& dir)
+	{
+		THROW_IF(dir.size() >= CL_CACHE_DIR_SIZE, "IOCLLabeling::SetBinaryCacheDir : Path is too long");
+
+		binaryCacheDir = dir;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	void IOCLLabeling::SetEventProfiling(bool enable)
+	{
+		eventProfiling = enable;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	TTime IOCLLabeling::Label(const TImage& pixels, TImage& labels, char threads, TCoherence coh)
+	{
+		THROW_IF(!Initialized, "IOCLLabeling::Label : OpenCL device is not initialized");
+		THROW_IF(pixels.empty(), "IOCLLabeling::Label : Input image is empty");
+
+		TImage binImg = AlignedBinImage(pixels);
+		TImage binRoi = binImg(cv::Rect(0, 0, pixels.cols, pixels.rows));
+
+		RGB2Gray(pixels, binRoi);
+
+		return LabelAligned(binImg, pixels, labels, coh);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	TTime IOCLLabeling::LabelBinary(const TImage& binImg, TImage& labels, char threads, TCoherence coh)
+	{
+		THROW_IF(!Initialized, "IOCLLabeling::LabelBinary : OpenCL device is not initialized");
+		THROW_IF(binImg.empty(), "IOCLLabeling::LabelBinary : Input image is empty");
+		THROW_IF(binImg.type() != CV_8UC1, "IOCLLabeling::LabelBinary : Input image is not a CV_8UC1 binary image");
+
+		// Kernels need aligned image, so the mask is only copied into padded workspace
+		TImage alignedImg = AlignedBinImage(binImg);
+		binImg.copyTo(alignedImg(cv::Rect(0, 0, binImg.cols, binImg.rows)));
+
+		return LabelAligned(alignedImg, binImg, labels, coh);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	TTime IOCLLabeling::LabelRuns(const TImage& pixels, TLabelRuns& runs, char threads, TCoherence coh, bool binary)
+	{
+		if (!HasRunsOutput())
+			return ILabeling::LabelRuns(pixels, runs, threads, coh, binary);
+
+		THROW_IF(!Initialized, "IOCLLabeling::LabelRuns : OpenCL device is not initialized");
+		THROW_IF(pixels.empty(), "IOCLLabeling::LabelRuns : Input image is empty");
+		THROW_IF(binary && pixels.type() != CV_8UC1, "IOCLLabeling::LabelRuns : Input image is not a CV_8UC1 binary image");
+
+		// Initialization
+		StopWatchWin endToEnd;
+		endToEnd.start();
+
+		TImage binImg = AlignedBinImage(pixels);
+		TImage binRoi = binImg(cv::Rect(0, 0, pixels.cols, pixels.rows));
+
+		if (binary)
+			pixels.copyTo(binRoi);
+		else
+			RGB2Gray(pixels, binRoi);
+
+		ResetProfile();
+		profile_.Run("Upload", binImg.total() * sizeof(TPixel), [&] { UploadPixels(binImg); });
+		labelCount_ = 0;
+
+		if (!runsBuf)
+			runsBuf.reset(new TOCLDeviceBuffer(*this));
+
+		watch_.reset();
+		watch_.start();
+
+		// Actual Code
+		const cl_uint count = DoOCLLabelRuns(*pixBuf, *runsBuf, binImg.cols, binImg.rows, coh);
+		clFinish(State.queue); // Last kernels may still be queued
+
+		// Post Conditions
+		watch_.stop();
+		profile_.Add("Label", watch_.getTime() * 1000);
+
+		// Only runs are read back, labels image is never filled
+		const TTime time = watch_.getTime() * 1000 + DownloadRuns(runs, count, threads);
+
+		endToEnd.stop();
+		profile_.endToEnd = endToEnd.getTime() * 1000;
+		CollectEvents();
+
+		return profile_.total = time;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	TTime IOCLLabeling::LabelPacked(const TBitImage& bits, TImage& labels, char threads, TCoherence coh)
+	{
+		THROW_IF(!Initialized, "IOCLLabeling::LabelPacked : OpenCL device is not initialized");
+		THROW_IF(bits.Empty(), "IOCLLabeling::LabelPacked : Input image is empty");
+
+		// Initialization
+		StopWatchWin endToEnd;
+		endToEnd.start();
+
+		const cv::Size alignedSize = AlignedSize(bits.rows, bits.cols);
+
+		ResetProfile();
+		profile_.Run("Upload", bits.Bytes(), [&] { UploadPacked(bits, alignedSize); });
+		labelCount_ = 0;
+
+		watch_.reset();
+		watch_.start();
+
+		// Actual Code
+		DoOCLLabel(PixelsBuffer(), LabelsBuffer(), alignedSize.width, alignedSize.height, coh);
+		CompactDeviceLabels(LabelsBuffer());
+		clFinish(State.queue); // Last kernels may still be queued
+
+		// Post Conditions
+		watch_.stop();
+		profile_.Add("Label", watch_.getTime() * 1000);
+
+		profile_.Run("Download", alignedSize.area() * sizeof(TLabel), [&] {
+			DownloadLabels(alignedSize)(cv::Rect(0, 0, bits.cols, bits.rows)).copyTo(labels);
+		});
+
+		endToEnd.stop();
+		profile_.endToEnd = endToEnd.getTime() * 1000;
+		CollectEvents();
+
+		return profile_.total = watch_.getTime() * 1000;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	TTime IOCLLabeling::LabelRuns(const TRunMask& mask, TLabelRuns& runs, char threads, TCoherence coh)
+	{
+		if (!HasRunsOutput())
+			return ILabeling::LabelRuns(mask, runs, threads, coh);
+
+		THROW_IF(!Initialized, "IOCLLabeling::LabelRuns : OpenCL device is not initialized");
+
+		// Initialization
+		StopWatchWin endToEnd;
+		endToEnd.start();
+
+		const vector<uint> offsets = MaskRowOffsets(mask);
+		const cl_uint count = cl_uint(mask.runs.size());
+
+		if (!maskRunsBuf)
+		{
+			maskRunsBuf.reset(new TOCLDeviceBuffer(*this, CL_MEM_READ_ONLY));
+			maskOffsetsBuf.reset(new TOCLDeviceBuffer(*this, CL_MEM_READ_ONLY));
+		}
+		if (!runsBuf)
+			runsBuf.reset(new TOCLDeviceBuffer(*this));
+
+		maskRunsBuf->Reserve(max(count, cl_uint(1)) * sizeof(TLabelRun));
+		maskOffsetsBuf->Reserve(offsets.size() * sizeof(uint));
+		runsBuf->Reserve(max(count, cl_uint(1)) * sizeof(TLabelRun));
+
+		ResetProfile();
+		labelCount_ = 0;
+
+		profile_.Run("Upload", count * sizeof(TLabelRun) + offsets.size() * sizeof(uint), [&] {
+			cl_int clError = clEnqueueWriteBuffer(State.queue, maskOffsetsBuf->buffer, CL_TRUE, 0, offsets.size() * sizeof(uint), 
+												  offsets.data(), 0, NULL, ProfileEvent("HostToDevice", offsets.size() * sizeof(uint)));
+			if (count)
+				clError |= clEnqueueWriteBuffer(State.queue, maskRunsBuf->buffer, CL_TRUE, 0, count * sizeof(TLabelRun), 
+												mask.runs.data(), 0, NULL, ProfileEvent("HostToDevice", count * sizeof(TLabelRun)));
+			THROW_IF_OCL(clError, "IOCLLabeling::LabelRuns");
+		});
+
+		watch_.reset();
+		watch_.start();
+
+		// Actual Code
+		DoOCLLabelRuns(*maskRunsBuf, *maskOffsetsBuf, *runsBuf, mask.cols, mask.rows, coh);
+		clFinish(State.queue); // Last kernels may still be queued
+
+		// Post Conditions
+		watch_.stop();
+		profile_.Add("Label", watch_.getTime() * 1000);
+
+		const TTime time = watch_.getTime() * 1000 + DownloadRuns(runs, count, threads);
+
+		endToEnd.stop();
+		profile_.endToEnd = endToEnd.getTime() * 1000;
+		CollectEvents();
+
+		return profile_.total = time;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	TTime IOCLLabeling::DownloadRuns(TLabelRuns& runs, cl_uint count, char threads)
+	{
+		profile_.Run("Download", count * sizeof(TLabelRun), [&] {
+			runs.resize(count);
+
+			if (!count)
+				return;
+
+			cl_int clError = clEnqueueReadBuffer(State.queue, runsBuf->buffer, CL_TRUE, 0, count * sizeof(TLabelRun), 
+												 runs.data(), 0, NULL, ProfileEvent("DeviceToHost", count * sizeof(TLabelRun)));
+			THROW_IF_OCL(clError, "IOCLLabeling::DownloadRuns");
+		});
+
+		if (!Compaction())
+			return 0;
+
+		StopWatchWin watch;
+		watch.start();
+
+		labelCount_ = CompactLabels(runs, threads);
+
+		watch.stop();
+		profile_.Add("Compact", watch.getTime() * 1000, runs.size() * sizeof(TLabelRun));
+
+		return watch.getTime() * 1000;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	cv::Size IOCLLabeling::AlignedSize(const TImage& pixels)
+	{
+		return AlignedSize(pixels.rows, pixels.cols);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	cv::Size IOCLLabeling::AlignedSize(int rows, int cols)
+	{
+		return cv::Size((cols >> 5 << 5) + 32, (rows >> 5 << 5) + 32);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	TImage IOCLLabeling::AlignedBinImage(const TImage& pixels)
+	{
+		const cv::Size alignedSize = AlignedSize(pixels);
+		const size_t count = alignedSize.width * alignedSize.height;
+		TPixel *data;
+
+		if (hostMemory)
+		{
+			ReservePixels(count);
+			data = pixBuf->Map(CL_MAP_WRITE);
+		}
+		else
+			data = workspace_.Get<TPixel>(WS_BIN_IMAGE, count);
+
+		TImage binImg(alignedSize.height, alignedSize.width, CV_8UC1, data);
+
+		binImg.setTo(0);
+
+		return binImg;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	TTime IOCLLabeling::LabelAligned(const TImage& binImg, const TImage& pixels, TImage& labels, TCoherence coh)
+	{
+		// Initialization
+		StopWatchWin endToEnd;
+		endToEnd.start();
+
+		ResetProfile();
+		profile_.Run("Upload", binImg.total() * sizeof(TPixel), [&] { 
+			if (!hostMemory)
+			{
+				UploadImage(binImg);
+				return;
+			}
+
+			// binImg is mapped pixels buffer, so it's already filled and labels are mapped on download
+			ReserveLabels(binImg.total());
+			UploadPixels(binImg);
+			ClearLabels(*lbBuf);
+		});
+		labelCount_ = 0;
+		
+		watch_.reset();
+		watch_.start();
+
+		// Actual Code
+		DoOCLLabel(PixelsBuffer(), LabelsBuffer(), binImg.cols, binImg.rows, coh);
+		CompactDeviceLabels(LabelsBuffer());
+		clFinish(State.queue); // Last kernels may still be queued
+
+		// Post Conditions
+		watch_.stop();
+		profile_.Add("Label", watch_.getTime() * 1000);
+
+		profile_.Run("Download", binImg.total() * sizeof(TLabel), [&] {
+			const TImage lbRoi = DownloadLabels(binImg)(cv::Rect(0, 0, pixels.cols, pixels.rows));
+
+			if (!stats_.Active())
+			{
+				lbRoi.copyTo(labels);
+				return;
+			}
+
+			// Stats are gathered while rows are copied, so labels are read once
+			labels.create(lbRoi.size(), CV_32SC1);
+
+#			pragma omp parallel for
+			for (int y = 0; y < lbRoi.rows; ++y)
+			{
+				const TLabel *src = lbRoi.ptr<TLabel>(y);
+				memcpy(labels.ptr<TLabel>(y), src, lbRoi.cols * sizeof(TLabel));
+				stats_.AddRow(src, y, lbRoi.cols);
+			}
+
+			stats_.SetCollected();
+		});
+
+		endToEnd.stop();
+		profile_.endToEnd = endToEnd.getTime() * 1000;
+		CollectEvents();
+		
+		return profile_.total = watch_.getTime() * 1000;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	size_t IOCLLabeling::LabelBatch(const TFrameSource& source, const TLabelsSink& sink, bool binaryInput, TCoherence coh)
+	{
+		THROW_IF(!Initialized, "IOCLLabeling::LabelBatch : OpenCL device is not initialized");
+
+		TImage frame, labels;
+		size_t count = 0;
+
+		// Nothing is transferred on devices sharing memory with host, so frames just go one by one
+		if (hostMemory)
+		{
+			while (source(frame))
+			{
+				TTime time = binaryInput ? LabelBinary(frame, labels, MAX_THREADS, coh) : Label(frame, labels, MAX_THREADS, coh);
+				sink(labels, time);
+				++count;
+			}
+
+			return count;
+		}
+
+		cl_int clError;
+
+		if (!transferQueue)
+		{
+			transferQueue = clCreateCommandQueue(State.context, State.device_info.device_ID, 0, &clError);
+			THROW_IF_OCL(clError, "IOCLLabeling::LabelBatch");
+		}
+
+		// Frame in flight, frame i + 1 is uploaded and frame i - 1 is downloaded while frame i is labeled
+		struct TSlot
+		{
+			std::unique_ptr<TOCLBuffer<TPixel>> pixels;
+			std::unique_ptr<TOCLBuffer<TLabel>> labels;
+			cv::Size size, alignedSize;
+			TTime time;
+			cl_uint labelCount;	// Read without blocking by compaction, valid once labels are downloaded
+			cl_event uploaded, labeled, downloaded;
+		};
+
+		const size_t SLOTS = 3;
+		TSlot slots[SLOTS];
+
+		for (auto &slot : slots)
+		{
+			slot.pixels.reset(new TOCLBuffer<TPixel>(*this, TOCLBufferType::READ_ONLY, 1));
+			slot.labels.reset(new TOCLBuffer<TLabel>(*this, TOCLBufferType::READ_WRITE, 1));
+			slot.labelCount = 0;
+			slot.uploaded = slot.labeled = slot.downloaded = NULL;
+		}
+
+		auto releaseEvents = [](TSlot &slot)
+		{
+			for (cl_event *event : { &slot.uploaded, &slot.labeled, &slot.downloaded })
+			{
+				if (*event)
+					clReleaseEvent(*event);
+				*event = NULL;
+			}
+		};
+
+		// Reads next frame into slot and enqueues its upload
+		auto readFrame = [&](TSlot &slot) -> bool
+		{
+			if (!source(frame))
+				return false;
+
+			THROW_IF(frame.empty(), "IOCLLabeling::LabelBatch : Input image is empty");
+			THROW_IF(binaryInput && frame.type() != CV_8UC1, "IOCLLabeling::LabelBatch : Input image is not a CV_8UC1 binary image");
+
+			slot.size = cv::Size(frame.cols, frame.rows);
+			slot.alignedSize = AlignedSize(frame);
+
+			const size_t pixCount = slot.alignedSize.width * slot.alignedSize.height;
+			slot.pixels->Resize(pixCount);
+			slot.labels->Resize(pixCount);
+
+			TImage binImg(slot.alignedSize.height, slot.alignedSize.width, CV_8UC1, slot.pixels->Buffer().data());
+			TImage binRoi = binImg(cv::Rect(0, 0, frame.cols, frame.rows));
+
+			binImg.setTo(0);
+			if (binaryInput)
+				frame.copyTo(binRoi);
+			else
+				RGB2Gray(frame, binRoi);
+
+			slot.pixels->PushAsync(transferQueue, 0, NULL, &slot.uploaded);
+
+			clError = clFlush(transferQueue);
+			THROW_IF_OCL(clError, "IOCLLabeling::LabelBatch");
+
+			return true;
+		};
+
+		// Labels slot frame after its upload and enqueues labels download
+		auto labelFrame = [&](TSlot &slot)
+		{
+			ResetProfile();
+			ClearLabels(*slot.labels, slot.uploaded);
+			labelCount_ = 0;
+
+			watch_.reset();
+			watch_.start();
+
+			DoOCLLabel(*slot.pixels, *slot.labels, slot.alignedSize.width, slot.alignedSize.height, coh);
+			CompactDeviceLabels(*slot.labels, &slot.labelCount);
+
+			clError = clEnqueueMarker(State.queue, &slot.labeled);
+			clError |= clFlush(State.queue);
+			THROW_IF_OCL(clError, "IOCLLabeling::LabelBatch");
+
+			// Last kernels may still be queued, transfers of the neighbour frames go on meanwhile
+			clError = clWaitForEvents(1, &slot.labeled);
+			THROW_IF_OCL(clError, "IOCLLabeling::LabelBatch");
+
+			watch_.stop();
+			slot.time = profile_.total = watch_.getTime() * 1000;
+			profile_.Add("Label", slot.time);
+
+			CollectEvents(); // Kernels of this frame only, transfer queue is not profiled
+
+			slot.labels->PullAsync(transferQueue, 1, &slot.labeled, &slot.downloaded);
+
+			clError = clFlush(transferQueue);
+			THROW_IF_OCL(clError, "IOCLLabeling::LabelBatch");
+		};
+
+		// Waits for slot labels and passes them to sink
+		auto finishFrame = [&](TSlot &slot)
+		{
+			clError = clWaitForEvents(1, &slot.downloaded);
+			releaseEvents(slot);
+			THROW_IF_OCL(clError, "IOCLLabeling::LabelBatch");
+
+			labelCount_ = slot.labelCount; // Download waits for labeling, so count read is over too
+
+			TImage lbImg(slot.alignedSize.height, slot.alignedSize.width, CV_32SC1, slot.labels->Buffer().data());
+			sink(lbImg(cv::Rect(0, 0, slot.size.width, slot.size.height)), slot.time);
+			++count;
+		};
+
+		try
+		{
+			size_t read = readFrame(slots[0]) ? 1 : 0;
+
+			for (size_t i = 0; i < read; ++i)
+			{
+				if (i >= 2)
+					finishFrame(slots[(i - 2) % SLOTS]); // Frees slot for the next frame
+
+				if (readFrame(slots[(i + 1) % SLOTS]))
+					++read;
+
+				labelFrame(slots[i % SLOTS]);
+			}
+
+			for (size_t i = read > 2 ? read - 2 : 0; i < read; ++i)
+				finishFrame(slots[i % SLOTS]);
+		}
+		catch (...)
+		{
+			// Transfers into slot host buffers must be over before slots go away
+			clFinish(transferQueue);
+			clFinish(State.queue);
+
+			for (auto &slot : slots)
+				releaseEvents(slot);
+
+			throw;
+		}
+
+		return count;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	void IOCLLabeling::UploadImage(const TImage& binImg)
 	{
-		THROW_IF(pixels.empty(), "ILabeling::Label : Input image is empty");
+		const size_t count = binImg.total();
 
-		TImage binImg = RGB2Gray(pixels);
-		labels = cv::Mat::zeros(binImg.rows, binImg.cols, CV_32SC1);
+		ReservePixels(count);
+		ReserveLabels(count);
 
-		watch_.reset();
-		watch_.start();
-		
-		DoLabel(binImg, labels, threads, coh);
+		if (hostMemory)
+			memcpy(pixBuf->Map(CL_MAP_WRITE), binImg.data, sizeof(TPixel) * count);
 
-		watch_.stop();
+		UploadPixels(binImg);
 
-		return watch_.getTime() * 1000;
+		// Labels are cleared on device, so nothing is uploaded for them
+		ClearLabels(*lbBuf);
 	}
 
 	///////////////////////////////////////////////////////////////////////////////
 
-	TImage ILabeling::RGB2Gray(const TImage& img)
+	void IOCLLabeling::UploadPixels(const TImage& binImg)
 	{
-		TImage binImg = img;
+		if (hostMemory)
+		{
+			pixBuf->Unmap();
+			return;
+		}
 
-		if (img.channels() > 1)
-			cv::cvtColor(binImg, binImg, cv::COLOR_RGB2GRAY);
-		
-		cv::threshold(binImg, binImg, cv::THRESH_OTSU, 255, CV_8UC1);
-		
-		return binImg;
+		const size_t count = binImg.total();
+
+		ReservePixels(count);
+		memcpy(pixBuf->Buffer().data(), binImg.data, sizeof(TPixel) * count);
+		pixBuf->Push();
 	}
 
 	///////////////////////////////////////////////////////////////////////////////
 
-	void ILabeling::SetupThreads(char threadCount)
+	void IOCLLabeling::UploadPacked(const TBitImage& bits, const cv::Size& alignedSize)
 	{
-		if (threadCount != MAX_THREADS)
+		const size_t count = alignedSize.area();
+
+		ReservePixels(count);
+		ReserveLabels(count);
+
+		if (!packedBuf)
+			packedBuf.reset(new TOCLDeviceBuffer(*this, CL_MEM_READ_ONLY));
+		packedBuf->Reserve(bits.Bytes());
+
+		cl_int clError = clEnqueueWriteBuffer(State.queue, packedBuf->buffer, CL_TRUE, 0, bits.Bytes(), bits.Row(0), 
+											  0, NULL, ProfileEvent("HostToDevice", bits.Bytes()));
+		THROW_IF_OCL(clError, "IOCLLabeling::UploadPacked");
+
+		// Every work item unpacks a word of aligned row, padding words and rows become zeros
+		const cl_uint stride = bits.Stride(), rows = bits.rows, alignedWidth = alignedSize.width;
+		const size_t workSize[2] = { size_t((alignedWidth + 63) >> 6), size_t(alignedSize.height) };
+
+		clError  = clSetKernelArg(unpackKernel, 0, sizeof(cl_mem), (void*)&packedBuf->buffer);
+		clError |= clSetKernelArg(unpackKernel, 1, sizeof(cl_mem), (void*)&pixBuf->buffer);
+		clError |= clSetKernelArg(unpackKernel, 2, sizeof(cl_uint), (void*)&stride);
+		clError |= clSetKernelArg(unpackKernel, 3, sizeof(cl_uint), (void*)&rows);
+		clError |= clSetKernelArg(unpackKernel, 4, sizeof(cl_uint), (void*)&alignedWidth);
+		clError |= clEnqueueNDRangeKernel(State.queue, unpackKernel, 2, NULL, workSize, NULL, 0, NULL, KernelEvent(unpackKernel));
+		THROW_IF_OCL(clError, "IOCLLabeling::UploadPacked");
+
+		ClearLabels(*lbBuf);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	void IOCLLabeling::ReserveLabels(size_t count)
+	{
+		if (!lbBuf)
+			lbBuf.reset(new TOCLBuffer<TLabel>(*this, TOCLBufferType::READ_WRITE, count, 
+				hostMemory ? TOCLBufferMemory::HOST_MEMORY : TOCLBufferMemory::DEVICE_MEMORY));
+		else
+			lbBuf->Resize(count);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	void IOCLLabeling::ReservePixels(size_t count)
+	{
+		if (!pixBuf)
+			pixBuf.reset(new TOCLBuffer<TPixel>(*this, TOCLBufferType::READ_ONLY, count,
+				hostMemory ? TOCLBufferMemory::HOST_MEMORY : TOCLBufferMemory::DEVICE_MEMORY));
+		else
+			pixBuf->Resize(count);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	void IOCLLabeling::ClearLabels(TOCLBuffer<TLabel>& labels, cl_event waitEvent)
+	{
+		const size_t count = labels.Size();
+
+		cl_int clError = clSetKernelArg(clearKernel, 0, sizeof(cl_mem), (void*)&labels.buffer);
+		clError |= clEnqueueNDRangeKernel(State.queue, clearKernel, 1, NULL, &count, NULL, 
+			waitEvent ? 1 : 0, waitEvent ? &waitEvent : NULL, KernelEvent(clearKernel));
+		THROW_IF_OCL(clError, "IOCLLabeling::ClearLabels");
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	TImage IOCLLabeling::DownloadLabels(const TImage& binImg)
+	{
+		return TImage(binImg.dims, binImg.size, CV_32SC1, DownloadLabelData());
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	TImage IOCLLabeling::DownloadLabels(const cv::Size& size)
+	{
+		return TImage(size, CV_32SC1, DownloadLabelData());
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	TLabel* IOCLLabeling::DownloadLabelData(void)
+	{
+		if (hostMemory)
+			return lbBuf->Map(CL_MAP_READ); // Stays mapped till the next upload
+
+		lbBuf->Pull();
+		return lbBuf->Buffer().data();
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	TOCLBuffer<char>& IOCLLabeling::NoChanges(void)
+	{
+		if (!noChanges)
+			noChanges.reset(new TOCLBuffer<char>(*this, TOCLBufferType::READ_WRITE, 1));
+
+		return *noChanges;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	void IOCLLabeling::SetSyncInterval(uint iterations)
+	{
+		THROW_IF(iterations == 0, "IOCLLabeling::SetSyncInterval : At least one iteration per check is needed");
+
+		syncInterval = iterations;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	void IOCLLabeling::RunTillConverged(const std::function<void(void)>& scan, const std::function<void(void)>& analyze)
+	{
+		TOCLBuffer<char> &noChanges = NoChanges();
+
+		if (syncInterval == 1)
 		{
-			omp_set_dynamic(0);
-			omp_set_num_threads(threadCount);
+			// Blocking check after every scan
+			while (true) {
+				noChanges[0] = 1;
+				noChanges.Push();
+
+				scan();
+				++profile_.iterations;
+
+				noChanges.Pull();
+				if (noChanges[0]) break;
+
+				analyze();
+			}
+
+			return;
 		}
-		else
+
+		// Flag is reset before the last scan of every batch and read without blocking. Host waits
+		// for the previous batch flag only after the next batch is enqueued, so device never idles
+		static const char flagInit = 1;
+		char flags[2] = { 0, 0 };
+
+		// Reads still in flight when something throws would write into the freed flags, so 
+		// queue is finished and their events are released first (declared after flags)
+		struct TPendingReads {
+			cl_command_queue queue;
+			cl_event events[2];
+
+			~TPendingReads(void) {
+				if (!events[0] && !events[1]) return;
+				clFinish(queue);
+				for (cl_event &e : events) if (e) clReleaseEvent(e);
+			}
+		} pending = { State.queue, { NULL, NULL } };
+
+		cl_event (&events)[2] = pending.events;
+		cl_int clError = CL_SUCCESS;
+		size_t cur = 0;
+
+		for (size_t batch = 0; ; ++batch)
 		{
-			omp_set_dynamic(1);
-			omp_set_num_threads(omp_get_max_threads());
+			cur = batch & 1;
+
+			for (uint i = 1; i < syncInterval; ++i)
+			{
+				scan();
+				analyze();
+			}
+
+			profile_.iterations += syncInterval; // Including speculative ones
+
+			clError |= clEnqueueWriteBuffer(State.queue, noChanges.buffer, CL_FALSE, 0, 1, &flagInit, 0, NULL, ProfileEvent("HostToDevice", 1));
+			scan();
+			clError |= clEnqueueReadBuffer(State.queue, noChanges.buffer, CL_FALSE, 0, 1, &flags[cur], 0, NULL, &events[cur]);
+			analyze();
+
+			clError |= clFlush(State.queue);
+			THROW_IF_OCL(clError, "IOCLLabeling::RunTillConverged");
+
+			if (batch == 0)
+				continue;
+
+			const size_t prev = cur ^ 1;
+			clError = clWaitForEvents(1, &events[prev]);
+			clReleaseEvent(events[prev]);
+			events[prev] = NULL;
+			THROW_IF_OCL(clError, "IOCLLabeling::RunTillConverged");
+
+			if (flags[prev]) break;
 		}
+
+		// The last batch was speculative, but its flag read still has to finish
+		clError = clWaitForEvents(1, &events[cur]);
+		clReleaseEvent(events[cur]);
+		events[cur] = NULL;
+		THROW_IF_OCL(clError, "IOCLLabeling::RunTillConverged");
 	}
 
 	///////////////////////////////////////////////////////////////////////////////
-	// IOCLLabeling declaration
+
+	cl_event* IOCLLabeling::ProfileEvent(const std::string& name, size_t bytes) const
+	{
+		if (!profiling)
+			return NULL;
+
+		profEvents.push_back(TProfiledEvent{ name, bytes, NULL });
+
+		return &profEvents.back().event;
+	}
+
 	///////////////////////////////////////////////////////////////////////////////
 
-	IOCLLabeling::IOCLLabeling(void)
-		: isInitialized(false),
-		  Initialized(isInitialized),
-		  State(OCLState)
+	cl_event* IOCLLabeling::KernelEvent(cl_kernel kernel) const
 	{
-		/* Empty */
+		if (!profiling)
+			return NULL;
+
+		char name[256] = "";
+		clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, sizeof(name), name, NULL);
+
+		return ProfileEvent(name);
 	}
 
 	///////////////////////////////////////////////////////////////////////////////
 
-	void IOCLLabeling::Init(cl_device_type deviceType, const std::string& buildParams, const std::string& srcFileName)
+	void IOCLLabeling::ResetProfile(void)
 	{
-		TerminateOCL();
+		// Events of a call which threw before collecting them are dropped, their commands still run
+		for (auto &prof : profEvents)
+			if (prof.event)
+				clReleaseEvent(prof.event);
 
-		clInitParams params = { deviceType, "", "" };
-		strcpy_s(params.build_params, buildParams.c_str());
-		strcpy_s(params.kernel_source_file_name, srcFileName.c_str());
+		profEvents.clear();
+		profile_.Reset();
+	}
 
-		int err = InitOpenCL(&OCLState, &params);
-		isInitialized = !err;
-		THROW_IF_OCL(err, "IOCLLabeling::Init::InitOpenCL");
+	///////////////////////////////////////////////////////////////////////////////
 
-		InitKernels();		
+	void IOCLLabeling::CollectEvents(void)
+	{
+		if (profEvents.empty())
+			return;
+
+		// Only profiled commands are waited for, so batch frames keep overlapping
+		std::vector<cl_event> events;
+		for (auto &prof : profEvents)
+			if (prof.event)
+				events.push_back(prof.event);
+
+		cl_int clError = events.empty() ? CL_SUCCESS : clWaitForEvents(cl_uint(events.size()), events.data());
+
+		// Nanoseconds are summed per name before rounding to us, kernels often take less than 1 us
+		struct TDeviceTime
+		{
+			std::string name;
+			cl_ulong time;
+			uint runs;
+			size_t bytes;
+		};
+
+		std::vector<TDeviceTime> times;
+
+		for (auto &prof : profEvents)
+		{
+			if (!prof.event)
+				continue; // Enqueue failed
+
+			cl_ulong start = 0, end = 0;
+			clError |= clGetEventProfilingInfo(prof.event, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL);
+			clError |= clGetEventProfilingInfo(prof.event, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL);
+			clReleaseEvent(prof.event);
+
+			auto time = std::find_if(times.begin(), times.end(), [&](const TDeviceTime &t) { return t.name == prof.name; });
+			if (time == times.end())
+				time = times.insert(times.end(), TDeviceTime{ prof.name, 0, 0, 0 });
+
+			time->time += end > start ? end - start : 0;
+			time->bytes += prof.bytes;
+			++time->runs;
+		}
+
+		profEvents.clear();
+		THROW_IF_OCL(clError, "IOCLLabeling::CollectEvents");
+
+		for (auto &time : times)
+			profile_.Add(("dev:" + time.name).c_str(), static_cast<TTime>(time.time / 1000), time.bytes, time.runs);
 	}
 
 	///////////////////////////////////////////////////////////////////////////////
 
-	TTime IOCLLabeling::Label(const TImage& pixels, TImage& labels, char threads, TCoherence coh)
+	void IOCLLabeling::CompactDeviceLabels(TOCLBuffer<TLabel>& labels, cl_uint *count)
 	{
-		THROW_IF(!Initialized, "IOCLLabeling::Label : OpenCL device is not initialized");
-		THROW_IF(pixels.empty(), "IOCLLabeling::Label : Input image is empty");
+		if (!Compaction())
+			return;
 
-		auto binImg = cv::Mat(cv::Size((pixels.cols >> 5 << 5) + 32, (pixels.rows >> 5 << 5) + 32), CV_8UC1);
-		RGB2Gray(pixels).copyTo(binImg(cv::Rect(0, 0, pixels.cols, pixels.rows)));
-		
-		labels = cv::Mat::zeros(binImg.rows, binImg.cols, CV_32SC1);
+		// Flags of every possible label, label count goes after them
+		if (!compactFlags)
+			compactFlags.reset(new TOCLDeviceBuffer(*this));
+		compactFlags->Reserve((labels.Size() + 1) * sizeof(cl_uint));
 
-		// Initialization
-		TOCLBuffer<TPixel> oclPixels(*this, TOCLBufferType::READ_ONLY, binImg.total());
-		TOCLBuffer<TLabel> oclLabels(*this, TOCLBufferType::READ_WRITE, labels.total());
+		const cl_mem &flags = compactFlags->buffer;
+		size_t items = labels.Size();
 
-		memset(&oclLabels.Buffer()[0], 0, sizeof(oclLabels.Buffer()[0]) * oclLabels.Buffer().size());
-		oclLabels.Push();
-		
-		memcpy(oclPixels.Buffer().data(), binImg.data, sizeof(TPixel) * binImg.total());
-		oclPixels.Push();
-		
-		watch_.reset();
-		watch_.start();
+		// Marking used labels
+		cl_int clError = clSetKernelArg(clearKernel, 0, sizeof(cl_mem), (void*)&flags);
+		clError |= clEnqueueNDRangeKernel(State.queue, clearKernel, 1, NULL, &items, NULL, 0, NULL, KernelEvent(clearKernel));
+		THROW_IF_OCL(clError, "IOCLLabeling::CompactDeviceLabels");
 
-		// Actual Code
-		DoOCLLabel(oclPixels, oclLabels, labels.cols, labels.rows, coh);
+		clError = clSetKernelArg(compactMarkKernel, 0, sizeof(cl_mem), (void*)&labels.buffer);
+		clError |= clSetKernelArg(compactMarkKernel, 1, sizeof(cl_mem), (void*)&flags);
+		clError |= clEnqueueNDRangeKernel(State.queue, compactMarkKernel, 1, NULL, &items, NULL, 0, NULL, KernelEvent(compactMarkKernel));
+		THROW_IF_OCL(clError, "IOCLLabeling::CompactDeviceLabels");
 
-		// Post Conditions
-		watch_.stop();
+		if (count)
+			ScanDevice(flags, cl_uint(labels.Size()), count);
+		else
+			labelCount_ = ScanDevice(flags, cl_uint(labels.Size()));
 
-		oclLabels.Pull();
-		memcpy(labels.data, oclLabels.Buffer().data(), sizeof(TLabel) * labels.total());
-		labels = labels(cv::Rect(0, 0, pixels.cols, pixels.rows));
-		
-		return watch_.getTime() * 1000;
+		// Labels become prefix sums of their flags plus one
+		clError = clSetKernelArg(compactGatherKernel, 0, sizeof(cl_mem), (void*)&labels.buffer);
+		clError |= clSetKernelArg(compactGatherKernel, 1, sizeof(cl_mem), (void*)&flags);
+		clError |= clEnqueueNDRangeKernel(State.queue, compactGatherKernel, 1, NULL, &items, NULL, 0, NULL, KernelEvent(compactGatherKernel));
+		THROW_IF_OCL(clError, "IOCLLabeling::CompactDeviceLabels");
 	}
 
 	///////////////////////////////////////////////////////////////////////////////
 
-	void IOCLLabeling::TerminateOCL(void)
+	cl_uint IOCLLabeling::ScanDevice(const cl_mem& data, cl_uint count, cl_uint *asyncTotal)
+	{
+		const cl_uint BLOCK = 256; // Elements summed or scanned by single work item
+
+		// Data itself, then sums of its blocks till single block is left
+		vector<cl_uint> counts(1, count);
+		while (counts.back() > BLOCK)
+			counts.push_back((counts.back() + BLOCK - 1) / BLOCK);
+
+		while (scanLevels.size() + 1 < counts.size())
+			scanLevels.emplace_back(new TOCLDeviceBuffer(*this));
+
+		for (size_t i = 1; i < counts.size(); ++i)
+			scanLevels[i - 1]->Reserve((counts[i] + 1) * sizeof(cl_uint)); // Top level gets total sum after its values
+
+		auto level = [&](size_t i) -> const cl_mem& { return i ? scanLevels[i - 1]->buffer : data; };
+
+		auto enqueue = [&](cl_kernel kernel, size_t items)
+		{
+			cl_int clError = clEnqueueNDRangeKernel(State.queue, kernel, 1, NULL, &items, NULL, 0, NULL, KernelEvent(kernel));
+			THROW_IF_OCL(clError, "IOCLLabeling::ScanDevice");
+		};
+
+		// Exclusive prefix sum: block sums go up, block offsets come down
+		cl_int clError;
+		for (size_t i = 0; i + 1 < counts.size(); ++i)
+		{
+			clError = clSetKernelArg(compactSumKernel, 0, sizeof(cl_mem), (void*)&level(i));
+			clError |= clSetKernelArg(compactSumKernel, 1, sizeof(cl_mem), (void*)&level(i + 1));
+			clError |= clSetKernelArg(compactSumKernel, 2, sizeof(cl_uint), (void*)&counts[i]);
+			clError |= clSetKernelArg(compactSumKernel, 3, sizeof(cl_uint), (void*)&BLOCK);
+			THROW_IF_OCL(clError, "IOCLLabeling::ScanDevice");
+			enqueue(compactSumKernel, counts[i + 1]);
+		}
+
+		const size_t top = counts.size() - 1;
+
+		clError = clSetKernelArg(compactScanTopKernel, 0, sizeof(cl_mem), (void*)&level(top));
+		clError |= clSetKernelArg(compactScanTopKernel, 1, sizeof(cl_uint), (void*)&counts.back());
+		THROW_IF_OCL(clError, "IOCLLabeling::ScanDevice");
+		enqueue(compactScanTopKernel, 1);
+
+		for (size_t i = top; i-- > 0; )
+		{
+			clError = clSetKernelArg(compactScanKernel, 0, sizeof(cl_mem), (void*)&level(i));
+			clError |= clSetKernelArg(compactScanKernel, 1, sizeof(cl_mem), (void*)&level(i + 1));
+			clError |= clSetKernelArg(compactScanKernel, 2, sizeof(cl_uint), (void*)&counts[i]);
+			clError |= clSetKernelArg(compactScanKernel, 3, sizeof(cl_uint), (void*)&BLOCK);
+			THROW_IF_OCL(clError, "IOCLLabeling::ScanDevice");
+			enqueue(compactScanKernel, counts[i + 1]);
+		}
+
+		cl_uint total = 0;
+		clError = clEnqueueReadBuffer(State.queue, level(top), asyncTotal ? CL_FALSE : CL_TRUE, counts.back() * sizeof(cl_uint), 
+									  sizeof(cl_uint), asyncTotal ? asyncTotal : &total, 0, NULL, ProfileEvent("ScanTotal", sizeof(cl_uint)));
+		THROW_IF_OCL(clError, "IOCLLabeling::ScanDevice");
+
+		return total;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	void IOCLLabeling::FreeBuffers(void)
 	{
-		int err = CL_SUCCESS;
+		pixBuf.reset();
+		lbBuf.reset();
+		noChanges.reset();
+		compactFlags.reset();
+		scanLevels.clear();
+		runsBuf.reset();
+		maskRunsBuf.reset();
+		maskOffsetsBuf.reset();
+		packedBuf.reset();
+	}
 
+	///////////////////////////////////////////////////////////////////////////////
+
+	void IOCLLabeling::TerminateOCL(void)
+	{
 		if (isInitialized)
 		{
 			FreeKernels();
-			err = TerminateOpenCL(&OCLState);
-		}
+			FreeBuffers();
+
+			for (cl_kernel *kernel : { &clearKernel, &unpackKernel, &compactMarkKernel, &compactSumKernel, &compactScanTopKernel, 
+									   &compactScanKernel, &compactGatherKernel })
+			{
+				if (*kernel)
+					clReleaseKernel(*kernel);
+				*kernel = NULL;
+			}
+
+			if (transferQueue)
+				clReleaseCommandQueue(transferQueue);
+			transferQueue = NULL;
+
+			for (auto &prof : profEvents)
+				if (prof.event)
+					clReleaseEvent(prof.event);
+			profEvents.clear();
 
-		THROW_IF_OCL(err, "IOCLLabeling::TerminateOCL");
+			// Device is closed when its last user goes away
+			session.reset();
+			memset(&OCLState, 0, sizeof(OCLState));
+			isInitialized = false;
+		}
 	}
 
 	///////////////////////////////////////////////////////////////////////////////
@@ -193,31 +1935,98 @@ namespace LabelingTools
 		};
 		
 		TImage binImg = CopyAlignImg<uchar, CV_8U>(pixels, padding, log2i(imAlign));
-		labels = cv::Mat::zeros(3, binImg.size, CV_32SC1);
 
 		// Initialization
-		TOCLBuffer<TPixel> oclPixels(*this, TOCLBufferType::READ_ONLY, binImg.total());
-		TOCLBuffer<TLabel> oclLabels(*this, TOCLBufferType::READ_WRITE, labels.total());
-
-		memset(&oclLabels.Buffer()[0], 0, sizeof(oclLabels.Buffer()[0]) * oclLabels.Buffer().size());
-		oclLabels.Push();
+		StopWatchWin endToEnd;
+		endToEnd.start();
 
-		memcpy(oclPixels.Buffer().data(), binImg.data, sizeof(TPixel) * binImg.total());
-		oclPixels.Push();
+		ResetProfile();
+		profile_.Run("Upload", binImg.total() * sizeof(TPixel), [&] { UploadImage(binImg); });
+		labelCount_ = 0;
 
 		watch_.reset();
 		watch_.start();
 
 		// Actual Code
-		DoOCLLabel3D(oclPixels, oclLabels, labels.size[0], labels.size[1], labels.size[2]);
+		DoOCLLabel3D(PixelsBuffer(), LabelsBuffer(), binImg.size[0], binImg.size[1], binImg.size[2]);
+		CompactDeviceLabels(LabelsBuffer());
+		clFinish(State.queue); // Last kernels may still be queued
 
 		// Post Conditions
 		watch_.stop();
+		profile_.Add("Label", watch_.getTime() * 1000);
+
+		profile_.Run("Download", binImg.total() * sizeof(TLabel), [&] { DownloadLabels(binImg).copyTo(labels); });
+
+		endToEnd.stop();
+		profile_.endToEnd = endToEnd.getTime() * 1000;
+		CollectEvents();
+
+		return profile_.total = watch_.getTime() * 1000;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
 
-		oclLabels.Pull();
-		memcpy(labels.data, oclLabels.Buffer().data(), sizeof(TLabel) * labels.total());
+	TTime IOCLLabeling3D::LabelBinary(const TImage& binImg, TImage& labels, char threads, TCoherence coh)
+	{
+		return Label(binImg, labels, threads, coh);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	TTime IOCLLabeling3D::LabelPacked(const TBitImage& bits, TImage& labels, char threads, TCoherence coh)
+	{
+		throw(std::exception("IOCLLabeling3D::LabelPacked : Input image is not a 3D image"));
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// TOCLDeviceBuffer declaration
+	///////////////////////////////////////////////////////////////////////////////
+
+	TOCLDeviceBuffer::TOCLDeviceBuffer(const IOCLLabeling &ownerClass, cl_mem_flags flags)
+		: owner(ownerClass),
+		  memFlags(flags),
+		  deviceBuf(NULL),
+		  capacity(0),
+		  buffer(deviceBuf)
+	{
+		/* Empty */
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	TOCLDeviceBuffer::~TOCLDeviceBuffer(void)
+	{
+		Release();
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	void TOCLDeviceBuffer::Reserve(size_t bytes)
+	{
+		THROW_IF(!owner.Initialized, "TOCLDeviceBuffer::Reserve : Buffer owner is not initialized");
+
+		if (deviceBuf && bytes <= capacity)
+			return;
+
+		Release();
+
+		cl_int clError;
+		deviceBuf = clCreateBuffer(owner.State.context, memFlags, bytes, NULL, &clError);
+		THROW_IF_OCL(clError, "TOCLDeviceBuffer::Reserve");
+
+		capacity = bytes;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	void TOCLDeviceBuffer::Release(void)
+	{
+		if (deviceBuf)
+			clReleaseMemObject(deviceBuf);
 
-		return watch_.getTime() * 1000;
+		deviceBuf = NULL;
+		capacity = 0;
 	}
 
 	///////////////////////////////////////////////////////////////////////////////
@@ -7,9 +7,18 @@
 #define LABELING_TOOLS_HPP_
 
 #include <vector>
+#include <string>
 #include <omp.h>
 #include <opencv2/core/core.hpp>
 #include <memory>
+#include <functional>
+#include <type_traits>
+#include <deque>
+#include <unordered_map>
+
+#ifdef _MSC_VER
+#	include <intrin.h>
+#endif
 
 #include "stopwatch_win.h"
 
@@ -51,6 +60,229 @@ namespace LabelingTools
 
 	const char MAX_THREADS = 0;
 
+	///////////////////////////////////////////////////////////////////////////////
+	// TWorkspace definition (scratch memory kept between labeling calls)
+	///////////////////////////////////////////////////////////////////////////////
+
+	class TWorkspace
+	{
+	public:
+		// Returns slot buffer with room for at least count elements, contents are undefined.
+		// Buffer grows to the largest size requested and is kept till Shrink or Reset
+		template <typename T> T* Get(size_t slot, size_t count);
+
+		void Shrink(void);			// Frees memory above the last requested size of every slot
+		void Reset(void);			// Frees all memory
+		size_t Size(void) const;	// Returns allocated memory size in bytes
+
+	private:
+		struct TSlot
+		{
+			std::unique_ptr<char[]> data;
+			size_t size = 0;	// Allocated bytes
+			size_t used = 0;	// Bytes requested last time
+		};
+
+		vector<TSlot> slots_;
+
+		char* GetBytes(size_t slot, size_t bytes);
+	};
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	template <typename T>
+	T* TWorkspace::Get(size_t slot, size_t count)
+	{
+		static_assert(std::is_trivially_destructible<T>::value, "TWorkspace::Get : Only plain types can be stored in workspace");
+
+		return reinterpret_cast<T*>(GetBytes(slot, count * sizeof(T)));
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// TProfile definition (per phase timings of labeling call)
+	///////////////////////////////////////////////////////////////////////////////
+
+	struct TPhase
+	{
+		std::string name;
+		TTime time;		// Sum of phase run times (us)
+		uint runs;		// Number of phase runs
+		size_t bytes;	// Sum of memory touched by phase runs (estimated from buffer sizes)
+	};
+
+	class TProfile
+	{
+	public:
+		vector<TPhase> phases;	// Phases in order of their first run
+		uint iterations = 0;	// Scan/analyze rounds of iterative algorithms
+		TTime total = 0;		// Labeling time (us) returned by Label, host-device transfers are out of it
+		TTime endToEnd = 0;		// Time (us) from upload start till labels are on host, OpenCL algorithms only
+
+		void Reset(void);
+		void Add(const char *name, TTime time, size_t bytes = 0, uint runs = 1);
+
+		// Runs phase and adds its time to profile, returns phase result
+		template <typename F> auto Run(const char *name, size_t bytes, F phase) -> decltype(phase());
+	};
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	template <typename F>
+	auto TProfile::Run(const char *name, size_t bytes, F phase) -> decltype(phase())
+	{
+		struct TTimer 
+		{
+			TProfile &profile;
+			const char *name;
+			size_t bytes;
+			StopWatchWin watch;
+
+			TTimer(TProfile &p, const char *n, size_t b) : profile(p), name(n), bytes(b) { watch.start(); }
+			~TTimer(void) { watch.stop(); profile.Add(name, watch.getTime() * 1000, bytes); }
+		} timer(*this, name, bytes);
+
+		return phase();
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// TComponentStats definition (area, bounding box and centroid of labeled component)
+	///////////////////////////////////////////////////////////////////////////////
+
+	struct TComponentStats
+	{
+		TLabel label;			// Component label in labels image
+		uint area;				// Number of pixels
+		cv::Rect bbox;			// Bounding box
+		cv::Point2d centroid;	// Mean pixel position
+	};
+
+	typedef vector<TComponentStats> TStats; // Sorted by label
+
+	///////////////////////////////////////////////////////////////////////////////
+	// TLabelRun definition (run length encoded labels)
+	///////////////////////////////////////////////////////////////////////////////
+
+	struct TLabelRun
+	{
+		uint row;		// Run row
+		uint l, r;		// First and last pixel of run
+		TLabel label;	// Run label
+	};
+
+	typedef vector<TLabelRun> TLabelRuns; // Runs in row order, left to right inside a row
+
+	// Run-length encoded binary mask, runs of a row must neither overlap nor touch
+	struct TRunMask
+	{
+		int rows, cols;		// Mask size
+		TLabelRuns runs;	// Foreground runs in row order, their labels are ignored
+	};
+
+	///////////////////////////////////////////////////////////////////////////////
+	// TBitImage definition (bit packed binary image, 64 pixels per word)
+	///////////////////////////////////////////////////////////////////////////////
+
+	class TBitImage
+	{
+	public:
+		int rows = 0, cols = 0;
+
+		TBitImage(void) {}
+		explicit TBitImage(const TImage& binImg) { Pack(binImg); }
+
+		// Makes zero image of given size
+		void Create(int rows, int cols);
+
+		// Packs CV_8UC1 binary image, non-zero pixels are objects
+		void Pack(const TImage& binImg);
+
+		// Unpacks into CV_8UC1 binary image (0 for background and 255 for objects)
+		void Unpack(TImage& binImg) const;
+
+		bool Empty(void) const { return rows == 0 || cols == 0; }
+		int Stride(void) const { return stride_; } // Words per row
+		size_t Bytes(void) const { return words_.size() * sizeof(uint64); }
+
+		// Pixel x of a row is bit x % 64 of row word x / 64, bits past image width must stay zero
+		uint64* Row(int y) { return words_.data() + size_t(y) * stride_; }
+		const uint64* Row(int y) const { return words_.data() + size_t(y) * stride_; }
+		bool At(int y, int x) const { return (Row(y)[x >> 6] >> (x & 63)) & 1; }
+
+	private:
+		int stride_ = 0;
+		vector<uint64> words_;
+	};
+
+	// Returns index of the lowest set bit of non-zero word
+	inline uint CountTrailingZeros(uint64 word)
+	{
+#	ifdef _MSC_VER
+		unsigned long index;
+		_BitScanForward64(&index, word);
+		return index;
+#	else
+		return __builtin_ctzll(word);
+#	endif
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// TStatsAccumulator definition (component moments gathered by final labeling pass)
+	///////////////////////////////////////////////////////////////////////////////
+
+	class TStatsAccumulator
+	{
+	public:
+		// Clears moments and makes a table per thread, threads are told apart by omp_get_thread_num
+		void Begin(int threads);
+
+		// Reduces thread tables into stats and stops accumulation
+		void End(TStats& stats);
+
+		bool Active(void) const { return active_; }			// Stats are wanted by current call
+		bool Collected(void) const { return collected_; }	// Moments were added by labeling pass
+		void SetCollected(void) { collected_ = true; }
+
+		// Adds pixels [left, right] of row, called by threads of any OpenMP team within Begin thread count
+		void AddRun(TLabel label, int row, int left, int right);
+
+		// Adds labels row, equal neighbours are added as single run and zeros are skipped
+		void AddRow(const TLabel *labels, int row, int width);
+
+	private:
+		struct TMoments
+		{
+			uint64 area, sumX, sumY;
+			int left, top, right, bottom;
+		};
+
+		typedef std::unordered_map<TLabel, TMoments> TTable;
+
+		vector<TTable> tables_;
+		bool active_ = false;
+		bool collected_ = false;
+	};
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	inline void TStatsAccumulator::AddRun(TLabel label, int row, int left, int right)
+	{
+		const uint64 count = right - left + 1;
+		auto res = tables_[omp_get_thread_num()].emplace(label, TMoments{ 0, 0, 0, left, row, right, row });
+		TMoments &m = res.first->second;
+
+		m.area += count;
+		m.sumX += count * (left + right) / 2;
+		m.sumY += count * row;
+
+		if (res.second)
+			return;
+
+		m.left = min(m.left, left);
+		m.right = max(m.right, right);
+		m.top = min(m.top, row);
+		m.bottom = max(m.bottom, row);
+	}
+
 	///////////////////////////////////////////////////////////////////////////////
 	// ILabeling definition (basic labeling algorithm class)
 	///////////////////////////////////////////////////////////////////////////////
@@ -63,13 +295,107 @@ namespace LabelingTools
 		// Call to start labeling
 		virtual TTime Label(const TImage& pixels, TImage& labels, char threads = MAX_THREADS, TCoherence coh = TCoherence::COH_DEFAULT);
 
+		// Call to start labeling of already binarized image (CV_8UC1, 0 for background and 255 for objects),
+		// image goes to the algorithm as is with no thresholding
+		virtual TTime LabelBinary(const TImage& binImg, TImage& labels, char threads = MAX_THREADS, TCoherence coh = TCoherence::COH_DEFAULT);
+
 		static TImage RGB2Gray(const TImage& img);
+		static void RGB2Gray(const TImage& img, TImage& binImg); // Writes into binImg if it has proper size
+
+		// Scratch buffers grow to the largest image seen and are reused between calls
+		virtual void ShrinkWorkspace(void);	// Frees memory not used by the last call
+		virtual void ResetWorkspace(void);	// Frees all scratch memory
+
+		// Phase timings, iterations and memory traffic of the last labeling call
+		const TProfile& Profile(void) const { return profile_; }
+
+		// Labels 2D image (binary one if binary is set) and gets stats of every label. Algorithms gather them
+		// in the pass writing final labels, others get extra "Stats" pass over labels, which is in returned time
+		TTime LabelWithStats(const TImage& pixels, TImage& labels, TStats& stats, char threads = MAX_THREADS, 
+							 TCoherence coh = TCoherence::COH_DEFAULT, bool binary = false);
+
+		// Makes labeling calls renumber labels to 1..N keeping their order (off by default), it's part of 
+		// labeling time and "Compact" phase. OpenCL algorithms do it on device before labels are downloaded
+		void SetCompaction(bool enable) { compact_ = enable; }
+		bool Compaction(void) const { return compact_; }
+
+		// Number of labels of the last call with compaction, algorithms numbering labels on their own may set it anyway
+		uint LabelCount(void) const { return labelCount_; }
+
+		// Renumbers labels (continuous CV_32SC1 image of any dims) to 1..N keeping their order, returns N
+		uint CompactLabels(TImage& labels, char threads = MAX_THREADS);
+		uint CompactLabels(TLabelRuns& runs, char threads = MAX_THREADS);
+
+		// Labels 2D image (binary one if binary is set) into runs of equal labels, no labels image is made. Run based 
+		// algorithms write runs right from their run tables, others label image and convert it in "Runs" phase
+		virtual TTime LabelRuns(const TImage& pixels, TLabelRuns& runs, char threads = MAX_THREADS, 
+								TCoherence coh = TCoherence::COH_DEFAULT, bool binary = false);
+
+		// Labels run-length encoded mask, labeled runs come in mask order. Run based algorithms fill their run
+		// tables right from the mask, others label decoded mask in "Decode" phase
+		virtual TTime LabelRuns(const TRunMask& mask, TLabelRuns& runs, char threads = MAX_THREADS, 
+								TCoherence coh = TCoherence::COH_DEFAULT);
+
+		// Labels bit packed binary image. Algorithms reading packed rows (PackedInput) label it right away,
+		// others label unpacked image and add "Unpack" phase
+		virtual TTime LabelPacked(const TBitImage& bits, TImage& labels, char threads = MAX_THREADS, 
+								  TCoherence coh = TCoherence::COH_DEFAULT);
+
+		// Converts 2D labels image into runs of equal labels
+		static void LabelsToRuns(const TImage& labels, TLabelRuns& runs);
+
+		// Decodes run-length encoded mask into binary image
+		static void RunsToImage(const TRunMask& mask, TImage& binImg);
+
+		// Encodes CV_8UC1 binary image (non-zero pixels are objects) into run-length mask
+		static void ImageToRuns(const TImage& binImg, TRunMask& mask);
 
 	protected:
 		StopWatchWin watch_;
+		TWorkspace workspace_;
+		TProfile profile_;	// Filled by algorithms, reset before every call
+		TStatsAccumulator stats_; // Active during LabelWithStats, final passes add labels into it and set it collected
+		uint labelCount_ = 0;	// Algorithms giving consecutive labels set it to skip compaction
+		TImage runsLabels_;		// Labels converted into runs by LabelRuns
+		TImage runsMask_;		// Mask decoded by LabelRuns
+		const TBitImage *packed_ = nullptr; // Set by LabelPacked for PackedInput algorithms, DoLabel gets empty pixels then
+
+		enum { WS_BIN_IMAGE, WS_COMPACT, WS_COMPACT_SUMS, WS_ALG }; // Workspace slots, algorithms use WS_ALG and following ones
 
 		virtual void DoLabel(const TImage& pixels, TImage& labels, char threads, TCoherence coh) = 0; // Labeling itself
 		void SetupThreads(char threadNum); // Threads setup
+
+		// Compacts labels of current call if compaction is on and labelCount_ isn't set by algorithm
+		void CompactIfNeeded(TImage& labels, char threads);
+
+		// Returns continuous CV_8UC1 binary image, thresholded one or binImg itself (copied if it's a ROI)
+		TImage BinaryInput(const TImage& pixels, bool binary);
+
+		// Checks mask runs, returns index of the first run of every row and run count as the last element
+		static vector<uint> MaskRowOffsets(const TRunMask& mask);
+
+		// Algorithm's DoLabel reads packed_ when it's set
+		virtual bool PackedInput(void) const { return false; }
+
+	private:
+		bool compact_ = false;
+		const TLabel *compactMap_ = nullptr;	// Old to new labels map of the last compaction (in workspace)
+
+		template <typename F> uint CompactLabels(size_t count, F label, char threads); // label(i) returns i-th label reference
+	};
+
+	///////////////////////////////////////////////////////////////////////////////
+	// ILabeling3D definition (basic 3D labeling algorithm class)
+	///////////////////////////////////////////////////////////////////////////////
+
+	class ILabeling3D : public ILabeling
+	{
+	public:
+		// Call to start labeling, pixels are expected to be a binary 3D image
+		virtual TTime Label(const TImage& pixels, TImage& labels, char threads = MAX_THREADS, TCoherence coh = TCoherence::COH_DEFAULT) override;
+
+		// Same as Label since 3D images are never thresholded
+		virtual TTime LabelBinary(const TImage& binImg, TImage& labels, char threads = MAX_THREADS, TCoherence coh = TCoherence::COH_DEFAULT) override;
 	};
 
 	///////////////////////////////////////////////////////////////////////////////
@@ -78,6 +404,7 @@ namespace LabelingTools
 
 	// Forward declaration
 	template <typename T> class TOCLBuffer;
+	class TOCLDeviceBuffer;
 
 	// OCL Labeling error
 	typedef enum TOCLLabelingError
@@ -95,6 +422,31 @@ namespace LabelingTools
 		OCL_MAX_ERROR
 	};
 
+	///////////////////////////////////////////////////////////////////////////////
+	// TOCLSession definition (OpenCL context, queue and program shared between algorithms)
+	///////////////////////////////////////////////////////////////////////////////
+
+	class TOCLSession final
+	{
+	public:
+		const clState &State;	// OpenCL state structure
+
+		// Returns session for specified device and program source. Program is built only if no
+		// session with the same params is alive, otherwise existing session is shared
+		static std::shared_ptr<TOCLSession> Get(cl_device_type deviceType, const std::string& buildParams, 
+												const std::string& srcFileName, const std::string& binaryCacheDir,
+												cl_command_queue_properties queueProps = 0);
+
+		~TOCLSession(void);
+
+	private:
+		clState state;
+
+		TOCLSession(void);
+		TOCLSession(const TOCLSession&) = delete;
+		TOCLSession& operator= (const TOCLSession&) = delete;
+	};
+
 	///////////////////////////////////////////////////////////////////////////////
 
 	class IOCLLabeling : public ILabeling
@@ -103,11 +455,55 @@ namespace LabelingTools
 		const bool &Initialized;	// Shows if device is initialized
 		const clState &State;		// OpenCL state structure
 
-		// Opens device with specified algorithm source
+		// Opens device with specified algorithm source, device and program are shared 
+		// between all instances opened with the same params, kernels are per instance
 		void Init(cl_device_type deviceType, const std::string& buildParams, const std::string& srcFileName);
 
+		// Sets directory where built programs are cached (empty string by default, which disables cache)
+		static void SetBinaryCacheDir(const std::string& dir);
+
+		// Enables event profiling for devices opened afterwards (off by default). Queues get CL_QUEUE_PROFILING_ENABLE
+		// and profile gets device time of every kernel ("dev:" + kernel name) and of host-device transfers
+		static void SetEventProfiling(bool enable);
+
+		// Sets number of iterations per convergence check in iterative algorithms (1 by default).
+		// With more than 1 iteration checks are asynchronous and some extra iterations may run
+		void SetSyncInterval(uint iterations);
+		uint SyncInterval(void) const { return syncInterval; }
+
 		// Call to start labeling
 		virtual TTime Label(const TImage& pixels, TImage& labels, char threads = MAX_THREADS, TCoherence coh = TCoherence::COH_DEFAULT) override;
+
+		// Call to start labeling of already binarized image (CV_8UC1, 0 for background and 255 for objects)
+		virtual TTime LabelBinary(const TImage& binImg, TImage& labels, char threads = MAX_THREADS, TCoherence coh = TCoherence::COH_DEFAULT) override;
+
+		// Run based algorithms find runs on device and download them instead of labels, compaction runs on host then
+		virtual TTime LabelRuns(const TImage& pixels, TLabelRuns& runs, char threads = MAX_THREADS, 
+								TCoherence coh = TCoherence::COH_DEFAULT, bool binary = false) override;
+
+		// Packed words are uploaded and unpacked into aligned image on device
+		virtual TTime LabelPacked(const TBitImage& bits, TImage& labels, char threads = MAX_THREADS, 
+								  TCoherence coh = TCoherence::COH_DEFAULT) override;
+
+		// Mask runs and their row offsets are uploaded instead of pixels
+		virtual TTime LabelRuns(const TRunMask& mask, TLabelRuns& runs, char threads = MAX_THREADS, 
+								TCoherence coh = TCoherence::COH_DEFAULT) override;
+
+		// On devices sharing memory with host (CPU devices) image is binarized right into mapped pixels buffer
+		// and labels are copied out of mapped labels buffer, so nothing is transferred
+		bool HostMemory(void) const { return hostMemory; }
+
+		// Batch frame source, returns false when there are no more frames
+		typedef std::function<bool(TImage& frame)> TFrameSource;
+
+		// Batch labels sink, gets labels and labeling time of every frame in source order.
+		// Labels header is valid only during the call
+		typedef std::function<void(const TImage& labels, TTime time)> TLabelsSink;
+
+		// Labels frames from source till it ends. Upload of the next frame and download of the previous one
+		// run on separate queue while current frame is labeled. Returns number of labeled frames
+		size_t LabelBatch(const TFrameSource& source, const TLabelsSink& sink, bool binaryInput = false, 
+						  TCoherence coh = TCoherence::COH_DEFAULT);
 		
 		// Destructor
 		~IOCLLabeling(void);
@@ -120,10 +516,58 @@ namespace LabelingTools
 
 		virtual void TerminateOCL(void);
 
+		// Uploads binarized image into device buffers (kept between calls) and clears labels
+		void UploadImage(const TImage& binImg);
+
+		// Downloads labels from device, returns header over downloaded labels shaped as binImg.
+		// Header is valid till the next UploadImage call
+		TImage DownloadLabels(const TImage& binImg);
+		TImage DownloadLabels(const cv::Size& size); // 2D labels of aligned size
+
+		// Device buffers filled by UploadImage
+		TOCLBuffer<TPixel>& PixelsBuffer(void) { return *pixBuf; }
+		TOCLBuffer<TLabel>& LabelsBuffer(void) { return *lbBuf; }
+
+		// One byte flag for iterative algorithms, kept between calls
+		TOCLBuffer<char>& NoChanges(void);
+
+		// Enqueues scan and analyze till scan leaves NoChanges() flag set (scan must clear it on any change).
+		// Both must be no-ops on converged labels, since iterations after convergence may be enqueued
+		void RunTillConverged(const std::function<void(void)>& scan, const std::function<void(void)>& analyze);
+
+		// Events to pass into clEnqueue* calls, NULL if event profiling is off
+		cl_event* ProfileEvent(const std::string& name, size_t bytes = 0) const;
+		cl_event* KernelEvent(cl_kernel kernel) const; // Named after kernel function
+
+		// Resets profile and releases events left uncollected by a failed call
+		void ResetProfile(void);
+
+		// Waits for profiled events and adds their device times to profile
+		void CollectEvents(void);
+
+		// Renumbers labels to 1..N on device if compaction is on, N is read back into labelCount_, or into
+		// count without blocking if it's given. Labels must be below labels buffer size
+		void CompactDeviceLabels(TOCLBuffer<TLabel>& labels, cl_uint *count = NULL);
+
+		// Exclusive prefix sum of count values in place (data must hold count + 1 values), returns total read back from data[count].
+		// If asyncTotal is given, total is read into it without blocking (0 is returned), it's valid once the queue gets past the read
+		cl_uint ScanDevice(const cl_mem& data, cl_uint count, cl_uint *asyncTotal = NULL);
+
 		// Write your OCL labeling code here
 		virtual void DoOCLLabel(TOCLBuffer<TPixel> &pixels, TOCLBuffer<TLabel> &labels, unsigned int imgWidth, 
 								unsigned int imgHeight, TCoherence Coherence) = 0;
 
+		// Write your OCL run output code here, runs go to runs buffer as TLabelRun array in row order.
+		// Returns number of runs, algorithms having no runs output leave HasRunsOutput false
+		virtual bool HasRunsOutput(void) const { return false; }
+		virtual cl_uint DoOCLLabelRuns(TOCLBuffer<TPixel> &pixels, TOCLDeviceBuffer &runs, uint imgWidth, uint imgHeight, 
+									   TCoherence coh) { return 0; }
+
+		// Same for run-length encoded mask: maskRuns holds TLabelRun array, rowOffsets holds first run 
+		// of every row and run count. Runs must come out in mask order
+		virtual void DoOCLLabelRuns(TOCLDeviceBuffer &maskRuns, TOCLDeviceBuffer &rowOffsets, TOCLDeviceBuffer &runs, 
+									uint maskWidth, uint maskHeight, TCoherence coh) {}
+
 		// Write your kernel initialization code here
 		virtual void InitKernels(void) = 0;
 
@@ -131,6 +575,56 @@ namespace LabelingTools
 		virtual void FreeKernels(void) {}; // Used in destructor, that's why non-pure virtual
 
 	private:
+		template <typename T> friend class TOCLBuffer; // Profiles transfers
+
+		struct TProfiledEvent
+		{
+			std::string name;
+			size_t bytes;
+			cl_event event;
+		};
+
+		static std::string binaryCacheDir;
+		static bool eventProfiling;
+
+		std::shared_ptr<TOCLSession> session;	// Keeps OCLState handles alive
+
+		std::unique_ptr<TOCLBuffer<TPixel>> pixBuf;
+		std::unique_ptr<TOCLBuffer<TLabel>> lbBuf;
+		std::unique_ptr<TOCLBuffer<char>> noChanges;
+
+		cl_kernel clearKernel;	// Clears labels on device
+		cl_kernel unpackKernel;	// Unpacks bit packed images
+		cl_kernel compactMarkKernel, compactSumKernel, compactScanTopKernel, compactScanKernel, compactGatherKernel;
+		std::unique_ptr<TOCLDeviceBuffer> compactFlags;		// Used label flags
+		vector<std::unique_ptr<TOCLDeviceBuffer>> scanLevels;	// Block sums of device prefix sums
+		std::unique_ptr<TOCLDeviceBuffer> runsBuf;			// Runs output
+		std::unique_ptr<TOCLDeviceBuffer> maskRunsBuf, maskOffsetsBuf; // Run-length encoded input
+		std::unique_ptr<TOCLDeviceBuffer> packedBuf;		// Bit packed input
+		cl_command_queue transferQueue; // Batch uploads and downloads
+		uint syncInterval;		// Iterations per convergence check
+		bool hostMemory;		// Device shares memory with host, so images are not copied
+		bool profiling;			// Queue was created with CL_QUEUE_PROFILING_ENABLE
+		mutable std::deque<TProfiledEvent> profEvents; // Deque keeps returned event pointers valid
+
+		void FreeBuffers(void);
+		void ReservePixels(size_t count);
+		void UploadPixels(const TImage& binImg); // Aligned image, mapped pixels buffer is only unmapped
+		void UploadPacked(const TBitImage& bits, const cv::Size& alignedSize); // Unpacks into pixels buffer and clears labels
+		void ReserveLabels(size_t count);
+		TLabel* DownloadLabelData(void);
+		void ClearLabels(TOCLBuffer<TLabel>& labels, cl_event waitEvent = NULL);
+
+		static cv::Size AlignedSize(const TImage& pixels);	// Image size expected by kernels
+		static cv::Size AlignedSize(int rows, int cols);
+
+		// Returns zero padded image, it's mapped device buffer if hostMemory is set and workspace otherwise
+		TImage AlignedBinImage(const TImage& pixels);	
+		TTime LabelAligned(const TImage& binImg, const TImage& pixels, TImage& labels, TCoherence coh);
+
+		// Reads count runs back and compacts them if needed, returns compaction time
+		TTime DownloadRuns(TLabelRuns& runs, cl_uint count, char threads);
+
 		IOCLLabeling(const IOCLLabeling&) = delete;
 		IOCLLabeling& operator= (const IOCLLabeling&) = delete;
 		virtual void DoLabel(const TImage& pixels, TImage& labels, char threads, TCoherence coh) {}; // Deprecated
@@ -153,6 +647,13 @@ namespace LabelingTools
 		// Call to start labeling
 		virtual TTime Label(const TImage& pixels, TImage& labels, char threads = MAX_THREADS, TCoherence coh = TCoherence::COH_DEFAULT) override;
 
+		// Same as Label since 3D images are never thresholded
+		virtual TTime LabelBinary(const TImage& binImg, TImage& labels, char threads = MAX_THREADS, TCoherence coh = TCoherence::COH_DEFAULT) override;
+
+		// Packed images are 2D only, so it always throws
+		virtual TTime LabelPacked(const TBitImage& bits, TImage& labels, char threads = MAX_THREADS, 
+								  TCoherence coh = TCoherence::COH_DEFAULT) override;
+
 		IOCLLabeling3D(void) : imAlign(32) { /* Empty */ };
 		~IOCLLabeling3D(void) = default;
 
@@ -189,6 +690,13 @@ namespace LabelingTools
 		MAX_BUFFER_TYPE
 	};
 
+	// Buffer memory
+	typedef enum TOCLBufferMemory
+	{
+		DEVICE_MEMORY,	// Device buffer with host copy, synced by Push and Pull
+		HOST_MEMORY		// Device buffer in host memory, accessed by Map with no copies on CPU devices
+	};
+
 	template <typename DataType> class TOCLBuffer final
 	{
 	public:		
@@ -197,18 +705,37 @@ namespace LabelingTools
 		cl_int clErrorContext;		// Stores last OpenCL error code (if OCL_ERROR has occured)
 
 		// Constructor
-		TOCLBuffer(const IOCLLabeling &ownerClass, TOCLBufferType bufType, size_t dataSize);
+		TOCLBuffer(const IOCLLabeling &ownerClass, TOCLBufferType bufType, size_t dataSize, 
+				   TOCLBufferMemory memType = TOCLBufferMemory::DEVICE_MEMORY);
 
 		// Destructor
 		~TOCLBuffer(void);
 
-		// Uploads buffer to device
+		// Uploads buffer to device (does nothing for HOST_MEMORY buffers)
 		void Push(void);
 
-		// Downloads buffer from device
+		// Downloads buffer from device (does nothing for HOST_MEMORY buffers)
 		void Pull(void);
 
-		// Returns buffer object
+		// Enqueues non-blocking upload into queue, host buffer must not change till event is complete
+		void PushAsync(cl_command_queue queue, cl_uint numWaitEvents, const cl_event *waitEvents, cl_event *event);
+
+		// Enqueues non-blocking download into queue, host buffer is valid only after event is complete
+		void PullAsync(cl_command_queue queue, cl_uint numWaitEvents, const cl_event *waitEvents, cl_event *event);
+
+		// Maps buffer into host memory (blocking), buffer must be unmapped before kernels use it
+		DataType* Map(cl_map_flags flags);
+
+		// Unmaps buffer if it's mapped
+		void Unmap(void);
+
+		// Resizes buffer, device memory is reallocated only if buffer grows above its capacity
+		void Resize(size_t dataSize);
+
+		// Returns number of elements
+		size_t Size(void) const { return size; }
+
+		// Returns buffer object (DEVICE_MEMORY buffers only)
 		vector<DataType>& Buffer(void);
 
 		// Direct buffer access (slow!)
@@ -220,9 +747,12 @@ namespace LabelingTools
 
 	private:
 		size_t size;				// Device buffer size
+		size_t capacity;			// Allocated device buffer size
 		bool wantUpdate;			// Shows if device buffer need to be updated
 		bool isInitialized;			// Shows if device buffer is initialized
 		cl_mem_flags memFlags;		// Device memory flags
+		TOCLBufferMemory memType;	// Buffer memory type
+		DataType *mapped;			// Mapped host pointer
 
 		cl_mem deviceBuf;			// Buffer device copy
 		vector<DataType> hostBuf;	// Host buffer (accessible directly)
@@ -240,13 +770,41 @@ namespace LabelingTools
 		void DeleteDeviceBuffer(void);
 
 		// Resizes device buffer
-		void ResizeDeviceBuffer(void);
+		void ResizeDeviceBuffer(size_t dataSize);
 
 		TOCLBuffer(void) = delete;
 		TOCLBuffer(const TOCLBuffer<DataType>&) = delete;
 		TOCLBuffer operator= (const TOCLBuffer<DataType>&) = delete;
 	};
 
+	///////////////////////////////////////////////////////////////////////////////
+	// TOCLDeviceBuffer definition (device only scratch buffer)
+	///////////////////////////////////////////////////////////////////////////////
+
+	class TOCLDeviceBuffer final
+	{
+	public:
+		const cl_mem &buffer;		// OpenCL buffer (pass it as kernel param)
+
+		TOCLDeviceBuffer(const IOCLLabeling &ownerClass, cl_mem_flags flags = CL_MEM_READ_WRITE);
+		~TOCLDeviceBuffer(void);
+
+		// Makes buffer at least bytes large, it's reallocated (and contents are lost) only if it grows
+		void Reserve(size_t bytes);
+
+		// Frees device memory
+		void Release(void);
+
+	private:
+		const IOCLLabeling &owner;
+		cl_mem_flags memFlags;
+		cl_mem deviceBuf;
+		size_t capacity;
+
+		TOCLDeviceBuffer(const TOCLDeviceBuffer&) = delete;
+		TOCLDeviceBuffer& operator= (const TOCLDeviceBuffer&) = delete;
+	};
+
 } /* LabelingTools*/
 
 #	include "TOCLBuffer_impl.hpp" // Template implementation
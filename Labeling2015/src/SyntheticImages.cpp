@@ -0,0 +1,176 @@
+//Synthetic Images declaration
+//Copyright (c) by Sergey Zavalishin 2010-2015
+//
+//See defenition in SyntheticImages.hpp
+
+#include "SyntheticImages.hpp"
+
+#include <random>
+#include <algorithm>
+
+///////////////////////////////////////////////////////////////////////////////
+
+namespace LabelingTools
+{
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Random images declaration
+	///////////////////////////////////////////////////////////////////////////////
+
+	// Raw mt19937 output is the same on every platform unlike std distributions, 
+	// so blocks are chosen by comparing it with a threshold
+	class TBlockRandom
+	{
+	public:
+		TBlockRandom(float density, uint seed)
+			: rng_(seed), threshold_(static_cast<uint64_t>(std::min(std::max(density, 0.0f), 1.0f) * 4294967296.0)) {}
+
+		TPixel operator()(void) { return rng_() < threshold_ ? 255 : 0; }
+
+	private:
+		std::mt19937 rng_;
+		const uint64_t threshold_;
+	};
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	TImage RandomImage(int rows, int cols, float density, int granularity, uint seed)
+	{
+		THROW_IF(rows < 1 || cols < 1 || granularity < 1, "RandomImage : Wrong image parameters");
+
+		TImage img(rows, cols, CV_8UC1);
+		TBlockRandom random(density, seed);
+
+		for (int i = 0; i < rows; i += granularity)
+			for (int j = 0; j < cols; j += granularity)
+			{
+				TPixel pix = random();
+
+				for (int bi = i; bi < std::min(i + granularity, rows); ++bi)
+					for (int bj = j; bj < std::min(j + granularity, cols); ++bj)
+						img.at<TPixel>(bi, bj) = pix;
+			}
+
+		return img;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	TImage RandomImage3D(int rows, int cols, int planes, float density, int granularity, uint seed)
+	{
+		THROW_IF(rows < 1 || cols < 1 || planes < 1 || granularity < 1, "RandomImage3D : Wrong image parameters");
+
+		int sz[] = { rows, cols, planes };
+		TImage img(3, sz, CV_8UC1);
+		TBlockRandom random(density, seed);
+
+		for (int i = 0; i < rows; i += granularity)
+			for (int j = 0; j < cols; j += granularity)
+				for (int k = 0; k < planes; k += granularity)
+				{
+					TPixel pix = random();
+
+					for (int bi = i; bi < std::min(i + granularity, rows); ++bi)
+						for (int bj = j; bj < std::min(j + granularity, cols); ++bj)
+							for (int bk = k; bk < std::min(k + granularity, planes); ++bk)
+								img.at<TPixel>(bi, bj, bk) = pix;
+				}
+
+		return img;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Worst case images declaration
+	///////////////////////////////////////////////////////////////////////////////
+
+	TImage SpiralImage(int rows, int cols)
+	{
+		THROW_IF(rows < 1 || cols < 1, "SpiralImage : Wrong image parameters");
+
+		TImage img = TImage::zeros(rows, cols, CV_8UC1);
+
+		// Every turn draws top, right, bottom and left sides and steps inside by two pixels,
+		// left side stops under the next turn's top side and is joined with it by one pixel
+		for (int top = 0, left = 0, bottom = rows - 1, right = cols - 1; top <= bottom && left <= right; 
+			top += 2, left += 2, bottom -= 2, right -= 2)
+		{
+			for (int j = left; j <= right; ++j) img.at<TPixel>(top, j) = 255;
+			for (int i = top; i <= bottom; ++i) img.at<TPixel>(i, right) = 255;
+
+			if (bottom - top < 2 || right - left < 2)
+				break;
+
+			for (int j = left; j <= right; ++j) img.at<TPixel>(bottom, j) = 255;
+			for (int i = top + 2; i <= bottom; ++i) img.at<TPixel>(i, left) = 255;
+
+			if (bottom - top >= 4 && right - left >= 4)
+				img.at<TPixel>(top + 2, left + 1) = 255;
+		}
+
+		return img;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	TImage SnakeImage(int rows, int cols)
+	{
+		THROW_IF(rows < 1 || cols < 1, "SnakeImage : Wrong image parameters");
+
+		TImage img = TImage::zeros(rows, cols, CV_8UC1);
+
+		for (int i = 0; i < rows; ++i)
+		{
+			if (i % 2 == 0)
+				for (int j = 0; j < cols; ++j) img.at<TPixel>(i, j) = 255;
+			else
+				img.at<TPixel>(i, i % 4 == 1 ? cols - 1 : 0) = 255;
+		}
+
+		return img;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	TImage SnakeImage3D(int rows, int cols, int planes)
+	{
+		THROW_IF(rows < 1 || cols < 1 || planes < 1, "SnakeImage3D : Wrong image parameters");
+
+		int sz[] = { rows, cols, planes };
+		TImage img = TImage::zeros(3, sz, CV_8UC1);
+		TImage snake = SnakeImage(rows, cols);
+
+		for (int k = 0; k < planes; ++k)
+		{
+			if (k % 2 == 0)
+			{
+				for (int i = 0; i < rows; ++i)
+					for (int j = 0; j < cols; ++j)
+						img.at<TPixel>(i, j, k) = snake.at<TPixel>(i, j);
+			}
+			else
+			{
+				img.at<TPixel>(0, 0, k) = 255;
+			}
+		}
+
+		return img;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	TImage CheckerboardImage(int rows, int cols, int cell)
+	{
+		THROW_IF(rows < 1 || cols < 1 || cell < 1, "CheckerboardImage : Wrong image parameters");
+
+		TImage img(rows, cols, CV_8UC1);
+
+		for (int i = 0; i < rows; ++i)
+			for (int j = 0; j < cols; ++j)
+				img.at<TPixel>(i, j) = (i / cell + j / cell) % 2 ? 0 : 255;
+
+		return img;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+} /* LabelingTools */
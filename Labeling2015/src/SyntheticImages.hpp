@@ -0,0 +1,38 @@
+//Synthetic Images
+//Copyright (c) by Sergey Zavalishin 2010-2015
+//
+//Contains generators of reproducible binary images for labeling benchmarks.
+
+#ifndef SYNTHETIC_IMAGES_HPP_
+#define SYNTHETIC_IMAGES_HPP_
+
+#include "LabelingTools.hpp"
+
+///////////////////////////////////////////////////////////////////////////////
+
+namespace LabelingTools
+{
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Synthetic images (CV_8UC1, 0 for background and 255 for objects)
+	// 3D images have {rows, cols, planes} size like the ones read from slices
+	///////////////////////////////////////////////////////////////////////////////
+
+	// Image split into granularity x granularity blocks, each block is an object with 
+	// density probability (granularity 1 gives plain noise)
+	TImage RandomImage(int rows, int cols, float density, int granularity, uint seed);
+	TImage RandomImage3D(int rows, int cols, int planes, float density, int granularity, uint seed);
+
+	// Single one pixel wide square spiral with one pixel gaps, longest propagation path for iterative algorithms
+	TImage SpiralImage(int rows, int cols);
+
+	// Single object made of filled even rows joined at alternating ends
+	TImage SnakeImage(int rows, int cols);
+	TImage SnakeImage3D(int rows, int cols, int planes); // Snakes on even planes joined at the origin
+
+	// Checkerboard of cell x cell squares, every cell is a separate object for 4-coherence
+	TImage CheckerboardImage(int rows, int cols, int cell = 1);
+
+} /* LabelingTools */
+
+#endif /* SYNTHETIC_IMAGES_HPP_ */
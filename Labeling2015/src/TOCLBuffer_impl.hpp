@@ -12,11 +12,16 @@ namespace LabelingTools
 {
 
 	template<typename T>
-		TOCLBuffer<T>::TOCLBuffer(const IOCLLabeling &ownerClass, TOCLBufferType bufType, size_t dataSize)
+		TOCLBuffer<T>::TOCLBuffer(const IOCLLabeling &ownerClass, TOCLBufferType bufType, size_t dataSize,
+								  TOCLBufferMemory memoryType)
 			: owner(ownerClass),
-			  hostBuf(dataSize),
+			  hostBuf(memoryType == TOCLBufferMemory::DEVICE_MEMORY ? dataSize : 0),
 			  wantUpdate(true),
+			  isInitialized(false),
 			  size(dataSize),
+			  capacity(0),
+			  memType(memoryType),
+			  mapped(NULL),
 			  buffer(deviceBuf)
 		{
 			memFlags =
@@ -24,10 +29,14 @@ namespace LabelingTools
 				bufType == WRITE_ONLY ? CL_MEM_WRITE_ONLY :
 				/* default */			CL_MEM_READ_WRITE;
 
+			if (memType == TOCLBufferMemory::HOST_MEMORY)
+				memFlags |= CL_MEM_ALLOC_HOST_PTR;
+
 			CreateDeviceBuffer();
 		}
 
 	///////////////////////////////////////////////////////////////////////////////
+
 		
 	template<typename T>
 		TOCLBuffer<T>::~TOCLBuffer(void)
@@ -40,7 +49,7 @@ namespace LabelingTools
 	template<typename T>
 		void TOCLBuffer<T>::Push(void)
 		{
-			if (wantUpdate)
+			if (memType == TOCLBufferMemory::DEVICE_MEMORY && wantUpdate)
 				UpdateDeviceBuffer();
 		}
 
@@ -49,7 +58,103 @@ namespace LabelingTools
 	template<typename T>
 		void TOCLBuffer<T>::Pull(void)
 		{
-			UpdateHostBuffer();
+			if (memType == TOCLBufferMemory::DEVICE_MEMORY)
+				UpdateHostBuffer();
+		}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	template<typename T>
+		void TOCLBuffer<T>::PushAsync(cl_command_queue queue, cl_uint numWaitEvents, const cl_event *waitEvents, cl_event *event)
+		{
+			// Pre Conditions
+			if (memType != TOCLBufferMemory::DEVICE_MEMORY)
+				throw(std::exception("TOCLBuffer::PushAsync : Only device memory buffers can be pushed"));
+			if (!owner.Initialized)
+				throw(std::exception("TOCLBuffer::PushAsync : Buffer owner is not initialized"));
+			if (size != hostBuf.size())
+				ResizeDeviceBuffer(hostBuf.size());
+
+			// Actual Code
+			clErrorContext = clEnqueueWriteBuffer(queue, deviceBuf, CL_FALSE, 0, size * sizeof(T), &hostBuf[0], 
+				numWaitEvents, waitEvents, event);
+
+			// Post Conditions
+			THROW_IF_OCL(clErrorContext, "TOCLBuffer::PushAsync")
+
+			wantUpdate = false;
+		}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	template<typename T>
+		void TOCLBuffer<T>::PullAsync(cl_command_queue queue, cl_uint numWaitEvents, const cl_event *waitEvents, cl_event *event)
+		{
+			// Pre Conditions
+			if (memType != TOCLBufferMemory::DEVICE_MEMORY)
+				throw(std::exception("TOCLBuffer::PullAsync : Only device memory buffers can be pulled"));
+			if (!owner.Initialized)
+				throw(std::exception("TOCLBuffer::PullAsync : Buffer owner is not initialized"));
+			if (size != hostBuf.size())
+				ResizeDeviceBuffer(hostBuf.size());
+
+			// Actual Code
+			clErrorContext = clEnqueueReadBuffer(queue, deviceBuf, CL_FALSE, 0, size * sizeof(T), &hostBuf[0], 
+				numWaitEvents, waitEvents, event);
+
+			// Post Conditions
+			THROW_IF_OCL(clErrorContext, "TOCLBuffer::PullAsync")
+		}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	template<typename T>
+		T* TOCLBuffer<T>::Map(cl_map_flags flags)
+		{
+			// Pre Conditions
+			if (!owner.Initialized)
+				throw(std::exception("TOCLBuffer::Map : Buffer owner is not initialized"));
+			if (!isInitialized)
+				CreateDeviceBuffer();
+
+			Unmap();
+
+			// Actual Code
+			mapped = (T*)clEnqueueMapBuffer(owner.State.queue, deviceBuf, CL_TRUE, flags, 0, 
+				size * sizeof(T), 0, NULL, NULL, &clErrorContext);
+
+			// Post Conditions
+			THROW_IF_OCL(clErrorContext, "TOCLBuffer::Map")
+
+			return mapped;
+		}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	template<typename T>
+		void TOCLBuffer<T>::Unmap(void)
+		{
+			// Pre Conditions
+			if (!mapped)
+				return;
+
+			// Actual Code
+			clErrorContext = clEnqueueUnmapMemObject(owner.State.queue, deviceBuf, mapped, 0, NULL, NULL);
+			mapped = NULL;
+
+			// Post Conditions
+			THROW_IF_OCL(clErrorContext, "TOCLBuffer::Unmap")
+		}
+
+	///////////////////////////////////////////////////////////////////////////////
+
+	template<typename T>
+		void TOCLBuffer<T>::Resize(size_t dataSize)
+		{
+			if (memType == TOCLBufferMemory::DEVICE_MEMORY)
+				hostBuf.resize(dataSize);
+
+			ResizeDeviceBuffer(dataSize);
 		}
 
 	///////////////////////////////////////////////////////////////////////////////
@@ -74,11 +179,11 @@ namespace LabelingTools
 			if (!isInitialized)
 				CreateDeviceBuffer();			
 			if (size != hostBuf.size())
-				ResizeDeviceBuffer();
+				ResizeDeviceBuffer(hostBuf.size());
 
 			// Actual Code
 			clErrorContext = clEnqueueWriteBuffer(owner.State.queue, deviceBuf, CL_TRUE, 0,
-				size * sizeof(T), &hostBuf[0], 0, NULL, NULL);
+				size * sizeof(T), &hostBuf[0], 0, NULL, owner.ProfileEvent("HostToDevice", size * sizeof(T)));
 
 
 			// Post Conditions
@@ -96,11 +201,11 @@ namespace LabelingTools
 			if (!isInitialized)
 				CreateDeviceBuffer();
 			if (size != hostBuf.size())
-				ResizeDeviceBuffer();
+				ResizeDeviceBuffer(hostBuf.size());
 
 			// Actual Code
 			clErrorContext = clEnqueueReadBuffer(owner.State.queue, deviceBuf, CL_TRUE, 0,
-				size * sizeof(T), &hostBuf[0], 0, NULL, NULL);
+				size * sizeof(T), &hostBuf[0], 0, NULL, owner.ProfileEvent("DeviceToHost", size * sizeof(T)));
 
 			// Post Conditions
 			THROW_IF_OCL(clErrorContext, "TOCLBuffer::UpdateHostBuffer")
@@ -116,9 +221,9 @@ namespace LabelingTools
 				throw(std::exception("TOCLBuffer::UpdateHostBuffer : Buffer owner is not initialized"));
 
 			// Actual Code
-			size = hostBuf.size();
+			capacity = size;
 
-			deviceBuf = clCreateBuffer(owner.State.context, memFlags, size * sizeof(T),
+			deviceBuf = clCreateBuffer(owner.State.context, memFlags, capacity * sizeof(T),
 				NULL, &clErrorContext);
 			
 			THROW_IF_OCL(clErrorContext, "TOCLBuffer::CreateDeviceBuffer")
@@ -138,7 +243,10 @@ namespace LabelingTools
 				return;
 
 			// Actual Code
+			Unmap();
+
 			clErrorContext = clReleaseMemObject(deviceBuf);
+			isInitialized = false;
 
 			THROW_IF_OCL(clErrorContext, "TOCLBuffer::DeleteDeviceBuffer")
 		}
@@ -146,17 +254,21 @@ namespace LabelingTools
 	///////////////////////////////////////////////////////////////////////////////
 
 	template<typename T>
-		void TOCLBuffer<T>::ResizeDeviceBuffer(void)
+		void TOCLBuffer<T>::ResizeDeviceBuffer(size_t dataSize)
 		{			
 			// Pre Conditions
-			if (!isInitialized)		 
-				CreateDeviceBuffer();
 			if (!owner.Initialized)
 				throw(std::exception("TOCLBuffer::ResizeDeviceBuffer : Buffer owner is not initialized"));
 
 			// Actual Code
-			DeleteDeviceBuffer();
-			CreateDeviceBuffer();
+			if (isInitialized && dataSize > capacity)
+				DeleteDeviceBuffer();
+
+			Unmap(); // Mapped region is of the old size
+			size = dataSize; // Device buffer never shrinks, only its used part does
+
+			if (!isInitialized)
+				CreateDeviceBuffer();
 
 			// Post Conditions
 			wantUpdate = true;			
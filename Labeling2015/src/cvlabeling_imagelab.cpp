@@ -21,7 +21,146 @@
 #include "cvlabeling_imagelab.h"
 #include <opencv/cxmisc.h>
 #include "stopwatch_win.h""
-static void /*CvStatus*/ icvLabelImage (IplImage* srcImage, IplImage* dstImage, unsigned char byF, int *numLabels);
+#include <omp.h>
+
+// equivalence classes kept as linked lists, aRTable always holds the class 
+// representative, merging rewrites every element of the bigger class
+class CvLinkedClasses {
+public:
+	int *aRTable, *aNext, *aTail;
+
+	// aBuffer holds 3*nLabels ints or is allocated here if NULL
+	CvLinkedClasses (int nLabels, int *aBuffer) : aOwnBuffer(aBuffer ? NULL : new int[3*nLabels]) {
+		aRTable = aBuffer ? aBuffer : aOwnBuffer;
+		aNext = aRTable + nLabels;
+		aTail = aNext + nLabels;
+	}
+	~CvLinkedClasses () { delete[] aOwnBuffer; }
+
+	inline void NewLabel (int lx) {
+		aRTable[lx] = lx;
+		aNext[lx] = -1;
+		aTail[lx] = lx;
+	}
+	inline int Find (int lx) { return aRTable[lx]; }
+	inline int Root (int lx) const { return aRTable[lx]; }
+	// merges two classes given by their representatives, returns the new one
+	inline int Merge (int u, int v) {
+		if (u>v) {
+			int t = u; u = v; v = t;
+		}
+		if (u<v) {
+			int i = v;
+			while (i>-1) {
+				aRTable[i] = u;
+				i = aNext[i];
+			}
+			aNext[aTail[u]] = v;
+			aTail[u] = aTail[v];
+		}
+		return u;
+	}
+	// lists are not needed anymore once all classes are merged
+	inline int* Numbers (void) { return aNext; }
+
+private:
+	int *aOwnBuffer;
+};
+
+// equivalence classes kept as union-find forest with path halving in Find, 
+// aRTable holds parents and the smaller root always becomes the parent
+class CvUnionFindClasses {
+public:
+	int *aRTable, *aNumbers;
+
+	// aBuffer holds 2*nLabels ints or is allocated here if NULL
+	CvUnionFindClasses (int nLabels, int *aBuffer) : aOwnBuffer(aBuffer ? NULL : new int[2*nLabels]) {
+		aRTable = aBuffer ? aBuffer : aOwnBuffer;
+		aNumbers = aRTable + nLabels;
+	}
+	~CvUnionFindClasses () { delete[] aOwnBuffer; }
+
+	inline void NewLabel (int lx) { aRTable[lx] = lx; }
+	inline int Find (int lx) {
+		while (aRTable[lx]!=lx) {
+			aRTable[lx] = aRTable[aRTable[lx]];
+			lx = aRTable[lx];
+		}
+		return lx;
+	}
+	inline int Root (int lx) const {
+		while (aRTable[lx]!=lx)
+			lx = aRTable[lx];
+		return lx;
+	}
+	inline int Merge (int u, int v) {
+		u = Find(u);
+		v = Find(v);
+		if (u<v) {
+			aRTable[v] = u;
+			return u;
+		}
+		aRTable[u] = v;
+		return v;
+	}
+	inline int* Numbers (void) { return aNumbers; }
+
+private:
+	int *aOwnBuffer;
+};
+
+// byte image, pixels equal to byF are foreground
+class CvByteImage {
+public:
+	CvByteImage (const unsigned char *img, int ws, unsigned char byF) : img(img), ws(ws), byF(byF) {}
+
+	inline bool operator() (int x, int y) const { return img[x+y*ws]==byF; }
+	// pixels of block (x,y) as bits 0 (x,y), 1 (x+1,y), 2 (x,y+1) and 3 (x+1,y+1)
+	inline int Block (int x, int y, int w, int h) const {
+		int iBlock = (*this)(x,y);
+		if (x+1<w)
+			iBlock |= (*this)(x+1,y)<<1;
+		if (y+1<h) {
+			iBlock |= (*this)(x,y+1)<<2;
+			if (x+1<w)
+				iBlock |= (*this)(x+1,y+1)<<3;
+		}
+		return iBlock;
+	}
+	inline CvByteImage Rows (int y0) const { return CvByteImage(img+y0*ws, ws, byF); }
+
+private:
+	const unsigned char *img;
+	int ws;
+	unsigned char byF;
+};
+
+// bit packed image, pixel x of a row is bit x%64 of its word x/64 and bits 
+// past the image width are zero. Blocks start at even x, so both columns of 
+// a block come from the same word with a single shift
+class CvBitImage {
+public:
+	CvBitImage (const uint64 *bits, int wpr) : bits(bits), wpr(wpr) {}
+
+	inline bool operator() (int x, int y) const { return (bits[(x>>6)+y*wpr] >> (x&63)) & 1; }
+	inline int Block (int x, int y, int w, int h) const {
+		int iBlock = (int)(bits[(x>>6)+y*wpr] >> (x&63)) & 3;
+		if (y+1<h)
+			iBlock |= ((int)(bits[(x>>6)+(y+1)*wpr] >> (x&63)) & 3) << 2;
+		return iBlock;
+	}
+	inline CvBitImage Rows (int y0) const { return CvBitImage(bits+y0*wpr, wpr); }
+
+private:
+	const uint64 *bits;
+	int wpr;
+};
+
+template <typename TClasses, typename TSrc>
+static void /*CvStatus*/ icvLabelImage (const TSrc &img, int w, int h, IplImage* dstImage, int *numLabels, int nBands, int *aBuffer, CvLabelingRowsDone rowsDone = NULL, void *userData = NULL);
+template <typename TClasses, typename TSrc>
+static int icvLabelBand (const TSrc &img, char *imgOut, int w, int h, int wd, int iNewLabel, TClasses &eq);
+static int icvBandCount (int h);
 
 // fast block based labeling with decision tree optimization
 //
@@ -40,43 +179,184 @@ cvLabelingImageLab (IplImage* srcImage, IplImage* dstImage, unsigned char byFore
     if( srcImage->width!=dstImage->width || srcImage->height!=dstImage->height)
         CV_ERROR( CV_StsUnmatchedSizes, "The source and the destination images must be of the same size" );*/
     
-	/*IPPI_CALL(*/ icvLabelImage(srcImage, dstImage, byForeground, numLabels);//);
+	/*IPPI_CALL(*/ icvLabelImage<CvLinkedClasses>(CvByteImage((unsigned char *)srcImage->imageData, srcImage->widthStep, byForeground), 
+												  srcImage->width, srcImage->height, dstImage, numLabels, 1, NULL);//);
 	
     //__END__;
 	//exit:
 }
 
+// multi-threaded version of cvLabelingImageLab
+//
+// every OpenMP thread labels its own band of block rows, bands are merged 
+// along their top rows and the second scan runs in parallel
+CV_IMPL  void
+cvLabelingImageLabParallel (IplImage* srcImage, IplImage* dstImage, unsigned char byForeground, int *numLabels, int useUnionFind, int *aBuffer, CvLabelingRowsDone rowsDone, void *userData) {
+	CvByteImage img((unsigned char *)srcImage->imageData, srcImage->widthStep, byForeground);
+	int w(srcImage->width), h(srcImage->height);
 
-static void/*CvStatus*/ icvLabelImage (IplImage* srcImage, IplImage* dstImage, unsigned char byF, int *numLabels) {
-	int w(srcImage->width),h(srcImage->height),ws(srcImage->widthStep),wd(dstImage->widthStep);
+	if (useUnionFind)
+		icvLabelImage<CvUnionFindClasses>(img, w, h, dstImage, numLabels, icvBandCount(h), aBuffer, rowsDone, userData);
+	else
+		icvLabelImage<CvLinkedClasses>(img, w, h, dstImage, numLabels, icvBandCount(h), aBuffer, rowsDone, userData);
+}
 
-	int iNewLabel(0);
-	int *aRTable = new int[w*h/4];
-	int *aNext = new int[w*h/4];
-	int *aTail = new int[w*h/4];
+// cvLabelingImageLabParallel for bit packed binary image of dstImage size
+CV_IMPL  void
+cvLabelingImageLabPacked (const uint64 *bits, int wordsPerRow, IplImage* dstImage, int *numLabels, int useUnionFind, int *aBuffer, CvLabelingRowsDone rowsDone, void *userData) {
+	CvBitImage img(bits, wordsPerRow);
+	int w(dstImage->width), h(dstImage->height);
+
+	if (useUnionFind)
+		icvLabelImage<CvUnionFindClasses>(img, w, h, dstImage, numLabels, icvBandCount(h), aBuffer, rowsDone, userData);
+	else
+		icvLabelImage<CvLinkedClasses>(img, w, h, dstImage, numLabels, icvBandCount(h), aBuffer, rowsDone, userData);
+}
+
+static int icvBandCount (int h) {
+	const int iMinBandHeight = 16; // block rows, smaller bands cost more on merging than they gain
 	
-	unsigned char *img = (unsigned char *)srcImage->imageData;
+	int nBands = ((h+1)/2) / iMinBandHeight;
+	if (nBands > omp_get_max_threads())
+		nBands = omp_get_max_threads();
+	if (nBands < 1)
+		nBands = 1;
+
+	return nBands;
+}
+
+// both equivalence policies fit in three ints per block label
+CV_IMPL  size_t
+cvLabelingImageLabBufferSize (int width, int height) {
+	return 3 * ((size_t)((width+1)/2) * ((height+1)/2) + 1);
+}
+
+#define INT_PTR(x) (*((int*)(&(x))))
+
+template <typename TClasses, typename TSrc>
+static void/*CvStatus*/ icvLabelImage (const TSrc &img, int w, int h, IplImage* dstImage, int *numLabels, int nBands, int *aBuffer, CvLabelingRowsDone rowsDone, void *userData) {
+	int wd(dstImage->widthStep);
+
+	int nBlockCols = (w+1)/2, nBlockRows = (h+1)/2;
+	TClasses eq(nBlockCols*nBlockRows+1, aBuffer);
+	int *aBandLast = new int[nBands]; // last label given in every band slice
+	int *aBandRoots = new int[nBands]; // first final label of every band
+
 	char *imgOut = (char *)dstImage->imageData;
+
+	// FIRST SCAN, every band gets its own slice of label tables
+#pragma omp parallel for schedule(dynamic)
+	for (int b=0; b<nBands; b++) {
+		int y0 = nBlockRows*b/nBands*2, y1 = nBlockRows*(b+1)/nBands*2;
+		if (y1 > h)
+			y1 = h;
+		aBandLast[b] = icvLabelBand(img.Rows(y0), imgOut+y0*wd, w, y1-y0, wd, y0/2*nBlockCols, eq);
+	}
+
+	// Unisco le bande: pixels of band top row against pixels of upper band bottom row
+	for (int b=1; b<nBands; b++) {
+		int y = nBlockRows*b/nBands*2;
+		for (int x=0; x<w; x++) {
+			if (!img(x,y))
+				continue;
+			int lx = INT_PTR(imgOut[(x&~1)*4+y*wd]);
+			for (int xx=x-1; xx<=x+1; xx++) {
+				if (xx>=0 && xx<w && img(xx,y-1))
+					eq.Merge(eq.Find(lx), eq.Find(INT_PTR(imgOut[(xx&~1)*4+(y-2)*wd])));
+			}
+		}
+	}
+
+	// Rinumero le label: roots are counted per band, then every label gets 
+	// the number of its root
+	int *aNumbers = eq.Numbers();
+#pragma omp parallel for schedule(dynamic)
+	for (int b=0; b<nBands; b++) {
+		int iCount = 0;
+		for (int k=nBlockRows*b/nBands*nBlockCols+1; k<=aBandLast[b]; k++)
+			iCount += eq.Root(k)==k;
+		aBandRoots[b] = iCount;
+	}
+	int iCurLabel = 0;
+	for (int b=0; b<nBands; b++) {
+		int iCount = aBandRoots[b];
+		aBandRoots[b] = iCurLabel;
+		iCurLabel += iCount;
+	}
+#pragma omp parallel for schedule(dynamic)
+	for (int b=0; b<nBands; b++) {
+		int iLabel = aBandRoots[b];
+		for (int k=nBlockRows*b/nBands*nBlockCols+1; k<=aBandLast[b]; k++) {
+			if (eq.Root(k)==k)
+				aNumbers[k] = ++iLabel;
+		}
+	}
+#pragma omp parallel for schedule(dynamic)
+	for (int b=0; b<nBands; b++) {
+		for (int k=nBlockRows*b/nBands*nBlockCols+1; k<=aBandLast[b]; k++) {
+			int iRoot = eq.Root(k);
+			if (iRoot!=k)
+				aNumbers[k] = aNumbers[iRoot];
+		}
+	}
+
+	// SECOND SCAN 
+#pragma omp parallel for
+	for(int y=0;y<h;y+=2) {
+		for(int x=0;x<w;x+=2) {
+			int iLabel = INT_PTR(imgOut[x*4+y*wd]) ;
+			int iBlock = 0; // foreground pixels of the block
+			if (iLabel>0) {
+				iLabel = aNumbers[iLabel];
+				iBlock = img.Block(x, y, w, h);
+			}
+			INT_PTR(imgOut[x*4+y*wd]) = iBlock&1 ? iLabel : 0;
+			if (x+1<w)
+				INT_PTR(imgOut[(x+1)*4+y*wd]) = iBlock&2 ? iLabel : 0;
+			if (y+1<h) {
+				INT_PTR(imgOut[(x)*4+(y+1)*wd]) = iBlock&4 ? iLabel : 0;
+				if (x+1<w)
+					INT_PTR(imgOut[(x+1)*4+(y+1)*wd]) = iBlock&8 ? iLabel : 0;
+			}
+		}
+		if (rowsDone)
+			rowsDone(dstImage, y, y+2<h ? y+2 : h, userData);
+	}
+
+	// output the number of labels
+	*numLabels = iCurLabel;
 	
+	delete[] aBandLast;
+	delete[] aBandRoots;
+
+	//return CV_OK;
+}
+
+// FIRST SCAN of a single band, img and imgOut point to the band top row
+//
+// labels are given starting from iNewLabel+1, returns the last given label
+template <typename TClasses, typename TSrc>
+static int icvLabelBand (const TSrc &img, char *imgOut, int w, int h, int wd, int iNewLabel, TClasses &eq) {
+
 	for(int y=0; y<h; y+=2) {
 		for(int x=0; x<w; x+=2) {
 
-#define condition_a x-1>=0 && y-2>=0 && img[x-1+(y-2)*ws]==byF
-#define condition_b y-2>=0 && img[x+(y-2)*ws]==byF
-#define condition_c x+1<w && y-2>=0 && img[x+1+(y-2)*ws]==byF
-#define condition_d x+2<w && y-2>=0 && img[x+2+(y-2)*ws]==byF
-#define condition_e x-2>=0 && y-1>=0 && img[x-2+(y-1)*ws]==byF
-#define condition_f x-1>=0 && y-1>=0 && img[x-1+(y-1)*ws]==byF
-#define condition_g y-1>=0 && img[x+(y-1)*ws]==byF
-#define condition_h x+1<w && y-1>=0 && img[x+1+(y-1)*ws]==byF
-#define condition_i x+2<w && y-1>=0 && img[x+2+(y-1)*ws]==byF
-#define condition_j x-2>=0 && img[x-2+(y)*ws]==byF
-#define condition_k x-1>=0 && img[x-1+(y)*ws]==byF
-#define condition_l img[x+(y)*ws]==byF
-#define condition_m x+1<w && img[x+1+(y)*ws]==byF
-#define condition_n x-1>=0 && y+1<h && img[x-1+(y+1)*ws]==byF
-#define condition_o y+1<h && img[x+(y+1)*ws]==byF
-#define condition_p x+1<w && y+1<h && img[x+1+(y+1)*ws]==byF
+#define condition_a x-1>=0 && y-2>=0 && img(x-1,y-2)
+#define condition_b y-2>=0 && img(x,y-2)
+#define condition_c x+1<w && y-2>=0 && img(x+1,y-2)
+#define condition_d x+2<w && y-2>=0 && img(x+2,y-2)
+#define condition_e x-2>=0 && y-1>=0 && img(x-2,y-1)
+#define condition_f x-1>=0 && y-1>=0 && img(x-1,y-1)
+#define condition_g y-1>=0 && img(x,y-1)
+#define condition_h x+1<w && y-1>=0 && img(x+1,y-1)
+#define condition_i x+2<w && y-1>=0 && img(x+2,y-1)
+#define condition_j x-2>=0 && img(x-2,y)
+#define condition_k x-1>=0 && img(x-1,y)
+#define condition_l img(x,y)
+#define condition_m x+1<w && img(x+1,y)
+#define condition_n x-1>=0 && y+1<h && img(x-1,y+1)
+#define condition_o y+1<h && img(x,y+1)
+#define condition_p x+1<w && y+1<h && img(x+1,y+1)
 
 			if (condition_l) {
 				if (condition_k) {
@@ -1352,14 +1632,10 @@ static void/*CvStatus*/ icvLabelImage (IplImage* srcImage, IplImage* dstImage, u
 
 			int lx,u,v,k;
 
-#define INT_PTR(x) (*((int*)(&(x))))
-
 action_1:	lx = 0;
 			goto fine;
 action_2:	lx = ++iNewLabel;
-			aRTable[lx] = lx;
-			aNext[lx] = -1;
-			aTail[lx] = lx;
+			eq.NewLabel(lx);
 			goto fine;
 action_3:	lx = INT_PTR(imgOut[(x+2)*4+(y-2)*wd]);
 			goto fine;
@@ -1370,148 +1646,50 @@ action_5:	lx = INT_PTR(imgOut[(x-2)*4+(y-2)*wd]);
 action_6:	lx = INT_PTR(imgOut[(x-2)*4+(y)*wd]);
 			goto fine;
 action_7:	lx = INT_PTR(imgOut[(x)*4+(y-2)*wd]);
-			u = aRTable[lx];
-			v = aRTable[INT_PTR(imgOut[(x+2)*4+(y-2)*wd])];
+			u = eq.Find(lx);
+			v = eq.Find(INT_PTR(imgOut[(x+2)*4+(y-2)*wd]));
 			goto merge2;
 action_8:	lx = INT_PTR(imgOut[(x-2)*4+(y-2)*wd]);
-			u = aRTable[lx];
-			v = aRTable[INT_PTR(imgOut[(x+2)*4+(y-2)*wd])];
+			u = eq.Find(lx);
+			v = eq.Find(INT_PTR(imgOut[(x+2)*4+(y-2)*wd]));
 			goto merge2;
 action_9:	lx = INT_PTR(imgOut[(x-2)*4+(y-2)*wd]);
-			u = aRTable[lx];
-			v = aRTable[INT_PTR(imgOut[(x)*4+(y-2)*wd])];
+			u = eq.Find(lx);
+			v = eq.Find(INT_PTR(imgOut[(x)*4+(y-2)*wd]));
 			goto merge2;
 action_10:	lx = INT_PTR(imgOut[(x-2)*4+(y)*wd]);
-			u = aRTable[lx];
-			v = aRTable[INT_PTR(imgOut[(x+2)*4+(y-2)*wd])];
+			u = eq.Find(lx);
+			v = eq.Find(INT_PTR(imgOut[(x+2)*4+(y-2)*wd]));
 			goto merge2;
 action_11:	lx = INT_PTR(imgOut[(x-2)*4+(y)*wd]);
-			u = aRTable[lx];
-			v = aRTable[INT_PTR(imgOut[(x)*4+(y-2)*wd])];
+			u = eq.Find(lx);
+			v = eq.Find(INT_PTR(imgOut[(x)*4+(y-2)*wd]));
 			goto merge2;
 action_12:	lx = INT_PTR(imgOut[(x-2)*4+(y)*wd]);
-			u = aRTable[lx];
-			v = aRTable[INT_PTR(imgOut[(x-2)*4+(y-2)*wd])];
+			u = eq.Find(lx);
+			v = eq.Find(INT_PTR(imgOut[(x-2)*4+(y-2)*wd]));
 			goto merge2;
 action_13:	lx = INT_PTR(imgOut[(x-2)*4+(y)*wd]);
-			u = aRTable[lx];
-			v = aRTable[INT_PTR(imgOut[(x)*4+(y-2)*wd])];
-			//k = aRTable[imgOut[(x+2)*4+(y-2)*wd]];
+			u = eq.Find(lx);
+			v = eq.Find(INT_PTR(imgOut[(x)*4+(y-2)*wd]));
 			k = INT_PTR(imgOut[(x+2)*4+(y-2)*wd]);
 			goto merge3;
 action_14:	lx = INT_PTR(imgOut[(x-2)*4+(y)*wd]);
-			u = aRTable[lx];
-			v = aRTable[INT_PTR(imgOut[(x-2)*4+(y-2)*wd])];
-			//k = aRTable[imgOut[(x+2)*4+(y-2)*wd]];
+			u = eq.Find(lx);
+			v = eq.Find(INT_PTR(imgOut[(x-2)*4+(y-2)*wd]));
 			k = INT_PTR(imgOut[(x+2)*4+(y-2)*wd]);
 			goto merge3;
 action_15:	lx = INT_PTR(imgOut[(x-2)*4+(y)*wd]);
-			u = aRTable[lx];
-			v = aRTable[INT_PTR(imgOut[(x-2)*4+(y-2)*wd])];
-			//k = aRTable[imgOut[(x)*4+(y-2)*wd]];
+			u = eq.Find(lx);
+			v = eq.Find(INT_PTR(imgOut[(x-2)*4+(y-2)*wd]));
 			k = INT_PTR(imgOut[(x)*4+(y-2)*wd]);
 			//goto merge3;
 
-merge3:		if (u<v) {
-				int i = v;
-				while (i>-1) {
-					aRTable[i] = u;
-					i = aNext[i];
-				}
-				aNext[aTail[u]] = v;
-				aTail[u] = aTail[v];
-
-				k = aRTable[k];
-				if (u<k) {
-					int i = k;
-					while (i>-1) {
-						aRTable[i] = u;
-						i = aNext[i];
-					}
-					aNext[aTail[u]] = k;
-					aTail[u] = aTail[k];
-				}
-				else if (u>k) {
-					int i = u;
-					while (i>-1) {
-						aRTable[i] = k;
-						i = aNext[i];
-					}
-					aNext[aTail[k]] = u;
-					aTail[k] = aTail[u];
-				}
-			}
-			else if (u>v) {
-				int i = u;
-				while (i>-1) {
-					aRTable[i] = v;
-					i = aNext[i];
-				}
-				aNext[aTail[v]] = u;
-				aTail[v] = aTail[u];
-
-				k = aRTable[k];
-				if (v<k) {
-					int i = k;
-					while (i>-1) {
-						aRTable[i] = v;
-						i = aNext[i];
-					}
-					aNext[aTail[v]] = k;
-					aTail[v] = aTail[k];
-				}
-				else if (v>k) {
-					int i = v;
-					while (i>-1) {
-						aRTable[i] = k;
-						i = aNext[i];
-					}
-					aNext[aTail[k]] = v;
-					aTail[k] = aTail[v];
-				}
-			}
-			else {
-				k = aRTable[k];
-				if (u<k) {
-					int i = k;
-					while (i>-1) {
-						aRTable[i] = u;
-						i = aNext[i];
-					}
-					aNext[aTail[u]] = k;
-					aTail[u] = aTail[k];
-				}
-				else if (u>k) {
-					int i = u;
-					while (i>-1) {
-						aRTable[i] = k;
-						i = aNext[i];
-					}
-					aNext[aTail[k]] = u;
-					aTail[k] = aTail[u];
-				}
-			}
-
+merge3:		u = eq.Merge(u, v);
+			eq.Merge(u, eq.Find(k));
 			goto fine;
 
-merge2:		if (u<v) {
-				 int i = v;
-				 while (i>-1) {
-					 aRTable[i] = u;
-					 i = aNext[i];
-				 }
-				 aNext[aTail[u]] = v;
-				 aTail[u] = aTail[v];
-			}
-			else if (u>v) {
-				 int i = u;
-				 while (i>-1) {
-					 aRTable[i] = v;
-					 i = aNext[i];
-				 }
-				 aNext[aTail[v]] = u;
-				 aTail[v] = aTail[u];
-			}
+merge2:		eq.Merge(u, v);
 			//goto fine;
 //fine:		memset(imgOut+x*4+y*wd,lx,sizeof(int));
 fine:		INT_PTR(imgOut[x*4+y*wd]) = lx;
@@ -1519,72 +1697,5 @@ fine:		INT_PTR(imgOut[x*4+y*wd]) = lx;
 		}
 	}
 
-	// Rinumero le label
-	int iCurLabel = 0;
-	for (int k=1;k<=iNewLabel;k++) {
-		if (aRTable[k]==k) {
-			iCurLabel++;
-			aRTable[k] = iCurLabel;
-		}
-		else
-			aRTable[k] = aRTable[aRTable[k]];
-	}
-
-	// SECOND SCAN 
-	for(int y=0;y<h;y+=2) {
-		for(int x=0;x<w;x+=2) {
-			int iLabel = INT_PTR(imgOut[x*4+y*wd]) ;
-			if (iLabel>0) {
-				iLabel = aRTable[iLabel];
-				if (img[x+y*ws]==byF)
-					INT_PTR(imgOut[x*4+y*wd]) = iLabel;
-				else
-					INT_PTR(imgOut[x*4+y*wd]) = 0;
-				if (x+1<w) {
-					if (img[x+1+y*ws]==byF)
-						INT_PTR(imgOut[(x+1)*4+y*wd]) = iLabel;
-					else
-						INT_PTR(imgOut[(x+1)*4+y*wd]) = 0;
-					if (y+1<h) {
-						if (img[x+(y+1)*ws]==byF)
-							INT_PTR(imgOut[(x)*4+(y+1)*wd]) = iLabel;
-						else
-							INT_PTR(imgOut[(x)*4+(y+1)*wd]) = 0;
-						if (img[x+1+(y+1)*ws]==byF)
-							INT_PTR(imgOut[(x+1)*4+(y+1)*wd]) = iLabel;
-						else
-							INT_PTR(imgOut[(x+1)*4+(y+1)*wd]) = 0;
-					}
-				}
-				else if (y+1<h) {
-					if (img[x+(y+1)*ws]==byF)
-						INT_PTR(imgOut[(x)*4+(y+1)*wd]) = iLabel;
-					else
-						INT_PTR(imgOut[(x)*4+(y+1)*wd]) = 0;
-				}
-			}
-			else {
-				INT_PTR(imgOut[(x)*4+(y)*wd]) = 0;
-				if (x+1<w) {
-					INT_PTR(imgOut[(x+1)*4+y*wd]) = 0;
-					if (y+1<h) {
-						INT_PTR(imgOut[(x)*4+(y+1)*wd]) = 0;
-						INT_PTR(imgOut[(x+1)*4+(y+1)*wd]) = 0;
-					}
-				}
-				else if (y+1<h) {
-					INT_PTR(imgOut[(x)*4+(y+1)*wd]) = 0;
-				}
-			}
-		}
-	}
-
-	// output the number of labels
-	*numLabels = iCurLabel;
-	
-	delete aRTable;
-	delete aNext;
-	delete aTail;
-
-	//return CV_OK;
+	return iNewLabel;
 }
\ No newline at end of file
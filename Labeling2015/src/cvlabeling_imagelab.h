@@ -29,4 +29,35 @@
 CVAPI(void) cvLabelingImageLab (IplImage* srcImage, IplImage* dstImage, 
 								unsigned char byForeground, int *numLabels);
 
+// called by the second scan every time final labels of rows [y0, y1) are 
+// written, calls come from several OpenMP threads at once
+typedef void (CV_CDECL *CvLabelingRowsDone)(IplImage* dstImage, int y0, int y1, void *userData);
+
+// multi-threaded block based labeling, image is split into bands of block 
+// rows processed by OpenMP threads
+//
+// src: single channel binary image of type IPL_DEPTH_8U 
+// dst: single channel label image of type IPL_DEPTH_32S
+// useUnionFind: resolve equivalences with union-find (path halving) 
+//               instead of Grana's linked lists
+// aBuffer: optional scratch memory of cvLabelingImageLabBufferSize ints, 
+//          allocated on every call if NULL
+// rowsDone: optional callback reading labels while they are in cache
+CVAPI(void) cvLabelingImageLabParallel (IplImage* srcImage, IplImage* dstImage, 
+										unsigned char byForeground, int *numLabels,
+										int useUnionFind CV_DEFAULT(0), int *aBuffer CV_DEFAULT(NULL),
+										CvLabelingRowsDone rowsDone CV_DEFAULT(NULL), void *userData CV_DEFAULT(NULL));
+
+// cvLabelingImageLabParallel for bit packed binary image, pixel x of row y is 
+// bit x%64 of word x/64+y*wordsPerRow, bits past the image width must be zero
+//
+// bits: binary image of dst size
+// dst: single channel label image of type IPL_DEPTH_32S
+CVAPI(void) cvLabelingImageLabPacked (const uint64 *bits, int wordsPerRow, IplImage* dstImage, 
+									  int *numLabels, int useUnionFind CV_DEFAULT(0), int *aBuffer CV_DEFAULT(NULL),
+									  CvLabelingRowsDone rowsDone CV_DEFAULT(NULL), void *userData CV_DEFAULT(NULL));
+
+// returns scratch memory size for cvLabelingImageLabParallel in ints
+CVAPI(size_t) cvLabelingImageLabBufferSize (int width, int height);
+
 #endif/*_CVLABELING_IMAGELAB_H_*/
\ No newline at end of file
@@ -1,15 +1,6 @@
 // includes, file
 #include "stopwatch_win.h"
 
-////////////////////////////////////////////////////////////////////////////////
-// Variables, static
-
-//! tick frequency
-/*static*/ double  StopWatchWin::freq;
-
-//! flag if the frequency has been set
-/*static*/  bool   StopWatchWin::freq_set;
-
 ////////////////////////////////////////////////////////////////////////////////
 //! Constructor, default
 ////////////////////////////////////////////////////////////////////////////////
@@ -21,20 +12,6 @@ StopWatchWin::StopWatchWin() :
     running( false),
     clock_sessions(0)
 {
-    if( ! freq_set) 
-    {
-        // helper variable
-        LARGE_INTEGER temp;
-
-        // get the tick frequency from the OS
-        QueryPerformanceFrequency((LARGE_INTEGER*) &temp);
-
-        // convert to type in which it is needed
-        freq = ((double) temp.QuadPart) / 1000.0;
-
-        // rememeber query
-        freq_set = true;
-    }
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -3,12 +3,10 @@
 #define _STOPWATCH_WIN_H_
 
 // includes, system
-#define WINDOWS_LEAN_AND_MEAN
-#include <windows.h>
-#undef min
-#undef max
+#include <chrono>
 
-//! Windows specific implementation of StopWatch
+//! Portable implementation of StopWatch on std::chrono::steady_clock,
+//! keeps its Windows name since it is used everywhere
 class StopWatchWin 
 {
 
@@ -43,10 +41,12 @@ private:
 
     // member variables
 
+    typedef std::chrono::steady_clock clock;
+
     //! Start of measurement
-    LARGE_INTEGER  start_time;
+    clock::time_point  start_time;
     //! End of measurement
-    LARGE_INTEGER  end_time;
+    clock::time_point  end_time;
 
     //! Time difference between the last start and stop
     float  diff_time;
@@ -61,11 +61,11 @@ private:
     //! and stopped to allow averaging
     int clock_sessions;
 
-    //! tick frequency
-    static double  freq;
-
-    //! flag if the frequency has been set
-    static  bool  freq_set;
+    //! Time in msec. between two points
+    static float elapsed(clock::time_point from, clock::time_point to)
+    {
+        return std::chrono::duration<float, std::milli>(to - from).count();
+    }
 };
 
 // functions, inlined
@@ -76,7 +76,7 @@ private:
 inline void
 StopWatchWin::start() 
 {
-    QueryPerformanceCounter((LARGE_INTEGER*) &start_time);
+    start_time = clock::now();
     running = true;
 }
 
@@ -87,9 +87,8 @@ StopWatchWin::start()
 inline void
 StopWatchWin::stop() 
 {
-    QueryPerformanceCounter((LARGE_INTEGER*) &end_time);
-    diff_time = (float) 
-        (((double) end_time.QuadPart - (double) start_time.QuadPart) / freq);
+    end_time = clock::now();
+    diff_time = elapsed(start_time, end_time);
 
     total_time += diff_time;
     clock_sessions++;
@@ -107,7 +106,7 @@ StopWatchWin::reset()
     total_time = 0;
     clock_sessions = 0;
     if( running )
-        QueryPerformanceCounter((LARGE_INTEGER*) &start_time);
+        start_time = clock::now();
 }
 
 
@@ -124,10 +123,7 @@ StopWatchWin::getTime() const
     float retval = total_time;
     if(running) 
     {
-        LARGE_INTEGER temp;
-        QueryPerformanceCounter((LARGE_INTEGER*) &temp);
-        retval += (float) 
-            (((double) (temp.QuadPart - start_time.QuadPart)) / freq);
+        retval += elapsed(start_time, clock::now());
     }
 
     return retval;